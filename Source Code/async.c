@@ -0,0 +1,515 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements loading and saving knowledge files in the
+ * background, so that the chatbot keeps answering while a large file is
+ * read or written.
+ *
+ * A pool of up to KB_ASYNC_THREADS threads does the file I/O, in chunks of
+ * KB_ASYNC_CHUNK bytes. The files of a load are read by several threads at
+ * once, and the thread that reads the last of them also parses them all,
+ * since parsing does not touch the knowledge base. Only the main thread
+ * changes the knowledge base: it puts each parsed load into memory at the
+ * start of the next command, in the order the loads completed, so a load
+ * lands on top of whatever the chatbot knows by then. A save takes a copy
+ * of the knowledge base in memory at once, so the file holds the knowledge
+ * as it was when SAVE was asked for, and the pool writes it beside the old
+ * file and puts it in its place.
+ *
+ * Each completed request is reported by async_begin(), which the main loop
+ * calls before each command and once more at exit.
+ *
+ * Linux's io_uring would let one thread keep many reads in flight, but the
+ * library for it is not available everywhere this builds, so threads are
+ * used for all I/O.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "chat1002.h"
+
+// Define the kinds of requests
+#define ASYNC_LOAD 1
+#define ASYNC_SAVE 2
+
+// Define a load or save in the background
+typedef struct async_request
+{
+	int type;				  // ASYNC_LOAD or ASYNC_SAVE
+	char **file_names;		  // Names of the files, in load order
+	int count;				  // Number of files
+	char **buffers;			  // For a load, the contents of each file, until they are parsed
+	size_t *lens;			  // For a load, the length of each file
+	kb_parsed *parsed;		  // For a load, the parsed files, once all have been read
+	char *data;				  // For a save, the knowledge to write
+	size_t len;				  // For a save, the length of the knowledge
+	int pending;			  // Number of files not read or written yet
+	int result;				  // KB_OK, or KB_NOTFOUND or KB_NOMEM if a file could not be read or written
+	struct async_request *next; // Next completed request
+} async_request;
+
+// Define a file for a thread of the pool to read or write
+typedef struct async_task
+{
+	async_request *request; // The request
+	int file;				// Index of the file in the request
+	struct async_task *next; // Next task in the queue
+} async_task;
+
+// Lock protecting everything below, and the pending and result fields of every request
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Condition signalled when a task is queued, or the pool is stopping
+static pthread_cond_t async_wake = PTHREAD_COND_INITIALIZER;
+
+// Tasks waiting for a thread, and completed requests waiting for async_begin(), both oldest first
+static async_task *queue_head, *queue_tail;
+static async_request *completed_head, *completed_tail;
+
+// The threads of the pool, and the number of them waiting for a task
+static pthread_t workers[KB_ASYNC_THREADS];
+static int worker_count, idle_count;
+
+// Set to 1 to make the threads exit once the queue is empty
+static int stopping;
+
+// Number of requests made but not reported yet
+static int outstanding;
+
+/*
+ * Read a whole file in chunks of KB_ASYNC_CHUNK bytes into a buffer that
+ * ends with a newline and one writable character, as knowledge_parse()
+ * expects. A file named *.gz is decompressed as it is read.
+ *
+ * Input:
+ *   file_name - the name of the file
+ *   buffer    - receives the buffer, which the caller must free
+ *   len       - receives the number of characters in the buffer
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOTFOUND, if the file could not be opened or read
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int read_file(const char *file_name, char **buffer, size_t *len)
+{
+	struct stat st;
+	FILE *f = gzip_open(file_name, "rb", gzip_named(file_name));
+	if (f == NULL || stat(file_name, &st) != 0)
+	{
+		if (f != NULL)
+		{
+			fclose(f);
+		}
+		return KB_NOTFOUND;
+	}
+
+	// Size the buffer for the whole file, growing it if the file grows while it is read, or is compressed
+	size_t capacity = st.st_size > 0 ? (size_t)st.st_size : KB_ASYNC_CHUNK, size = 0, got;
+	char *data = malloc(capacity + 2);
+	while (data != NULL)
+	{
+		if (size == capacity)
+		{
+			char *bigger = realloc(data, capacity * 2 + 2);
+			if (bigger == NULL)
+			{
+				free(data);
+				data = NULL;
+				break;
+			}
+			data = bigger;
+			capacity *= 2;
+		}
+		if ((got = fread(data + size, 1, capacity - size < KB_ASYNC_CHUNK ? capacity - size : KB_ASYNC_CHUNK, f)) == 0)
+		{
+			break;
+		}
+		size += got;
+	}
+	int failed = ferror(f);
+	fclose(f);
+
+	if (data == NULL)
+	{
+		return KB_NOMEM;
+	}
+	if (failed)
+	{
+		free(data);
+		return KB_NOTFOUND;
+	}
+
+	// End the last line with a newline, so no chunk ends with a partial line
+	if (size > 0 && data[size - 1] != '\n')
+	{
+		data[size++] = '\n';
+	}
+	data[size] = '\0';
+	*buffer = data;
+	*len = size;
+	return KB_OK;
+}
+
+/*
+ * Write a buffer to a file in chunks of KB_ASYNC_CHUNK bytes, beside the
+ * file under a name of its own, then put it in the file's place, so the
+ * file is never left half written, even by two saves of it at once. A file
+ * named *.gz is compressed as it is written.
+ *
+ * Input:
+ *   file_name - the name of the file
+ *   data      - the buffer
+ *   len       - the length of the buffer
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOTFOUND, if the file could not be written
+ */
+static int write_file(const char *file_name, const char *data, size_t len)
+{
+	char *temporary;
+	FILE *f = gzip_create_beside(file_name, &temporary);
+	int result = f == NULL ? KB_NOTFOUND : KB_OK;
+	for (size_t done = 0; result == KB_OK && done < len;)
+	{
+		size_t chunk = len - done < KB_ASYNC_CHUNK ? len - done : KB_ASYNC_CHUNK;
+		if (fwrite(data + done, 1, chunk, f) != chunk)
+		{
+			result = KB_NOTFOUND;
+		}
+		done += chunk;
+	}
+	if ((f != NULL && fclose(f) != 0) || (result == KB_OK && rename(temporary, file_name) != 0))
+	{
+		result = KB_NOTFOUND;
+	}
+	if (result != KB_OK && temporary != NULL)
+	{
+		remove(temporary);
+	}
+
+	free(temporary);
+	return result;
+}
+
+// Utility function to free a request
+static void free_request(async_request *request)
+{
+	for (int i = 0; i < request->count; i++)
+	{
+		free(request->file_names[i]);
+		free(request->buffers == NULL ? NULL : request->buffers[i]);
+	}
+	free(request->file_names);
+	free(request->buffers);
+	free(request->lens);
+	free(request->data);
+	free(request);
+}
+
+// Thread of the pool, which reads and writes files until the pool stops and the queue is empty
+static void *async_worker(void *arg)
+{
+	(void)arg;
+	while (1)
+	{
+		// Take the next task
+		pthread_mutex_lock(&async_lock);
+		while (queue_head == NULL && !stopping)
+		{
+			idle_count++;
+			pthread_cond_wait(&async_wake, &async_lock);
+			idle_count--;
+		}
+		async_task *task = queue_head;
+		if (task == NULL)
+		{
+			pthread_mutex_unlock(&async_lock);
+			return NULL;
+		}
+		queue_head = task->next;
+		queue_tail = queue_head == NULL ? NULL : queue_tail;
+		pthread_mutex_unlock(&async_lock);
+
+		// Read or write the file
+		async_request *request = task->request;
+		int result;
+		if (request->type == ASYNC_LOAD)
+		{
+			result = read_file(request->file_names[task->file], &request->buffers[task->file], &request->lens[task->file]);
+		}
+		else
+		{
+			result = write_file(request->file_names[task->file], request->data, request->len);
+		}
+		free(task);
+
+		pthread_mutex_lock(&async_lock);
+		request->result = request->result == KB_OK ? result : request->result;
+		int last = --request->pending == 0;
+		pthread_mutex_unlock(&async_lock);
+
+		// The thread that reads the last file of a load parses them all; the buffers are taken over either way
+		if (last && request->type == ASYNC_LOAD && request->result == KB_OK)
+		{
+			request->parsed = knowledge_parse(request->buffers, request->lens, request->count);
+			request->buffers = NULL;
+			request->result = request->parsed == NULL ? KB_NOMEM : KB_OK;
+		}
+
+		// Pass the request on to the main thread once it is done
+		if (last)
+		{
+			pthread_mutex_lock(&async_lock);
+			if (completed_tail == NULL)
+			{
+				completed_head = request;
+			}
+			else
+			{
+				completed_tail->next = request;
+			}
+			completed_tail = request;
+			pthread_mutex_unlock(&async_lock);
+		}
+	}
+}
+
+/*
+ * Queue a task for each file of a request, starting threads for them if
+ * the pool has none waiting.
+ *
+ * Input:
+ *   request - the request
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure (nothing is queued)
+ */
+static int queue_request(async_request *request)
+{
+	async_task *tasks = NULL;
+
+	// Make every task before queuing any of them
+	for (int i = request->count - 1; i >= 0; i--)
+	{
+		async_task *task = malloc(sizeof(async_task));
+		if (task == NULL)
+		{
+			while (tasks != NULL)
+			{
+				task = tasks->next;
+				free(tasks);
+				tasks = task;
+			}
+			return KB_NOMEM;
+		}
+		task->request = request;
+		task->file = i;
+		task->next = tasks;
+		tasks = task;
+	}
+
+	pthread_mutex_lock(&async_lock);
+	request->pending = request->count;
+	for (async_task *task = tasks; task != NULL;)
+	{
+		async_task *next = task->next;
+		task->next = NULL;
+		if (queue_tail == NULL)
+		{
+			queue_head = task;
+		}
+		else
+		{
+			queue_tail->next = task;
+		}
+		queue_tail = task;
+		task = next;
+	}
+
+	// Start a thread for each task no thread is waiting for, as far as the pool allows
+	int wanted = request->count - idle_count;
+	while (wanted-- > 0 && worker_count < KB_ASYNC_THREADS &&
+		   pthread_create(&workers[worker_count], NULL, async_worker, NULL) == 0)
+	{
+		worker_count++;
+	}
+	pthread_cond_broadcast(&async_wake);
+	pthread_mutex_unlock(&async_lock);
+
+	// With no thread at all, do the work on this one
+	if (worker_count == 0)
+	{
+		stopping = 1;
+		async_worker(NULL);
+		stopping = 0;
+	}
+
+	outstanding++;
+	return KB_OK;
+}
+
+/*
+ * Load knowledge files in the background. The files are read and parsed
+ * while the chatbot keeps answering, and put into memory at the start of
+ * the first command after they have been, by async_begin().
+ *
+ * Input:
+ *   file_names - the names of the files, which are taken over along with the array, even if loading fails
+ *   count      - the number of files
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int async_load(char *file_names[], int count)
+{
+	async_request *request = calloc(1, sizeof(async_request));
+	if (request == NULL)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			free(file_names[i]);
+		}
+		free(file_names);
+		return KB_NOMEM;
+	}
+
+	request->type = ASYNC_LOAD;
+	request->file_names = file_names;
+	request->count = count;
+	request->buffers = calloc(count, sizeof(char *));
+	request->lens = calloc(count, sizeof(size_t));
+	if (request->buffers == NULL || request->lens == NULL || queue_request(request) != KB_OK)
+	{
+		free_request(request);
+		return KB_NOMEM;
+	}
+
+	return KB_OK;
+}
+
+/*
+ * Save the knowledge base to a file in the background. The knowledge is
+ * copied at once, as knowledge_write() writes it, and the file is written
+ * while the chatbot keeps answering.
+ *
+ * Input:
+ *   file_name - the name of the file
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_UNAVAILABLE, if the knowledge base is sharded and a backend cannot be reached
+ */
+int async_save(const char *file_name)
+{
+	async_request *request = calloc(1, sizeof(async_request));
+	if (request == NULL)
+	{
+		return KB_NOMEM;
+	}
+
+	request->type = ASYNC_SAVE;
+	request->file_names = malloc(sizeof(char *));
+	if (request->file_names != NULL && (request->file_names[0] = strdup(file_name)) != NULL)
+	{
+		request->count = 1;
+	}
+
+	// Copy the knowledge base as it is now
+	FILE *f = request->count == 1 ? open_memstream(&request->data, &request->len) : NULL;
+	int result = f == NULL ? KB_NOMEM : knowledge_write(f);
+	if (f != NULL)
+	{
+		fclose(f);
+	}
+
+	if (result != KB_OK || queue_request(request) != KB_OK)
+	{
+		free_request(request);
+		return result == KB_UNAVAILABLE ? KB_UNAVAILABLE : KB_NOMEM;
+	}
+
+	return KB_OK;
+}
+
+/*
+ * Finish the oldest load or save that has completed in the background,
+ * putting what was loaded into memory, and describe it.
+ *
+ * Input:
+ *   response - a buffer to receive the description
+ *   n        - the size of the buffer
+ *
+ * Returns: 1 if a load or save was finished and described, 0 if none has completed
+ */
+int async_begin(char *response, int n)
+{
+	pthread_mutex_lock(&async_lock);
+	async_request *request = completed_head;
+	if (request != NULL)
+	{
+		completed_head = request->next;
+		completed_tail = completed_head == NULL ? NULL : completed_tail;
+	}
+	pthread_mutex_unlock(&async_lock);
+
+	if (request == NULL)
+	{
+		return 0;
+	}
+
+	if (request->type == ASYNC_LOAD)
+	{
+		int data_loaded = request->result == KB_OK ? knowledge_merge(request->parsed) : request->result;
+		chatbot_report_load(data_loaded, request->file_names, request->count, response, n);
+	}
+	else if (request->result == KB_OK)
+	{
+		snprintf(response, n, "My knowledge has been saved to %s", request->file_names[0]);
+	}
+	else
+	{
+		snprintf(response, n, "I am unable to open/create %s. Please try again.", request->file_names[0]);
+	}
+
+	free_request(request);
+	outstanding--;
+	return 1;
+}
+
+/*
+ * Get the number of loads and saves in the background that have not been
+ * finished by async_begin() yet.
+ *
+ * Returns: the number of loads and saves
+ */
+int async_pending()
+{
+	return outstanding;
+}
+
+/*
+ * Wait for every load and save in the background to complete, and stop the
+ * pool. Completed requests are still left for async_begin().
+ */
+void async_stop()
+{
+	pthread_mutex_lock(&async_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&async_wake);
+	pthread_mutex_unlock(&async_lock);
+
+	for (int i = 0; i < worker_count; i++)
+	{
+		pthread_join(workers[i], NULL);
+	}
+	worker_count = 0;
+	stopping = 0;
+}
@@ -0,0 +1,436 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the benchmarks of the chatbot's hot paths. It is run
+ * with "chatbot --benchmark [options]", generates a synthetic knowledge base,
+ * times loading, lookups, learning and saving, and writes the results as
+ * JSON so that they can be compared between builds.
+ *
+ * Options:
+ *   --entities N        entities per intent (default 10000)
+ *   --intents N         number of intents used, 1 to 3 (default 3)
+ *   --key-length A:B    entity lengths, uniform from A to B (default 8:24)
+ *   --value-length A:B  response lengths, uniform from A to B (default 32:256)
+ *   --zipf S            skew of the Zipf lookups (default 1.0)
+ *   --operations N      operations per lookup benchmark (default 100000)
+ *   --seed N            seed of the generator (default 1)
+ *   --output FILE       write the results to FILE instead of stdout
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "chat1002.h"
+
+// Define the shape of the synthetic knowledge base and of the benchmarks
+typedef struct bench_config
+{
+	int entities;		   // Entities per intent
+	int intents;		   // Number of intents used
+	int key_min, key_max;  // Range of entity lengths
+	int value_min, value_max; // Range of response lengths
+	double zipf;		   // Skew of the Zipf lookups
+	int operations;		   // Operations per lookup benchmark
+	unsigned long long seed; // Seed of the generator
+	const char *output;	   // File to write the results to, or NULL for stdout
+} bench_config;
+
+// Define the synthetic knowledge base
+typedef struct bench_data
+{
+	char **keys;	  // Entities, entities * intents of them, grouped by intent
+	char **values;	  // Responses, one for each entity
+	char **misses;	  // Entities that are never put, one for each entity
+	double *zipf_cdf; // Cumulative Zipf probability of each entity rank
+	int count;		  // Number of entities in total
+} bench_data;
+
+// State of the xorshift generator
+static unsigned long long rng_state;
+
+// Utility function to get the next pseudo-random number
+static unsigned long long rng_next()
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+// Utility function to get a pseudo-random number from min to max, inclusive
+static int rng_range(int min, int max)
+{
+	return min + (int)(rng_next() % (unsigned long long)(max - min + 1));
+}
+
+/*
+ * Make a random string that is unique for its index. The string starts with
+ * a prefix letter and the index in base 36, and is padded with random
+ * letters up to a random length in the given range.
+ *
+ * Returns: the string, which the caller must free
+ */
+static char *make_string(char prefix, int index, int min, int max)
+{
+	static const char letters[] = "abcdefghijklmnopqrstuvwxyz";
+	char head[16];
+	int head_len = 0;
+
+	// Write the prefix and the index, in base 36
+	head[head_len++] = prefix;
+	do
+	{
+		head[head_len++] = "0123456789abcdefghijklmnopqrstuvwxyz"[index % 36];
+		index /= 36;
+	} while (index > 0);
+
+	int len = rng_range(min, max);
+	if (len < head_len)
+	{
+		len = head_len;
+	}
+
+	char *str = malloc(len + 1);
+	if (str == NULL)
+	{
+		fprintf(stderr, "benchmark: out of memory\n");
+		exit(1);
+	}
+	memcpy(str, head, head_len);
+	for (int i = head_len; i < len; i++)
+	{
+		str[i] = letters[rng_next() % 26];
+	}
+	str[len] = '\0';
+	return str;
+}
+
+// Generate the synthetic knowledge base described by the configuration
+static void generate(const bench_config *config, bench_data *data)
+{
+	data->count = config->entities * config->intents;
+	data->keys = malloc(data->count * sizeof(char *));
+	data->values = malloc(data->count * sizeof(char *));
+	data->misses = malloc(data->count * sizeof(char *));
+	data->zipf_cdf = malloc(config->entities * sizeof(double));
+	if (data->keys == NULL || data->values == NULL || data->misses == NULL || data->zipf_cdf == NULL)
+	{
+		fprintf(stderr, "benchmark: out of memory\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < data->count; i++)
+	{
+		data->keys[i] = make_string('k', i, config->key_min, config->key_max);
+		data->values[i] = make_string('v', i, config->value_min, config->value_max);
+		data->misses[i] = make_string('m', i, config->key_min, config->key_max);
+	}
+
+	// Build the cumulative Zipf distribution over the entities of an intent
+	double total = 0;
+	for (int i = 0; i < config->entities; i++)
+	{
+		total += 1.0 / pow(i + 1, config->zipf);
+		data->zipf_cdf[i] = total;
+	}
+	for (int i = 0; i < config->entities; i++)
+	{
+		data->zipf_cdf[i] /= total;
+	}
+}
+
+// Pick the index of an entity of an intent, uniformly or by Zipf rank
+static int pick(const bench_config *config, const bench_data *data, int zipf)
+{
+	int intent = (int)(rng_next() % config->intents);
+	int rank;
+
+	if (zipf)
+	{
+		// Binary search the cumulative distribution for a uniform random number
+		double u = (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+		int low = 0, high = config->entities - 1;
+		while (low < high)
+		{
+			int mid = (low + high) / 2;
+			if (data->zipf_cdf[mid] < u)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		rank = low;
+	}
+	else
+	{
+		rank = (int)(rng_next() % config->entities);
+	}
+
+	return intent * config->entities + rank;
+}
+
+// Put every entity of the synthetic knowledge base
+static void put_all(const bench_config *config, const bench_data *data)
+{
+	for (int i = 0; i < data->count; i++)
+	{
+		knowledge_put(knowledge_intent_name(i / config->entities), data->keys[i], data->values[i]);
+	}
+}
+
+// Write one result as a JSON object
+static void report(FILE *out, int *first, const char *name, long long operations, unsigned long long start, long long bytes)
+{
+	double seconds = (stats_clock() - start) / 1e9;
+
+	fprintf(out, "%s\n    {\"name\": \"%s\", \"operations\": %lld, \"seconds\": %.6f, \"operations_per_second\": %.1f, \"ns_per_operation\": %.1f",
+			*first ? "" : ",", name, operations, seconds,
+			seconds > 0 ? operations / seconds : 0.0, operations > 0 ? seconds * 1e9 / operations : 0.0);
+	if (bytes > 0)
+	{
+		fprintf(out, ", \"megabytes_per_second\": %.1f", seconds > 0 ? bytes / seconds / 1e6 : 0.0);
+	}
+	fputc('}', out);
+	*first = 0;
+}
+
+// Utility function to read a range such as "8:24" into its bounds
+static int parse_range(const char *arg, int *min, int *max)
+{
+	return sscanf(arg, "%d:%d", min, max) == 2 && *min > 0 && *max >= *min;
+}
+
+/*
+ * Run the benchmarks.
+ *
+ * Input:
+ *   argc - the number of options, as main()
+ *   argv - the options, as main(), starting after "--benchmark"
+ *
+ * Returns: the exit status of the program
+ */
+int benchmark_main(int argc, char *argv[])
+{
+	bench_config config = {10000, 3, 8, 24, 32, 256, 1.0, 100000, 1, NULL};
+	bench_data data;
+	char *response;
+	int response_size;
+	unsigned long long start;
+	int first = 1;
+
+	// Read the options
+	for (int i = 0; i < argc; i++)
+	{
+		int ok = i + 1 < argc;
+		if (ok && strcmp(argv[i], "--entities") == 0)
+			ok = (config.entities = atoi(argv[++i])) > 0;
+		else if (ok && strcmp(argv[i], "--intents") == 0)
+			ok = (config.intents = atoi(argv[++i])) >= 1 && config.intents <= MAX_HASHTABLE;
+		else if (ok && strcmp(argv[i], "--key-length") == 0)
+			ok = parse_range(argv[++i], &config.key_min, &config.key_max);
+		else if (ok && strcmp(argv[i], "--value-length") == 0)
+			ok = parse_range(argv[++i], &config.value_min, &config.value_max);
+		else if (ok && strcmp(argv[i], "--zipf") == 0)
+			ok = (config.zipf = atof(argv[++i])) >= 0;
+		else if (ok && strcmp(argv[i], "--operations") == 0)
+			ok = (config.operations = atoi(argv[++i])) > 0;
+		else if (ok && strcmp(argv[i], "--seed") == 0)
+			ok = (config.seed = strtoull(argv[++i], NULL, 10)) != 0;
+		else if (ok && strcmp(argv[i], "--output") == 0)
+			config.output = argv[++i];
+		else
+			ok = 0;
+
+		if (!ok)
+		{
+			fprintf(stderr, "benchmark: invalid option %s\n", argv[i]);
+			return 2;
+		}
+	}
+
+	// Size the response buffer for the longest response, so that every hit is copied
+	response_size = config.value_max + 1;
+	response = malloc(response_size);
+	if (response == NULL)
+	{
+		fprintf(stderr, "benchmark: out of memory\n");
+		return 1;
+	}
+
+	FILE *out = config.output == NULL ? stdout : fopen(config.output, "w");
+	if (out == NULL)
+	{
+		fprintf(stderr, "benchmark: cannot open %s\n", config.output);
+		return 1;
+	}
+
+	rng_state = config.seed;
+	generate(&config, &data);
+
+	fprintf(out, "{\n  \"config\": {\"entities\": %d, \"intents\": %d, \"key_length\": [%d, %d], \"value_length\": [%d, %d], \"zipf\": %.2f, \"operations\": %d, \"seed\": %llu},\n  \"results\": [",
+			config.entities, config.intents, config.key_min, config.key_max, config.value_min, config.value_max,
+			config.zipf, config.operations, config.seed);
+
+	// Write the synthetic knowledge base to a file, which also benchmarks knowledge_write()
+	char file_name[] = "/tmp/chatbot-benchmark-XXXXXX";
+	int fd = mkstemp(file_name);
+	FILE *f = fd < 0 ? NULL : fdopen(fd, "w");
+	if (f == NULL)
+	{
+		fprintf(stderr, "benchmark: cannot create a temporary file\n");
+		return 1;
+	}
+	knowledge_clear();
+	put_all(&config, &data);
+	start = stats_clock();
+	knowledge_write(f);
+	fflush(f);
+	long long file_size = ftell(f);
+	report(out, &first, "knowledge_write", data.count, start, file_size);
+	fclose(f);
+
+	// Load it back
+	const char *file_names[] = {file_name};
+	knowledge_clear();
+	start = stats_clock();
+	knowledge_read_files(file_names, 1);
+	report(out, &first, "knowledge_read", data.count, start, file_size);
+	unlink(file_name);
+
+	// Look up entities that are known, uniformly and by Zipf rank, and entities that are not
+	start = stats_clock();
+	for (int i = 0; i < config.operations; i++)
+	{
+		int k = pick(&config, &data, 0);
+		knowledge_get(knowledge_intent_name(k / config.entities), data.keys[k], response, response_size);
+	}
+	report(out, &first, "knowledge_get_hit_uniform", config.operations, start, 0);
+
+	start = stats_clock();
+	for (int i = 0; i < config.operations; i++)
+	{
+		int k = pick(&config, &data, 1);
+		knowledge_get(knowledge_intent_name(k / config.entities), data.keys[k], response, response_size);
+	}
+	report(out, &first, "knowledge_get_hit_zipf", config.operations, start, 0);
+
+	start = stats_clock();
+	for (int i = 0; i < config.operations; i++)
+	{
+		int k = pick(&config, &data, 0);
+		knowledge_get(knowledge_intent_name(k / config.entities), data.misses[k], response, response_size);
+	}
+	report(out, &first, "knowledge_get_miss", config.operations, start, 0);
+
+	// Overwrite known entities, then insert every entity into an empty knowledge base
+	start = stats_clock();
+	for (int i = 0; i < config.operations; i++)
+	{
+		int k = pick(&config, &data, 0);
+		knowledge_put(knowledge_intent_name(k / config.entities), data.keys[k], data.values[(k + 1) % data.count]);
+	}
+	report(out, &first, "knowledge_put_overwrite", config.operations, start, 0);
+
+	knowledge_clear();
+	start = stats_clock();
+	put_all(&config, &data);
+	report(out, &first, "knowledge_put_insert", data.count, start, 0);
+
+	// Freeze the knowledge base and look up known entities, and entities that are not, in the frozen image
+	size_t image_size;
+	start = stats_clock();
+	knowledge_freeze(0, &image_size);
+	report(out, &first, "knowledge_freeze", data.count, start, 0);
+
+	start = stats_clock();
+	for (int i = 0; i < config.operations; i++)
+	{
+		int k = pick(&config, &data, 0);
+		knowledge_get(knowledge_intent_name(k / config.entities), data.keys[k], response, response_size);
+	}
+	report(out, &first, "knowledge_get_frozen_hit_uniform", config.operations, start, 0);
+
+	start = stats_clock();
+	for (int i = 0; i < config.operations; i++)
+	{
+		int k = pick(&config, &data, 0);
+		knowledge_get(knowledge_intent_name(k / config.entities), data.misses[k], response, response_size);
+	}
+	report(out, &first, "knowledge_get_frozen_miss", config.operations, start, 0);
+
+	// Freeze again with the responses compressed, and look up known entities, evenly and as a popular few
+	start = stats_clock();
+	knowledge_freeze(1, &image_size);
+	report(out, &first, "knowledge_freeze_compressed", data.count, start, 0);
+
+	start = stats_clock();
+	for (int i = 0; i < config.operations; i++)
+	{
+		int k = pick(&config, &data, 0);
+		knowledge_get(knowledge_intent_name(k / config.entities), data.keys[k], response, response_size);
+	}
+	report(out, &first, "knowledge_get_compressed_hit_uniform", config.operations, start, 0);
+
+	start = stats_clock();
+	for (int i = 0; i < config.operations; i++)
+	{
+		int k = pick(&config, &data, 1);
+		knowledge_get(knowledge_intent_name(k / config.entities), data.keys[k], response, response_size);
+	}
+	report(out, &first, "knowledge_get_compressed_hit_zipf", config.operations, start, 0);
+
+	// Ask questions end to end, including splitting them into words
+	size_t line_size = config.key_max + 16;
+	char *line = malloc(line_size);
+	char **inv = malloc((line_size / 2 + 2) * sizeof(char *));
+	char *output = malloc(knowledge_max_response() + 1);
+	if (line == NULL || inv == NULL || output == NULL)
+	{
+		fprintf(stderr, "benchmark: out of memory\n");
+		return 1;
+	}
+	start = stats_clock();
+	for (int i = 0; i < config.operations; i++)
+	{
+		int k = pick(&config, &data, 1);
+		snprintf(line, line_size, "%s is %s?\n", knowledge_intent_name(k / config.entities), data.keys[k]);
+		int inc = tokenize_input(line, inv);
+		chatbot_main(inc, inv, output, (int)knowledge_max_response() + 1);
+	}
+	report(out, &first, "chatbot_main_question", config.operations, start, 0);
+
+	// Remember an entity in each of as many sessions as operations, then recall them in random order
+	char name[32];
+	start = stats_clock();
+	for (int i = 0; i < config.operations; i++)
+	{
+		snprintf(name, sizeof(name), "session%d", i);
+		session_select(name);
+		session_remember(0, data.keys[i % data.count]);
+	}
+	report(out, &first, "session_remember", config.operations, start, 0);
+
+	start = stats_clock();
+	for (int i = 0; i < config.operations; i++)
+	{
+		snprintf(name, sizeof(name), "session%d", (int)(rng_next() % config.operations));
+		session_select(name);
+		session_recall("it");
+	}
+	report(out, &first, "session_recall", config.operations, start, 0);
+	session_select("default");
+
+	fprintf(out, "\n  ]\n}\n");
+	if (out != stdout)
+	{
+		fclose(out);
+	}
+
+	free(line);
+	free(inv);
+	free(output);
+	free(response);
+	knowledge_clear();
+	return 0;
+}
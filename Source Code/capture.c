@@ -0,0 +1,529 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the capture and replay of requests, so that real
+ * use of the chatbot can be played back against another build of it.
+ *
+ * "chatbot --capture log.bin" chats as usual, and records every line of
+ * input given to chatbot_main() in the log, with the time it was given, the
+ * time the chatbot took, and its outcome (hit, miss, learned or command).
+ * The answers the user gives when the chatbot asks for a response are
+ * recorded after the request they belong to.
+ *
+ * "chatbot --replay log.bin [--paced] [--output FILE]" drives the chatbot
+ * from the log, as fast as possible or at the pace the requests were
+ * recorded, feeding it the recorded answers instead of reading them from
+ * the user. It writes the throughput, the latency percentiles and the
+ * number of requests whose outcome differs from the recorded one as JSON.
+ *
+ * The log starts with the eight bytes "KBLOG1\0\0", followed by records:
+ *   1 byte   the type (LOG_REQUEST or LOG_ANSWER) in the low 4 bits, and the outcome in the high 4 bits
+ *   varint   nanoseconds since the previous record
+ *   varint   nanoseconds taken by chatbot_main(), less any wait for the user, or 0 for answers
+ *   varint   length of the line
+ *   bytes    the line, without its newline
+ * A varint is 7 bits per byte, lowest first, with the top bit set on every
+ * byte but the last.
+ *
+ * capture_start(), capture_begin(), capture_answer(), capture_skip() and capture_end() record a log.
+ * replay_main() plays a log back.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chat1002.h"
+
+// Define the types of records
+#define LOG_REQUEST 1
+#define LOG_ANSWER  2
+
+// Define the first bytes of a log
+static const char log_magic[8] = "KBLOG1";
+
+// Set to 1 while capturing
+int capture_enabled;
+
+// The log being captured
+static FILE *capture_file;
+
+// The time of the last record, and of the start of the request being captured
+static unsigned long long last_record;
+static unsigned long long request_start;
+
+// Nanoseconds of the request being captured spent waiting for the user, which are left out of its latency
+static unsigned long long request_waited;
+
+// The request being captured, and the answers given during it, each null-terminated
+static char *pending;
+static size_t pending_len;
+static size_t pending_capacity;
+static size_t request_len;
+
+// Define a record read from a log
+typedef struct log_record
+{
+	int type;						// LOG_REQUEST or LOG_ANSWER
+	int outcome;					// OUTCOME_COMMAND, OUTCOME_HIT, OUTCOME_MISS or OUTCOME_LEARNED
+	unsigned long long delay;		// Nanoseconds since the previous record
+	unsigned long long latency;		// Nanoseconds taken by chatbot_main()
+	char *line;						// The line, null-terminated
+	size_t capacity;				// Size of the memory allocated for the line
+} log_record;
+
+// Utility function to write a varint
+static void write_varint(FILE *f, unsigned long long value)
+{
+	while (value >= 0x80)
+	{
+		fputc((int)(value & 0x7F) | 0x80, f);
+		value >>= 7;
+	}
+	fputc((int)value, f);
+}
+
+// Utility function to read a varint; returns 0 at the end of the log
+static int read_varint(FILE *f, unsigned long long *value)
+{
+	int c, shift = 0;
+
+	*value = 0;
+	do
+	{
+		c = fgetc(f);
+		if (c == EOF || shift > 63)
+		{
+			return 0;
+		}
+		*value |= (unsigned long long)(c & 0x7F) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return 1;
+}
+
+// Utility function to write a record
+static void write_record(int type, int outcome, unsigned long long at, unsigned long long latency, const char *line, size_t len)
+{
+	fputc(type | outcome << 4, capture_file);
+	write_varint(capture_file, at - last_record);
+	write_varint(capture_file, latency);
+	write_varint(capture_file, len);
+	fwrite(line, 1, len, capture_file);
+	last_record = at;
+}
+
+// Utility function to add a line to the pending request, with room for its null
+static int add_pending(const char *line, size_t len)
+{
+	if (pending_len + len + 1 > pending_capacity)
+	{
+		size_t capacity = pending_capacity < 256 ? 256 : pending_capacity;
+		while (capacity < pending_len + len + 1)
+		{
+			capacity *= 2;
+		}
+		char *bigger = realloc(pending, capacity);
+		if (bigger == NULL)
+		{
+			return 0;
+		}
+		pending = bigger;
+		pending_capacity = capacity;
+	}
+
+	memcpy(pending + pending_len, line, len);
+	pending[pending_len + len] = '\0';
+	pending_len += len + 1;
+	return 1;
+}
+
+/*
+ * Start capturing requests into a log.
+ *
+ * Input:
+ *   file_name - the log, which is written over
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOTFOUND, if the log could not be created
+ */
+int capture_start(const char *file_name)
+{
+	capture_file = fopen(file_name, "wb");
+	if (capture_file == NULL)
+	{
+		return KB_NOTFOUND;
+	}
+
+	fwrite(log_magic, 1, sizeof(log_magic), capture_file);
+	last_record = stats_clock();
+	capture_enabled = 1;
+	return KB_OK;
+}
+
+/*
+ * Start capturing a request, before it is split into words.
+ *
+ * Input:
+ *   input - the line of input
+ */
+void capture_begin(const char *input)
+{
+	pending_len = 0;
+	if (!add_pending(input, strcspn(input, "\r\n")))
+	{
+		request_len = 0;
+		return;
+	}
+	request_len = pending_len;
+	request_waited = 0;
+	request_start = stats_clock();
+}
+
+/*
+ * Capture an answer given by the user during the current request.
+ *
+ * Input:
+ *   answer - the answer
+ */
+void capture_answer(const char *answer)
+{
+	if (request_len > 0)
+	{
+		add_pending(answer, strlen(answer));
+	}
+}
+
+/*
+ * Leave the time since a point in the current request out of its latency,
+ * e.g. the time spent waiting for the user to answer.
+ *
+ * Input:
+ *   since - the point, from stats_clock()
+ */
+void capture_skip(unsigned long long since)
+{
+	request_waited += stats_clock() - since;
+}
+
+/*
+ * Finish capturing a request, writing it and its answers to the log.
+ *
+ * Input:
+ *   outcome - the outcome of the request, from chatbot_outcome()
+ */
+void capture_end(int outcome)
+{
+	unsigned long long latency = stats_clock() - request_start - request_waited;
+
+	if (request_len == 0)
+	{
+		return;
+	}
+
+	write_record(LOG_REQUEST, outcome, request_start, latency, pending, request_len - 1);
+	for (size_t at = request_len; at < pending_len; at += strlen(pending + at) + 1)
+	{
+		write_record(LOG_ANSWER, 0, request_start, 0, pending + at, strlen(pending + at));
+	}
+	fflush(capture_file);
+}
+
+/*
+ * Stop capturing, closing the log.
+ */
+void capture_stop()
+{
+	if (capture_file != NULL)
+	{
+		fclose(capture_file);
+	}
+	capture_file = NULL;
+	capture_enabled = 0;
+	free(pending);
+	pending = NULL;
+	pending_capacity = 0;
+}
+
+/*
+ * Read the next record of a log.
+ *
+ * Input:
+ *   f      - the log
+ *   record - receives the record, reusing the memory of its line
+ *
+ * Returns:
+ *   1, if a record was read
+ *   0, at the end of the log, or if the rest of it is damaged
+ */
+static int read_record(FILE *f, log_record *record)
+{
+	unsigned long long len;
+	int c = fgetc(f);
+
+	if (c == EOF || !read_varint(f, &record->delay) || !read_varint(f, &record->latency) || !read_varint(f, &len))
+	{
+		return 0;
+	}
+	record->type = c & 0x0F;
+	record->outcome = c >> 4;
+
+	if (len + 1 > record->capacity)
+	{
+		char *bigger = realloc(record->line, len + 1);
+		if (bigger == NULL)
+		{
+			return 0;
+		}
+		record->line = bigger;
+		record->capacity = len + 1;
+	}
+	if (fread(record->line, 1, len, f) != len)
+	{
+		return 0;
+	}
+	record->line[len] = '\0';
+	return 1;
+}
+
+// The recorded answers of the request being replayed, null-terminated one after another, and the next to give
+static char *replay_answers;
+static size_t replay_answers_len;
+static size_t replay_next;
+
+// Give prompt_user() the next recorded answer, or NULL if the request has no more
+static char *next_answer()
+{
+	if (replay_next >= replay_answers_len)
+	{
+		return NULL;
+	}
+
+	char *answer = replay_answers + replay_next;
+	replay_next += strlen(answer) + 1;
+	return answer;
+}
+
+// Utility function to order latencies from the shortest
+static int compare_latency(const void *a, const void *b)
+{
+	unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Utility function to write the percentiles of sorted latencies as a JSON object
+static void write_percentiles(FILE *out, const char *name, const unsigned long long *sorted, size_t count)
+{
+	const double fractions[] = {0.5, 0.9, 0.99, 0.999};
+	const char *names[] = {"p50", "p90", "p99", "p999"};
+
+	fprintf(out, "  \"%s\": {", name);
+	for (int i = 0; i < 4; i++)
+	{
+		size_t at = count == 0 ? 0 : (size_t)(fractions[i] * (count - 1));
+		fprintf(out, "\"%s\": %llu, ", names[i], count == 0 ? 0 : sorted[at]);
+	}
+	fprintf(out, "\"max\": %llu}", count == 0 ? 0 : sorted[count - 1]);
+}
+
+// Utility function to sleep until a time of stats_clock()
+static void sleep_until(unsigned long long when)
+{
+	unsigned long long now = stats_clock();
+
+	if (when > now)
+	{
+		struct timespec delay = {(time_t)((when - now) / 1000000000ULL), (long)((when - now) % 1000000000ULL)};
+		nanosleep(&delay, NULL);
+	}
+}
+
+/*
+ * Replay a log.
+ *
+ * Input:
+ *   argc - the number of arguments, as main()
+ *   argv - the arguments, as main(), starting after "--replay"
+ *
+ * Returns: the exit status of the program
+ */
+int replay_main(int argc, char *argv[])
+{
+	const char *log_name = NULL, *output_name = NULL;
+	int paced = 0;
+	char magic[sizeof(log_magic)];
+
+	// Read the arguments
+	for (int i = 0; i < argc; i++)
+	{
+		if (strcmp(argv[i], "--paced") == 0)
+			paced = 1;
+		else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc)
+			output_name = argv[++i];
+		else if (log_name == NULL && argv[i][0] != '-')
+			log_name = argv[i];
+		else
+		{
+			fprintf(stderr, "usage: chatbot --replay log.bin [--paced] [--output FILE]\n");
+			return 2;
+		}
+	}
+	if (log_name == NULL)
+	{
+		fprintf(stderr, "usage: chatbot --replay log.bin [--paced] [--output FILE]\n");
+		return 2;
+	}
+
+	FILE *f = fopen(log_name, "rb");
+	if (f == NULL || fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, log_magic, sizeof(magic)) != 0)
+	{
+		fprintf(stderr, "replay: %s is not a request log\n", log_name);
+		return 1;
+	}
+	FILE *out = output_name == NULL ? stdout : fopen(output_name, "w");
+	if (out == NULL)
+	{
+		fprintf(stderr, "replay: cannot open %s\n", output_name);
+		return 1;
+	}
+
+	// Start from the same state as an interactive chatbot, answering from the log instead of the user
+	char *reset[] = {"reset", NULL};
+	size_t output_size = MAX_RESPONSE;
+	char *output = malloc(output_size);
+	char **inv = NULL;
+	size_t inv_size = 0;
+	unsigned long long *latencies = NULL, *recorded = NULL;
+	size_t count = 0, capacity = 0;
+	unsigned long long outcomes[OUTCOMES] = {0}, mismatches = 0;
+	size_t answers_capacity = 0;
+	log_record record = {0}, request = {0};
+	int have_record = read_record(f, &record), done = 0;
+
+	if (output == NULL)
+	{
+		fprintf(stderr, "replay: out of memory\n");
+		return 1;
+	}
+	chatbot_do_reset(1, reset, output, (int)output_size);
+	answer_source = next_answer;
+
+	unsigned long long start = stats_clock(), recorded_at = 0;
+	while (have_record && !done)
+	{
+		// Take the request, and the answers that follow it
+		if (record.type != LOG_REQUEST)
+		{
+			have_record = read_record(f, &record);
+			continue;
+		}
+		log_record swap = request;
+		request = record;
+		record = swap;
+		recorded_at += request.delay;
+		replay_answers_len = 0;
+		replay_next = 0;
+		while ((have_record = read_record(f, &record)) && record.type == LOG_ANSWER)
+		{
+			size_t len = strlen(record.line) + 1;
+			if (replay_answers_len + len > answers_capacity)
+			{
+				answers_capacity = (replay_answers_len + len) * 2;
+				char *bigger = realloc(replay_answers, answers_capacity);
+				if (bigger == NULL)
+				{
+					break;
+				}
+				replay_answers = bigger;
+			}
+			memcpy(replay_answers + replay_answers_len, record.line, len);
+			replay_answers_len += len;
+			recorded_at += record.delay;
+		}
+
+		// Keep to the recorded pace, if asked to
+		if (paced)
+		{
+			sleep_until(start + recorded_at);
+		}
+
+		// Make room for the words and the latency of the request
+		size_t len = strlen(request.line);
+		if (inv_size < len / 2 + 2)
+		{
+			char **bigger = realloc(inv, (len / 2 + 2) * sizeof(char *));
+			if (bigger == NULL)
+				break;
+			inv = bigger;
+			inv_size = len / 2 + 2;
+		}
+		if (count == capacity)
+		{
+			capacity = capacity == 0 ? 1024 : capacity * 2;
+			unsigned long long *bigger = realloc(latencies, capacity * sizeof(unsigned long long));
+			unsigned long long *bigger_recorded = bigger == NULL ? NULL : realloc(recorded, capacity * sizeof(unsigned long long));
+			if (bigger != NULL)
+				latencies = bigger;
+			if (bigger == NULL || bigger_recorded == NULL)
+				break;
+			recorded = bigger_recorded;
+		}
+
+		// Handle the request as main() would, timing chatbot_main() as it was timed when captured
+		int inc = tokenize_input(request.line, inv);
+		if (inc < 1)
+			continue;
+		knowledge_refresh();
+		if (knowledge_max_response() + 1 > output_size)
+		{
+			char *bigger = realloc(output, knowledge_max_response() + 1);
+			if (bigger != NULL)
+			{
+				output = bigger;
+				output_size = knowledge_max_response() + 1;
+			}
+		}
+		unsigned long long begin = stats_clock();
+		done = chatbot_main(inc, inv, output, (int)output_size);
+		latencies[count] = stats_clock() - begin;
+		recorded[count] = request.latency;
+		count++;
+
+		int outcome = chatbot_outcome();
+		outcomes[outcome]++;
+		if (outcome != request.outcome)
+		{
+			mismatches++;
+		}
+	}
+	double seconds = (stats_clock() - start) / 1e9;
+
+	qsort(latencies, count, sizeof(unsigned long long), compare_latency);
+	qsort(recorded, count, sizeof(unsigned long long), compare_latency);
+	fprintf(out, "{\n  \"log\": \"%s\", \"paced\": %s,\n", log_name, paced ? "true" : "false");
+	fprintf(out, "  \"requests\": %zu, \"seconds\": %.6f, \"requests_per_second\": %.1f,\n", count, seconds,
+			seconds > 0 ? count / seconds : 0.0);
+	fprintf(out, "  \"outcomes\": {\"command\": %llu, \"hit\": %llu, \"miss\": %llu, \"learned\": %llu}, \"mismatches\": %llu,\n",
+			outcomes[OUTCOME_COMMAND], outcomes[OUTCOME_HIT], outcomes[OUTCOME_MISS], outcomes[OUTCOME_LEARNED], mismatches);
+	write_percentiles(out, "latency_ns", latencies, count);
+	fprintf(out, ",\n");
+	write_percentiles(out, "recorded_latency_ns", recorded, count);
+	fprintf(out, "\n}\n");
+
+	if (out != stdout)
+	{
+		fclose(out);
+	}
+	fclose(f);
+	free(output);
+	free(inv);
+	free(latencies);
+	free(recorded);
+	free(record.line);
+	free(request.line);
+	free(replay_answers);
+	answer_source = NULL;
+	return 0;
+}
@@ -10,35 +10,250 @@
 
 #include <stdio.h>
 
-/* the maximum number of characters we expect in a line of input (including the terminating null)  */
+/* the initial size of the input buffer; longer lines of input grow it as needed */
 #define MAX_INPUT    256
 
 /* the maximum number of characters allowed in the name of an intent (including the terminating null)  */
 #define MAX_INTENT   32
 
-/* the maximum number of characters allowed in the name of an entity (including the terminating null)  */
-#define MAX_ENTITY   64
-
-/* the maximum number of characters allowed in a response (including the terminating null) */
-#define MAX_RESPONSE 256
+/* the initial size of the output buffer; it grows to fit the longest response known */
+#define MAX_RESPONSE 512
 
 // Define maximum length of hashtable to be 3
 #define MAX_HASHTABLE 3
 
+/* the size of the chunks a large knowledge file is split into, so that several threads can parse it */
+#define KB_CHUNK_SIZE (1 << 20)
+
+/* the maximum number of threads used to load knowledge files */
+#define KB_MAX_THREADS 16
+
+/* the size of the blocks a knowledge file is read in */
+#define KB_BLOCK_SIZE (256 * 1024)
+
+/* the maximum number of unreadable lines remembered from a load */
+#define KB_MAX_DIAGNOSTICS 100
+
+/* the size of the Bloom filter of each intent in bits per entity, and the number of bits set per entity; */
+/* 10 bits and 6 hashes give about 1% false positives, and each extra bit per entity roughly halves them */
+#define KB_BLOOM_BITS_PER_KEY 10
+#define KB_BLOOM_HASHES       6
+
+/* the average number of entities per bucket of the perfect hash of a frozen image, and how hard to search for it */
+#define KB_MPH_BUCKET_SIZE 4
+#define KB_MPH_MAX_SEED    (1 << 16)
+#define KB_MPH_MAX_SALT    16
+
+/* the first four bytes of a frozen image, "KBI2" */
+#define KB_IMAGE_MAGIC 0x3249424B
+
+/* flags of a frozen image */
+#define KB_IMAGE_COMPRESSED 1 /* the responses are compressed with the dictionary of the image */
+
+/* the largest dictionary trained to compress the responses of a frozen image; matches reach back at most 64KB */
+#define KB_DICTIONARY_SIZE (32 * 1024)
+
+/* the number of compressed responses kept restored, for the questions asked most often */
+#define KB_RESPONSE_CACHE 256
+
+/* the number of slow requests kept in a trace file, and the length of the line of each */
+#define KB_TRACE_RING   1024
+#define KB_TRACE_RECORD 256
+
+/* requests slower than this many microseconds are written to the trace file, unless another threshold is given */
+#define KB_TRACE_THRESHOLD 1000
+
+/* steps of the normalization of entities into the keys they are matched by; ASCII letters are always folded to lower case */
+#define NORM_SPACE       1  /* collapse runs of white space into one space, and trim both ends */
+#define NORM_PUNCT       2  /* strip punctuation such as '.', '?' and quotes from both ends of each word */
+#define NORM_ARTICLES    4  /* drop the words "a", "an" and "the", unless nothing else is left */
+#define NORM_POSSESSIVES 8  /* fold "SIT's" and "students'" to "SIT" and "students" */
+#define NORM_PLURALS     16 /* fold plurals such as "universities" and "modules" to singular */
+#define NORM_UNICODE     32 /* also fold the case of accented Latin, Greek and Cyrillic letters in UTF-8 */
+#define NORM_DEFAULT     (NORM_SPACE | NORM_PUNCT | NORM_ARTICLES | NORM_POSSESSIVES | NORM_UNICODE)
+
+/* the number of short entities whose keys are kept, for the questions asked most often */
+#define KB_NORMALIZE_CACHE 256
+
+/* the most processes that can follow a leader at once */
+#define KB_MAX_FOLLOWERS 64
+
+/* the most bytes of log a follower may fall behind, beyond its snapshot, before the leader drops it */
+#define KB_REPL_QUEUE (16 * 1024 * 1024)
+
+/* the most milliseconds a leader waits, when it stops, for its followers to take the rest of the log */
+#define KB_REPL_LINGER 1000
+
+/* the number of threads that read and write knowledge files in the background */
+#define KB_ASYNC_THREADS 4
+
+/* the size of each read or write of a knowledge file in the background */
+#define KB_ASYNC_CHUNK (1 << 20)
+
+/* the number of points each backend of a sharded knowledge base owns on the ring of hashes; more spread the keys more evenly */
+#define KB_SHARD_POINTS 128
+
+/* the most sessions whose context is kept at once, a power of two; each takes 64 bytes */
+#define KB_MAX_SESSIONS (1 << 18)
+
+/* the number of seconds after which a session that has not been used forgets its context */
+#define KB_SESSION_TTL 1800
+
+/* the number of slots of the session table a session may be in, from the slot of its hash */
+#define KB_SESSION_PROBES 8
+
 /* return codes for knowledge_get() and knowledge_put() */
 #define KB_OK        0
 #define KB_NOTFOUND -1
 #define KB_INVALID  -2
 #define KB_NOMEM    -3
+#define KB_TOOLONG  -4
+#define KB_UNAVAILABLE -5
+
+/* a line of a knowledge file that could not be read */
+typedef struct kb_diagnostic
+{
+	int file;			 /* index of the file, in the order the files were loaded */
+	int line;			 /* line number, starting from 1 */
+	const char *message; /* what is wrong with the line */
+} kb_diagnostic;
+
+/* a string in the pool of intern.c, shared by every entity or response equal to it */
+typedef struct kb_string
+{
+	unsigned long long hash; /* hash of the string, from intern_hash() */
+	size_t len;				 /* length of the string */
+	unsigned int refs;		 /* number of references to the string */
+	struct kb_string *next;	 /* next string in the same chain of the pool */
+	char data[];			 /* the string, null-terminated */
+} kb_string;
+
+/* an entity and its response, as passed between knowledge.c and image.c */
+typedef struct kb_entry
+{
+	int index;				 /* index of the intent in the hashtable */
+	unsigned long long hash; /* hash of the key of the entity */
+	const char *entity;
+	size_t entity_len;
+	const char *key;		 /* the entity normalized, from normalize_entity() */
+	size_t key_len;
+	const char *response;
+	size_t response_len;
+} kb_entry;
+
+/* what saving the knowledge base changed in a file, from knowledge_save() */
+typedef struct kb_save_diff
+{
+	size_t added;	/* entities that were not in the file */
+	size_t removed; /* entities that were in the file, and are no longer known */
+	size_t changed; /* entities whose line in the file is different */
+} kb_save_diff;
+
+/* files parsed by knowledge_parse(), waiting for knowledge_merge() to put them into memory */
+typedef struct kb_parsed kb_parsed;
+
+/* the header of a frozen image: a read-only knowledge base in one block of memory, using offsets instead of pointers */
+typedef struct kb_image
+{
+	unsigned int magic;								 /* KB_IMAGE_MAGIC */
+	unsigned int count;								 /* number of entities, which is also the number of slots */
+	unsigned int bucket_count;						 /* number of buckets of the perfect hash */
+	unsigned int salt;								 /* salt of the bucket hash */
+	unsigned int flags;								 /* see KB_IMAGE_COMPRESSED */
+	unsigned int dictionary_size;					 /* size of the dictionary of compressed responses */
+	unsigned int normalization;						 /* the steps of the normalization the keys were made with */
+	unsigned long long size;						 /* size of the whole image in bytes */
+	unsigned long long seeds_offset;				 /* offset of the seed of each bucket */
+	unsigned long long dictionary_offset;			 /* offset of the dictionary of compressed responses */
+	unsigned long long entries_offset;				 /* offset of the entity in each slot */
+	unsigned long long strings_offset;				 /* offset of the entities and responses */
+	unsigned long long max_response;				 /* length of the longest response */
+	unsigned long long intent_count[MAX_HASHTABLE]; /* number of entities of each intent */
+} kb_image;
+
+/* the control block of a knowledge base shared between processes, which names the generation to use */
+typedef struct kb_shared_control
+{
+	unsigned int magic;		 /* KB_IMAGE_MAGIC, once a generation has been published */
+	unsigned int generation; /* the current generation, from 1; read and written atomically */
+} kb_shared_control;
+
+/* the state of compress.c while compressing the responses of an image */
+typedef struct kb_compressor
+{
+	char *dictionary;			  /* the dictionary, trained from the responses */
+	size_t dictionary_size;		  /* size of the dictionary */
+	int *dictionary_table;		  /* last position in the dictionary of each hash */
+	int *window_table;			  /* last position in the current response of each hash */
+	unsigned int *window_stamp;	  /* the response each position of window_table belongs to */
+	unsigned int stamp;			  /* the current response */
+} kb_compressor;
+
+/* counters kept by stats.c */
+#define STAT_HIT       0 /* questions answered */
+#define STAT_MISS      1 /* questions not known */
+#define STAT_LEARNED   2 /* responses learned from the user */
+#define STAT_INSERT    3 /* entities added */
+#define STAT_OVERWRITE 4 /* responses replaced */
+#define STAT_FILTERED  5 /* entities rejected by a Bloom filter without walking the list */
+#define STAT_EVICTED   6 /* learned responses evicted to stay within the memory budget */
+#define STAT_COUNTERS  7
+
+/* timers kept by stats.c */
+#define STAT_TIME_GET   0 /* knowledge_get() */
+#define STAT_TIME_READ  1 /* knowledge_read() and knowledge_read_files() */
+#define STAT_TIME_WRITE 2 /* knowledge_write() */
+#define STAT_TIMERS     3
+
+/* the number of buckets in a histogram; bucket i counts values from 2^(i-1) up to 2^i - 1 */
+#define STAT_BUCKETS 40
+
+/* statistics of the knowledge base */
+typedef struct kb_stats
+{
+	unsigned long long counters[STAT_COUNTERS];				 /* see STAT_HIT etc. */
+	unsigned long long probes[STAT_BUCKETS];				 /* histogram of the number of nodes compared per lookup */
+	unsigned long long latency[STAT_TIMERS][STAT_BUCKETS]; /* histograms of the time taken, in nanoseconds */
+} kb_stats;
+
+/* stages of a request traced by trace.c */
+#define TRACE_TOKENIZE 0 /* splitting the input into words */
+#define TRACE_DISPATCH 1 /* finding the intent */
+#define TRACE_ENTITY   2 /* putting the entity of a question together */
+#define TRACE_LOOKUP   3 /* looking the entity up */
+#define TRACE_HANDLER  4 /* the rest of the command */
+#define TRACE_OUTPUT   5 /* printing the response */
+#define TRACE_STAGES   6
+
+/* mark the end of a stage of the request being traced; when tracing is off, this only tests trace_enabled */
+#define TRACE_MARK(stage)         \
+	do                            \
+	{                             \
+		if (trace_enabled)        \
+			trace_mark(stage);    \
+	} while (0)
+
+/* outcomes of a request, from chatbot_outcome() */
+#define OUTCOME_COMMAND 0 /* not a question */
+#define OUTCOME_HIT     1 /* a question that was answered */
+#define OUTCOME_MISS    2 /* a question that was not answered, and nothing was learned */
+#define OUTCOME_LEARNED 3 /* a question whose response was learned from the user */
+#define OUTCOMES        4
 
 /* functions defined in main.c */
 int compare_token(const char *token1, const char *token2);
-void prompt_user(char *buf, int n, const char *format, ...);
+char *prompt_user(const char *format, ...);
+long read_line(char **buf, size_t *size, FILE *f);
+int tokenize_input(char *input, char *inv[]);
+
+/* defined in main.c: where prompt_user() takes answers from instead of the user, or NULL */
+extern char *(*answer_source)();
 
 /* functions defined in chatbot.c */
 const char *chatbot_botname();
 const char *chatbot_username();
 int chatbot_main(int inc, char *inv[], char *response, int n);
+int chatbot_outcome();
 int chatbot_is_exit(const char *intent);
 int chatbot_do_exit(int inc, char *inv[], char *response, int n);
 int chatbot_is_load(const char *intent);
@@ -49,14 +264,184 @@ int chatbot_is_reset(const char *intent);
 int chatbot_do_reset(int inc, char *inv[], char *response, int n);
 int chatbot_is_save(const char *intent);
 int chatbot_do_save(int inc, char *inv[], char *response, int n);
+int chatbot_is_freeze(const char *intent);
+int chatbot_do_freeze(int inc, char *inv[], char *response, int n);
+int chatbot_is_stats(const char *intent);
+int chatbot_do_stats(int inc, char *inv[], char *response, int n);
+int chatbot_is_budget(const char *intent);
+int chatbot_do_budget(int inc, char *inv[], char *response, int n);
+int chatbot_is_publish(const char *intent);
+int chatbot_do_publish(int inc, char *inv[], char *response, int n);
+int chatbot_is_attach(const char *intent);
+int chatbot_do_attach(int inc, char *inv[], char *response, int n);
+int chatbot_is_trace(const char *intent);
+int chatbot_do_trace(int inc, char *inv[], char *response, int n);
+int chatbot_is_normalize(const char *intent);
+int chatbot_do_normalize(int inc, char *inv[], char *response, int n);
+int chatbot_is_replicate(const char *intent);
+int chatbot_do_replicate(int inc, char *inv[], char *response, int n);
+int chatbot_is_session(const char *intent);
+int chatbot_do_session(int inc, char *inv[], char *response, int n);
 int compare_str_end_with(const char *str, const char *substr);
+int add_load_path(const char *path, char ***file_names, int *count);
+void chatbot_report_load(int data_loaded, char *file_names[], int file_count, char *response, int n);
 
 /* functions defined in knowledge.c */
 int knowledge_get(const char *intent, const char *entity, char *response, int n);
+int knowledge_get_ref(const char *intent, const char *entity, const char **response, size_t *len);
 int knowledge_put(const char *intent, const char *entity, const char *response);
+int knowledge_put_len(const char *intent, const char *entity, size_t entity_len, const char *response, size_t response_len);
+int knowledge_learn(const char *intent, const char *entity, const char *response);
+int knowledge_set_budget(size_t budget);
+size_t knowledge_budget();
+size_t knowledge_max_response();
+int knowledge_freeze(int compressed, size_t *image_size);
+int knowledge_publish(const char *name, int compressed);
+int knowledge_attach(const char *name);
+void knowledge_refresh();
+void knowledge_sizes(size_t entries[MAX_HASHTABLE], size_t *memory);
+const char *knowledge_intent_name(int index);
 void knowledge_reset();
+void knowledge_clear();
+const kb_image *knowledge_image();
+int knowledge_normalize(int flags);
 int knowledge_read(FILE *f);
-void knowledge_write(FILE *f);
+int knowledge_read_files(const char *file_names[], int count);
+kb_parsed *knowledge_parse(char *buffers[], const size_t lens[], int count);
+int knowledge_merge(kb_parsed *parsed);
+int knowledge_diagnostics(const kb_diagnostic **list);
+int knowledge_write(FILE *f);
+int knowledge_save(const char *file_name, kb_save_diff *diff);
 int hash(const char *str);
 
+/* functions defined in intern.c */
+unsigned long long intern_hash(const char *str, size_t len);
+const kb_string *intern(const char *str, size_t len);
+void intern_release(const kb_string *str);
+size_t intern_memory(size_t *count);
+
+/* functions defined in image.c */
+kb_image *image_build(const kb_entry *entries, size_t count, int compressed);
+void image_free(kb_image *image);
+void image_forget(const kb_image *image);
+int image_find(const kb_image *image, int index, const char *key, size_t key_len, unsigned long long h);
+void image_entry_at(const kb_image *image, unsigned int slot, kb_entry *entry);
+const char *image_response(const kb_image *image, unsigned int slot, size_t *len);
+int image_copy_response(const kb_image *image, unsigned int slot, char *buf, size_t n, int keep);
+
+/* functions defined in normalize.c */
+void normalize_set(int flags);
+int normalize_get();
+size_t normalize_entity(const char *entity, size_t len, char *key);
+const char *normalize_cached(const char *entity, size_t len, size_t *key_len);
+
+/* functions defined in shared.c */
+int shared_publish(const char *name, const kb_image *image);
+kb_image *shared_attach(const char *name, unsigned int *generation);
+kb_image *shared_refresh(unsigned int *generation);
+void shared_unmap(kb_image *image);
+void shared_close();
+
+/* functions defined in compress.c */
+int compressor_init(kb_compressor *compressor, const kb_entry *entries, size_t count);
+void compressor_free(kb_compressor *compressor);
+size_t compress_bound(size_t len);
+size_t compress_response(kb_compressor *compressor, const char *in, size_t len, unsigned char *out);
+int decompress_response(const char *dictionary, size_t dictionary_size, const unsigned char *in, size_t in_len,
+						char *out, size_t out_len);
+
+/* functions defined in gzip.c */
+int gzip_named(const char *file_name);
+FILE *gzip_open(const char *file_name, const char *mode, int compressed);
+FILE *gzip_create_beside(const char *file_name, char **temporary);
+
+/* functions defined in benchmark.c */
+int benchmark_main(int argc, char *argv[]);
+
+/* functions defined in embed.c */
+int embed_main(int argc, char *argv[]);
+
+/* defined in embedded.c, which is generated by embed.c: the knowledge the chatbot starts with, or NULL */
+extern const kb_image *const embedded_knowledge;
+
+/* functions defined in stats.c */
+void stats_count(int counter);
+void stats_probe(int probes);
+unsigned long long stats_clock();
+void stats_time(int timer, unsigned long long start);
+int stats_bucket(unsigned long long value);
+unsigned long long stats_percentile(const unsigned long long histogram[STAT_BUCKETS], double fraction);
+void stats_collect(kb_stats *total);
+void stats_report(char *response, int n);
+void stats_write(FILE *f);
+
+/* functions defined in async.c */
+int async_load(char *file_names[], int count);
+int async_save(const char *file_name);
+int async_begin(char *response, int n);
+int async_pending();
+void async_stop();
+
+/* defined in capture.c */
+extern int capture_enabled;
+
+/* functions defined in capture.c */
+int capture_start(const char *file_name);
+void capture_begin(const char *input);
+void capture_answer(const char *answer);
+void capture_skip(unsigned long long since);
+void capture_end(int outcome);
+void capture_stop();
+int replay_main(int argc, char *argv[]);
+
+/* defined in replicate.c */
+extern int replicate_leading;
+
+/* functions defined in replicate.c */
+int replicate_lead(const char *path);
+int replicate_follow(const char *path);
+void replicate_begin();
+void replicate_end();
+void replicate_put(int index, const char *entity, size_t entity_len, const char *response, size_t response_len, int learned);
+void replicate_reset();
+void replicate_normalize(int flags);
+void replicate_stop();
+void replicate_report(char *response, int n);
+
+/* functions defined in session.c */
+void session_select(const char *name);
+const char *session_recall(const char *entity);
+void session_remember(int index, const char *entity);
+void session_forget();
+void session_report(char *response, int n);
+
+/* defined in shard.c */
+extern int route_enabled;
+
+/* functions defined in shard.c */
+int serve_main(int argc, char *argv[]);
+int route_start(int count, char *paths[]);
+void route_stop();
+int route_get(int index, const char *entity, const char **response, size_t *len);
+int route_put(int index, const char *entity, size_t entity_len, const char *response, size_t response_len, int learned,
+			  int batched);
+int route_flush();
+void route_reset();
+int route_fresh(int index, const char *entity, size_t entity_len);
+int route_shards();
+int route_dump(int index, char **data, size_t *len);
+size_t route_max_response();
+
+/* defined in trace.c */
+extern int trace_enabled;
+
+/* functions defined in trace.c */
+int trace_start(unsigned long long threshold, const char *file_name);
+void trace_stop();
+void trace_begin(const char *input);
+void trace_mark(int stage);
+void trace_skip();
+void trace_end();
+void trace_report(char *response, int n);
+
 #endif
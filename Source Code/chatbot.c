@@ -40,10 +40,16 @@
  * returned by these functions at the start of each line.
  */
 
+#include <glob.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "chat1002.h"
 
+// Outcome of the last request, as reported by chatbot_outcome()
+static int last_outcome;
+
 /*
  * Get the name of the chatbot.
  *
@@ -79,6 +85,9 @@ const char *chatbot_username()
 int chatbot_main(int inc, char *inv[], char *response, int n)
 {
 
+	/* anything but a question is a command */
+	last_outcome = OUTCOME_COMMAND;
+
 	/* check for empty input */
 	if (inc < 1)
 	{
@@ -97,13 +106,46 @@ int chatbot_main(int inc, char *inv[], char *response, int n)
 		return chatbot_do_reset(inc, inv, response, n);
 	else if (chatbot_is_save(inv[0]))
 		return chatbot_do_save(inc, inv, response, n);
+	else if (chatbot_is_freeze(inv[0]))
+		return chatbot_do_freeze(inc, inv, response, n);
+	else if (chatbot_is_stats(inv[0]))
+		return chatbot_do_stats(inc, inv, response, n);
+	else if (chatbot_is_budget(inv[0]))
+		return chatbot_do_budget(inc, inv, response, n);
+	else if (chatbot_is_publish(inv[0]))
+		return chatbot_do_publish(inc, inv, response, n);
+	else if (chatbot_is_attach(inv[0]))
+		return chatbot_do_attach(inc, inv, response, n);
+	else if (chatbot_is_trace(inv[0]))
+		return chatbot_do_trace(inc, inv, response, n);
+	else if (chatbot_is_normalize(inv[0]))
+		return chatbot_do_normalize(inc, inv, response, n);
+	else if (chatbot_is_replicate(inv[0]))
+		return chatbot_do_replicate(inc, inv, response, n);
+	else if (chatbot_is_session(inv[0]))
+		return chatbot_do_session(inc, inv, response, n);
 	else
 	{
+		TRACE_MARK(TRACE_DISPATCH);
 		snprintf(response, n, "I don't understand \"%s\".", inv[0]);
 		return 0;
 	}
 }
 
+/*
+ * Get the outcome of the last request given to chatbot_main().
+ *
+ * Returns:
+ *   OUTCOME_HIT, if it was a question that was answered
+ *   OUTCOME_MISS, if it was a question that was not answered, and nothing was learned
+ *   OUTCOME_LEARNED, if it was a question whose response was learned from the user
+ *   OUTCOME_COMMAND, otherwise
+ */
+int chatbot_outcome()
+{
+	return last_outcome;
+}
+
 /*
  * Determine whether an intent is EXIT.
  *
@@ -150,7 +192,15 @@ int chatbot_is_load(const char *intent)
 }
 
 /*
- * Load a chatbot's knowledge base from a file.
+ * Load a chatbot's knowledge base from one or more files. Each file is a
+ * .ini file, a gzip-compressed .ini.gz file, a directory (all of its .ini
+ * and .ini.gz files are loaded) or a wildcard pattern such as '*.ini' or
+ * '[ab]*.ini'; '?' ends a word of input, so it is not a wildcard here.
+ * Files are loaded in parallel, and when an entity appears in more than
+ * one file, the file named last wins. With "background", e.g. "load
+ * background from sample.ini", the files are read while the chatbot keeps
+ * answering, and the knowledge is put into memory before the first command
+ * after they have been.
  *
  * See the comment at the top of the file for a description of how this
  * function is used.
@@ -160,10 +210,14 @@ int chatbot_is_load(const char *intent)
  */
 int chatbot_do_load(int inc, char *inv[], char *response, int n)
 {
-	FILE *f;					// File pointer created to locate the file
 	int data_loaded = 0;		// Counter for number of successful entity and response data loaded into memory
-	char file_name[MAX_ENTITY]; // Temp storage for file name
-	file_name[0] = '\0';
+	char *file_name;			// Temp storage for the file name being assembled from the words of input
+	size_t file_name_size = 1;
+	char **file_names = NULL;	// Names of all files to load
+	int file_count = 0;			// Number of files to load
+	int valid = 1;				// Set to 0 if any file name is not valid
+	int background = 0;			// Set to 1 if the user asked to load in the background
+	int first = 1;				// Index of the first word of the file names
 
 	// If the user only typed in "load" but did not specify filename, prompt the user to include file name
 	if (inc == 1 || inc < 2)
@@ -171,69 +225,225 @@ int chatbot_do_load(int inc, char *inv[], char *response, int n)
 		snprintf(response, n, "There is no file for me to read. Please specify file to load. e.g. 'sample.ini'");
 		return 0;
 	}
-	// If index 2 of user input contains "from", e.g. load from hello.ini, ignore "from"
-	else if (compare_token(inv[1], "from") == 0)
+
+	// Skip "background", e.g. load background hello.ini, then "from", e.g. load from hello.ini
+	if (compare_token(inv[first], "background") == 0)
 	{
-		// Iterate through the words after index 2 ("from") and append the words to file_name
-		for (int i = 2; i < inc; i++)
-		{
-			strcat(file_name, inv[i]);
-			strcat(file_name, " ");
-		}
+		background = 1;
+		first++;
 	}
-	// If index 2 of user input does not contain "from", e.g. load hello.ini
-	else
+	if (first < inc && compare_token(inv[first], "from") == 0)
 	{
-		// Iterate through the words after index 1 (intent) and append the words to file_name
-		for (int i = 1; i < inc; i++)
+		first++;
+	}
+	if (first == inc)
+	{
+		snprintf(response, n, "There is no file for me to read. Please specify file to load. e.g. 'sample.ini'");
+		return 0;
+	}
+
+	// Allocate the file name, which may be of any length
+	for (int i = first; i < inc; i++)
+	{
+		file_name_size += strlen(inv[i]) + 1;
+	}
+	file_name = malloc(file_name_size);
+	if (file_name == NULL)
+	{
+		snprintf(response, n, "There is insufficient memory space. Please clear the knowledge in memory.");
+		return 0;
+	}
+	file_name[0] = '\0';
+
+	// Iterate through the words of the file names
+	for (int i = first; i < inc && valid; i++)
+	{
+		// Append the word to file_name, so that file names may contain spaces
+		if (file_name[0] != '\0')
 		{
-			strcat(file_name, inv[i]);
 			strcat(file_name, " ");
 		}
+		strcat(file_name, inv[i]);
+
+		// A word ending in .ini or .ini.gz, or containing a wildcard, completes a file name
+		if (compare_str_end_with(file_name, ".ini") || compare_str_end_with(file_name, ".ini.gz") || strpbrk(file_name, "*[") != NULL)
+		{
+			valid = add_load_path(file_name, &file_names, &file_count);
+			file_name[0] = '\0';
+		}
 	}
 
-	// Replace extra space with end of string indicator
-	file_name[strlen(file_name) - 1] = '\0';
+	// Any words left over must name a directory of .ini files
+	if (valid && file_name[0] != '\0')
+	{
+		struct stat st;
+		valid = stat(file_name, &st) == 0 && S_ISDIR(st.st_mode) && add_load_path(file_name, &file_names, &file_count);
+	}
 
 	// If specified file is not of type .ini, prompt the user to specify file of type .ini
-	if (!compare_str_end_with(file_name, ".ini") && inc >= 2)
+	if (!valid)
 	{
 		snprintf(response, n, "I cannot read the file. Please upload a .ini file. e.g. 'sample.ini'");
 	}
-	// If specified file is of type .ini, open file
-	else if (compare_str_end_with(file_name, ".ini"))
+	// If a directory or pattern matched no files, inform user that file is not found
+	else if (file_count == 0)
+	{
+		snprintf(response, n, "I cannot find the file. Please upload an existing .ini file.");
+	}
+	// Read and parse the files in the background, leaving them to be put into memory before a later command
+	else if (background)
+	{
+		if (async_load(file_names, file_count) == KB_OK)
+		{
+			snprintf(response, n, "I am reading %d file%s in the background.", file_count, file_count == 1 ? "" : "s");
+		}
+		else
+		{
+			snprintf(response, n, "There is insufficient memory space. Please clear the knowledge in memory.");
+		}
+
+		// The file names have been taken over, even if loading failed
+		file_names = NULL;
+		file_count = 0;
+	}
+	else
+	{
+		// Read knowledge from the files into memory and get the number of successful data loaded into memory
+		data_loaded = knowledge_read_files((const char **)file_names, file_count);
+		chatbot_report_load(data_loaded, file_names, file_count, response, n);
+	}
+
+	for (int i = 0; i < file_count; i++)
+	{
+		free(file_names[i]);
+	}
+	free(file_names);
+	free(file_name);
+
+	return 0;
+}
+
+/*
+ * Describe the outcome of loading knowledge files.
+ *
+ * Input:
+ *   data_loaded - the number of entity/response pairs read, or KB_NOTFOUND or KB_NOMEM
+ *   file_names  - the names of the files
+ *   file_count  - the number of files
+ *   response    - a buffer to receive the description
+ *   n           - the size of the buffer
+ */
+void chatbot_report_load(int data_loaded, char *file_names[], int file_count, char *response, int n)
+{
+	// If a file does not open, inform user that file is not found
+	if (data_loaded == KB_NOTFOUND)
+	{
+		snprintf(response, n, "I cannot find the file. Please upload an existing .ini file.");
+	}
+	// If there is insufficient memory, inform the user that there is insufficient memory space
+	else if (data_loaded == KB_NOMEM)
+	{
+		snprintf(response, n, "There is insufficient memory space. Please clear the knowledge in memory.");
+	}
+	// If knowledge_read operation was successful, inform user of number of successful data loaded into memory
+	else
 	{
-		// Open file in read mode
-		f = fopen(file_name, "r");
+		const kb_diagnostic *diagnostics;
+		int skipped = knowledge_diagnostics(&diagnostics);
+		int len;
 
-		// If file does not open, inform user that file is not found
-		if (f == NULL)
+		if (file_count == 1)
 		{
-			snprintf(response, n, "I cannot find the file. Please upload an existing .ini file.");
+			len = snprintf(response, n, "I have read %d responses from %s", data_loaded, file_names[0]);
 		}
-		// If file is open correctly, read knowledge from file into memory
 		else
 		{
-			// Read knowledge from file into memory and get the number of successful data loaded into memory
-			data_loaded = knowledge_read(f);
+			len = snprintf(response, n, "I have read %d responses from %d files", data_loaded, file_count);
+		}
 
-			// Close file after reading
-			fclose(f);
+		// If any lines could not be read, tell the user how many, and where the first one is
+		if (skipped > 0 && len >= 0 && len < n)
+		{
+			snprintf(response + len, n - len, ", but skipped %d line%s (line %d of %s: %s)", skipped, skipped == 1 ? "" : "s",
+					 diagnostics[0].line, file_names[diagnostics[0].file], diagnostics[0].message);
+		}
+	}
+}
 
-			// If there is insufficient memory, inform the user that there is insufficient memory space
-			if (data_loaded == KB_NOMEM)
-			{
-				snprintf(response, n, "There is insufficient memory space. Please clear the knowledge in memory.");
-			}
-			// If knowledge_read operation was successful, inform user of number of successful data loaded into memory
-			else
+/*
+ * Add the files named by a path to the list of files to load. A directory
+ * adds all of its .ini and .ini.gz files, and a wildcard pattern adds all matching
+ * files, both in sorted order so that loading is deterministic.
+ *
+ * Input:
+ *   path       - the file name, directory or pattern
+ *   file_names - the list of files, grown as needed
+ *   count      - the number of files in the list
+ *
+ * Returns:
+ *   1, if successful
+ *   0, if there was a memory allocation failure
+ */
+int add_load_path(const char *path, char ***file_names, int *count)
+{
+	char *pattern; // Pattern to expand, if any
+	struct stat st;
+	glob_t matches;
+	int flags = 0; // Flags for expanding the pattern
+	int ok = 1;
+
+	// Build the pattern to expand, or add a plain file name as it is
+	if (strpbrk(path, "*[") != NULL)
+	{
+		pattern = strdup(path);
+	}
+	else if (stat(path, &st) == 0 && S_ISDIR(st.st_mode))
+	{
+		pattern = malloc(strlen(path) + sizeof("/*.{ini,ini.gz}"));
+		if (pattern != NULL)
+		{
+			strcat(strcpy(pattern, path), "/*.{ini,ini.gz}");
+		}
+		flags = GLOB_BRACE;
+	}
+	else
+	{
+		char **names = realloc(*file_names, (*count + 1) * sizeof(char *));
+		if (names == NULL)
+		{
+			return 0;
+		}
+		*file_names = names;
+		(*file_names)[*count] = strdup(path);
+		return (*file_names)[(*count)++] != NULL;
+	}
+	if (pattern == NULL)
+	{
+		return 0;
+	}
+
+	// Expand the pattern, adding every match
+	if (glob(pattern, flags, NULL, &matches) == 0)
+	{
+		char **names = realloc(*file_names, (*count + matches.gl_pathc) * sizeof(char *));
+		if (names == NULL)
+		{
+			ok = 0;
+		}
+		else
+		{
+			*file_names = names;
+			for (size_t i = 0; i < matches.gl_pathc && ok; i++)
 			{
-				snprintf(response, n, "I have read %d responses from %s", data_loaded, file_name);
+				(*file_names)[*count] = strdup(matches.gl_pathv[i]);
+				ok = (*file_names)[(*count)++] != NULL;
 			}
 		}
+		globfree(&matches);
 	}
 
-	return 0;
+	free(pattern);
+	return ok;
 }
 
 /*
@@ -256,7 +466,8 @@ int chatbot_is_question(const char *intent)
  *
  * inv[0] contains the the question word.
  * inv[1] may contain "is" or "are"; if so, it is skipped.
- * The remainder of the words form the entity.
+ * The remainder of the words form the entity. An entity such as "it" or
+ * "there", or none at all, is the entity last asked about in the session.
  *
  * See the comment at the top of the file for a description of how this
  * function is used.
@@ -266,14 +477,33 @@ int chatbot_is_question(const char *intent)
  */
 int chatbot_do_question(int inc, char *inv[], char *response, int n)
 {
-	char intent[MAX_INTENT], entity[MAX_ENTITY], article[4]; // Temp storage for intent, article ("is" or "are") and entity
-	intent[0] = '\0';
-	entity[0] = '\0';
-	article[0] = '\0';
+	const char *intent = inv[0], *article = ""; // Intent and article ("is" or "are") from user input
+	const char *subject;						// The entity, or the entity it refers to
+	char *entity;								// Temp storage for entity, sized to hold all words of input
+	size_t entity_size = 1;
+	char *answer;								// New response from the user
 	int get_result, put_result;
 
-	// If the user input a single word and it is "what", "where" or "who", prompt user to enter a full question
-	if (inc == 1)
+	// The intent has been found, and the time since tokenizing was spent finding it
+	TRACE_MARK(TRACE_DISPATCH);
+	last_outcome = OUTCOME_MISS;
+
+	// Allocate the entity, which may be of any length
+	for (int i = 1; i < inc; i++)
+	{
+		entity_size += strlen(inv[i]) + 1;
+	}
+	entity = malloc(entity_size);
+	if (entity == NULL)
+	{
+		snprintf(response, n, "Insufficient memory space. Please clear the knowledge in memory.");
+		return 0;
+	}
+	entity[0] = '\0';
+
+	// If the user input a single word and it is "what", "where" or "who", prompt user to enter a full question,
+	// unless it follows up on an entity, e.g. "where?" after "what is SIT?"
+	if (inc == 1 && session_recall("") == NULL)
 	{
 		if (compare_token(inv[0], "what") == 0)
 		{
@@ -288,6 +518,7 @@ int chatbot_do_question(int inc, char *inv[], char *response, int n)
 			snprintf(response, n, "I do not understand the phrase. Please enter a question. e.g. 'Who is Frank Guan?'");
 		}
 
+		free(entity);
 		return 0;
 	}
 	// If the user input 2 words without an entity, check for article
@@ -297,16 +528,14 @@ int chatbot_do_question(int inc, char *inv[], char *response, int n)
 		if ((compare_token(inv[1], "is") == 0) || (compare_token(inv[1], "are") == 0))
 		{
 			snprintf(response, n, "Missing Noun. Please re-enter the question.");
+			free(entity);
 			return 0;
 		}
 		// If user input does not include an article, e.g. "What SIT", save intent and entity from user input
 		else
 		{
-			// Store intent and entity from user input
-			strcpy(intent, inv[0]);
+			// Store entity from user input
 			strcpy(entity, inv[1]);
-			intent[strlen(intent)] = '\0';
-			entity[strlen(entity)] = '\0';
 		}
 	}
 	// If the user input a 3 or more words, check if 2nd word of user input is a "is" or "are"
@@ -315,10 +544,8 @@ int chatbot_do_question(int inc, char *inv[], char *response, int n)
 		// If 2nd word of user input is a "is" or "are", store intent, article and entity
 		if ((compare_token(inv[1], "is") == 0 || compare_token(inv[1], "are") == 0))
 		{
-			// Store the intent and article from user input
-			strcpy(intent, inv[0]);
-			strcpy(article, inv[1]);
-			article[strlen(article)] = '\0';
+			// Store the article from user input
+			article = inv[1];
 
 			// Iterate through the words after index 2 (article) and append the words to entity
 			for (int i = 2; i < inc; i++)
@@ -330,9 +557,6 @@ int chatbot_do_question(int inc, char *inv[], char *response, int n)
 		// If 2nd word of user input is not a "is" or "are", store intent and entity
 		else
 		{
-			// Store the intent from user input
-			strcpy(intent, inv[0]);
-
 			// Iterate through the words after index 1 (intent) and append the words to entity
 			for (int i = 1; i < inc; i++)
 			{
@@ -341,38 +565,72 @@ int chatbot_do_question(int inc, char *inv[], char *response, int n)
 			}
 		}
 
-		intent[strlen(intent)] = '\0';
 		entity[strlen(entity) - 1] = '\0';
 	}
 
+	// Resolve a reference such as "it" to the entity last asked about, rather than learning a response for "it"
+	subject = session_recall(entity);
+
 	// Get knowledge from memory and get the outcome of the operation
-	get_result = knowledge_get(intent, entity, response, n);
+	TRACE_MARK(TRACE_ENTITY);
+	get_result = subject == NULL ? KB_NOTFOUND : knowledge_get(intent, subject, response, n);
 
-	// If knowledge_get operation was successful, return 0
-	if (get_result == KB_OK)
+	// A reference with nothing to refer to is looked up as it is, and is only asked about by name if it is unknown
+	if (subject == NULL && (entity[0] == '\0' || (get_result = knowledge_get(intent, entity, response, n)) == KB_NOTFOUND))
 	{
+		snprintf(response, n, "I am not sure what \"%s\" is. Please ask about it by name.", entity);
+		free(entity);
 		return 0;
 	}
+	if (subject == NULL)
+	{
+		subject = entity;
+	}
+	TRACE_MARK(TRACE_LOOKUP);
+
+	// Remember what was asked about, so that the next question may refer to it
+	if (get_result != KB_INVALID)
+	{
+		session_remember(hash(intent), subject);
+	}
+
+	// If knowledge_get operation was successful, the response is already in the response buffer
+	if (get_result == KB_OK)
+	{
+		last_outcome = OUTCOME_HIT;
+	}
+	// If the response does not fit into the response buffer, inform the user of error
+	else if (get_result == KB_TOOLONG)
+	{
+		snprintf(response, n, "My answer is too long to show here.");
+	}
 	// If knowledge_read operation was successful due to knowledge not found, prompt user for new response to question
 	else if (get_result == KB_NOTFOUND)
 	{
 		// If article is not empty, prompt user for new response with intent, article and entity
 		if (article[0] != '\0')
 		{
-			prompt_user(response, MAX_RESPONSE, "I don't know. %s %s %s?", intent, article, entity);
+			answer = prompt_user("I don't know. %s %s %s?", intent, article, subject);
 		}
 		// If article is empty, prompt user for new response with intent and entity
 		else
 		{
-			prompt_user(response, MAX_RESPONSE, "I don't know. %s %s?", intent, entity);
+			answer = prompt_user("I don't know. %s %s?", intent, subject);
 		}
 
 		// Put knowledge with new response from user into memory and get the outcome of the operation
-		put_result = knowledge_put(intent, entity, response);
+		put_result = answer == NULL ? KB_NOTFOUND : knowledge_learn(intent, subject, answer);
 
+		// If the user did not answer before the end of input, nothing is learned
+		if (put_result == KB_NOTFOUND)
+		{
+			snprintf(response, n, "I did not get a response.");
+		}
 		// If knowledge_put operation was successful, thank the user
 		if (put_result == KB_OK)
 		{
+			stats_count(STAT_LEARNED);
+			last_outcome = OUTCOME_LEARNED;
 			snprintf(response, n, "Thank you for the response.");
 		}
 		// If knowledge_put operation was unsuccessful due to invalid intent, inform the user of error
@@ -380,11 +638,26 @@ int chatbot_do_question(int inc, char *inv[], char *response, int n)
 		{
 			snprintf(response, n, "Unknown Question, please re-type.");
 		}
+		// If the response does not fit in the memory budget, even after forgetting other learned responses, say so
+		else if (put_result == KB_NOMEM && knowledge_budget() > 0)
+		{
+			snprintf(response, n, "That does not fit in my memory budget. Please raise it or clear the knowledge in memory.");
+		}
 		// If knowledge_put operation was unsuccessful due to lack of memory, inform the user of error
 		else if (put_result == KB_NOMEM)
 		{
 			snprintf(response, n, "Insufficient memory space. Please clear the knowledge in memory.");
 		}
+		// If the backend that would keep the response cannot be reached, say that it was not learned
+		else if (put_result == KB_UNAVAILABLE)
+		{
+			snprintf(response, n, "The part of my knowledge that would keep that is unavailable, so I could not learn it. Please try again later.");
+		}
+	}
+	// If the backend that owns the question cannot be reached, say so rather than asking to learn what may be known
+	else if (get_result == KB_UNAVAILABLE)
+	{
+		snprintf(response, n, "The part of my knowledge that answers that is unavailable. Please try again later.");
 	}
 	// If knowledge_get operation was unsuccessful due to invalid intent, inform the user of error
 	else if (get_result == KB_INVALID)
@@ -392,6 +665,7 @@ int chatbot_do_question(int inc, char *inv[], char *response, int n)
 		snprintf(response, n, "Invalid Intent.");
 	}
 
+	free(entity);
 	return 0;
 }
 
@@ -448,7 +722,12 @@ int chatbot_is_save(const char *intent)
 }
 
 /*
- * Save the chatbot's knowledge to a file.
+ * Save the chatbot's knowledge to a file. With "diff", e.g.
+ * "save diff to sample.ini", the file is only written if the knowledge
+ * differs from it, and the entities added, removed and changed are
+ * counted. With "background", e.g. "save background to sample.ini", the
+ * knowledge is copied at once, and written while the chatbot keeps
+ * answering. A file named *.ini.gz is compressed as it is written.
  *
  * See the comment at the top of the file for a description of how this
  * function is used.
@@ -459,9 +738,10 @@ int chatbot_is_save(const char *intent)
  */
 int chatbot_do_save(int inc, char *inv[], char *response, int n)
 {
-	FILE *f;					// File pointer created to locate the file
-	char file_name[MAX_ENTITY]; // Temp storage for file name
-	file_name[0] = '\0';
+	FILE *f;					   // File pointer created to locate the file
+	const char *file_name = NULL; // File name, taken from the user input
+	int diff_mode = 0;			   // Set to 1 if the user asked to save only the differences
+	int background = 0;		   // Set to 1 if the user asked to save in the background
 
 	// If the user only typed in "save" but did not specify filename, prompt the user to include file name
 	if (inc == 1 || inc < 2)
@@ -473,42 +753,222 @@ int chatbot_do_save(int inc, char *inv[], char *response, int n)
 		// Iterate through the user input
 		for (int i = 0; i < inc; i++)
 		{
-			// If the word in the user input contains .ini, save word to file_name
-			if (compare_str_end_with(inv[i], ".ini"))
+			// If the word in the user input ends with .ini, or .ini.gz to compress the file, save word to file_name
+			if (compare_str_end_with(inv[i], ".ini") || compare_str_end_with(inv[i], ".ini.gz"))
 			{
-				strcpy(file_name, inv[i]);
-				file_name[strlen(file_name)] = '\0';
+				file_name = inv[i];
+			}
+			// If the word is "diff", only save the differences
+			else if (compare_token(inv[i], "diff") == 0)
+			{
+				diff_mode = 1;
+			}
+			// If the word is "background", write the file while answering
+			else if (compare_token(inv[i], "background") == 0)
+			{
+				background = 1;
 			}
 		}
 
 		// If specified file is not of type .ini, prompt the user to specify file of type .ini
-		if (file_name[0] == '\0')
+		if (file_name == NULL)
 		{
 			snprintf(response, n, "I cannot read the file. Please upload a .ini file. e.g. 'sample.ini'");
 		}
+		// In diff mode, merge the knowledge against the file and describe what changed
+		else if (diff_mode)
+		{
+			kb_save_diff diff;
+			int result = knowledge_save(file_name, &diff);
+			if (result == KB_NOMEM)
+			{
+				snprintf(response, n, "Memory allocation failure, %s is unchanged.", file_name);
+			}
+			else if (result == KB_UNAVAILABLE)
+			{
+				snprintf(response, n, "Part of my knowledge is unavailable, so %s is unchanged. Please try again later.", file_name);
+			}
+			else if (result != KB_OK)
+			{
+				snprintf(response, n, "I am unable to open/create file. Please try again.");
+			}
+			else if (diff.added == 0 && diff.removed == 0 && diff.changed == 0)
+			{
+				snprintf(response, n, "%s already holds my knowledge.", file_name);
+			}
+			else
+			{
+				snprintf(response, n, "My knowledge has been saved to %s: %zu added, %zu removed, %zu changed.", file_name,
+						 diff.added, diff.removed, diff.changed);
+			}
+		}
+		// In the background, copy the knowledge now and write it while answering
+		else if (background)
+		{
+			int result = async_save(file_name);
+			if (result == KB_OK)
+			{
+				snprintf(response, n, "I am saving my knowledge to %s in the background.", file_name);
+			}
+			else if (result == KB_UNAVAILABLE)
+			{
+				snprintf(response, n, "Part of my knowledge is unavailable, so %s could not be saved. Please try again later.", file_name);
+			}
+			else
+			{
+				snprintf(response, n, "Memory allocation failure, %s could not be saved.", file_name);
+			}
+		}
 		// If specified file is of type .ini, open and write to file
 		else
 		{
-			// Open/create file in write mode with user specified file name
-			f = fopen(file_name, "w");
+			// Open/create file in write mode with user specified file name, compressing it if it ends with .gz
+			f = gzip_open(file_name, "w", gzip_named(file_name));
 
 			// If file is open correctly, write knowledge from memory into file
 			if (f != NULL)
 			{
-				// Write knowledge from memory into file
-				knowledge_write(f);
+				// Write knowledge from memory into file, and inform user whether the knowledge_write operation was successful
+				int result = knowledge_write(f);
 
-				// Inform user that knowledge_write operation was successful
-				snprintf(response, n, "My knowledge has been saved to %s", file_name);
+				// Close the file after writing, which finishes compressing it
+				if (fclose(f) != 0)
+				{
+					snprintf(response, n, "I am unable to write %s. Please try again.", file_name);
+				}
+				else if (result == KB_OK)
+				{
+					snprintf(response, n, "My knowledge has been saved to %s", file_name);
+				}
+				else if (result == KB_UNAVAILABLE)
+				{
+					snprintf(response, n, "Part of my knowledge is unavailable, so %s could not be saved. Please try again later.", file_name);
+				}
+				else
+				{
+					snprintf(response, n, "Memory allocation failure, %s could not be saved.", file_name);
+				}
 			}
 			// If file does not open, inform user that file is unable to be opened/created
 			else
 			{
 				snprintf(response, n, "I am unable to open/create file. Please try again.");
 			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Determine whether an intent is FREEZE.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "freeze"
+ *  0, otherwise
+ *
+ */
+int chatbot_is_freeze(const char *intent)
+{
+	return compare_token(intent, "freeze") == 0;
+}
+
+/*
+ * Freeze the chatbot's knowledge into a read-only index for fast answers.
+ * The chatbot can still learn afterwards; new responses are kept apart
+ * until the next freeze. "freeze compressed" also compresses the
+ * responses, to keep a large knowledge base in less memory.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after freezing knowledge)
+ *
+ */
+int chatbot_do_freeze(int inc, char *inv[], char *response, int n)
+{
+	size_t image_size;
+	int compressed = inc > 1 && compare_token(inv[1], "compressed") == 0;
+	int frozen = knowledge_freeze(compressed, &image_size);
+
+	// If there is insufficient memory, inform the user that nothing was frozen
+	if (frozen == KB_NOMEM)
+	{
+		snprintf(response, n, "There is insufficient memory space to freeze my knowledge.");
+	}
+	else
+	{
+		snprintf(response, n, "I have frozen %d responses into a %sread-only index of %zu bytes.", frozen,
+				 compressed ? "compressed " : "", image_size);
+	}
+
+	return 0;
+}
+
+/*
+ * Determine whether an intent is STATS.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "stats"
+ *  0, otherwise
+ *
+ */
+int chatbot_is_stats(const char *intent)
+{
+	return compare_token(intent, "stats") == 0;
+}
+
+/*
+ * Report statistics of the chatbot's knowledge base. With a .json file
+ * name, e.g. "stats to stats.json", all statistics are written to that file
+ * for other programs to read; otherwise they are summarised in the response.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after reporting statistics)
+ *
+ */
+int chatbot_do_stats(int inc, char *inv[], char *response, int n)
+{
+	const char *file_name = NULL; // File name, taken from the user input
+
+	// Iterate through the user input for a .json file name
+	for (int i = 1; i < inc; i++)
+	{
+		if (compare_str_end_with(inv[i], ".json"))
+		{
+			file_name = inv[i];
+		}
+	}
+
+	// If no file is given, summarise the statistics
+	if (file_name == NULL)
+	{
+		stats_report(response, n);
+	}
+	// If a file is given, write the statistics to it
+	else
+	{
+		FILE *f = fopen(file_name, "w");
 
-			// Close the file after writing
+		if (f != NULL)
+		{
+			stats_write(f);
 			fclose(f);
+			snprintf(response, n, "My statistics have been saved to %s", file_name);
+		}
+		else
+		{
+			snprintf(response, n, "I am unable to open/create file. Please try again.");
 		}
 	}
 
@@ -539,4 +999,539 @@ int compare_str_end_with(const char *str, const char *substr)
 
 	// If string length is less than substring length, return 0
 	return 0;
+}
+
+/*
+ * Determine whether an intent is BUDGET.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "budget"
+ *  0, otherwise
+ *
+ */
+int chatbot_is_budget(const char *intent)
+{
+	return compare_token(intent, "budget") == 0;
+}
+
+/*
+ * Set or show the memory budget of the chatbot's knowledge, e.g.
+ * "budget 2 MB", "budget 500000" or "budget off". When the knowledge
+ * outgrows the budget, the responses learned from the user that were used
+ * least recently are forgotten; responses loaded from files never are.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after setting the budget)
+ *
+ */
+int chatbot_do_budget(int inc, char *inv[], char *response, int n)
+{
+	size_t entries[MAX_HASHTABLE], memory;
+	char unit[8] = "";
+	double amount;
+
+	// Without a budget given, show the current one
+	if (inc < 2)
+	{
+		knowledge_sizes(entries, &memory);
+		if (knowledge_budget() == 0)
+		{
+			snprintf(response, n, "My knowledge uses %zu bytes, with no budget.", memory);
+		}
+		else
+		{
+			snprintf(response, n, "My knowledge uses %zu of its budget of %zu bytes.", memory, knowledge_budget());
+		}
+		return 0;
+	}
+
+	// Read the budget as a number of bytes, optionally followed by B, KB, MB or GB, or "off" for no budget
+	if (compare_token(inv[1], "off") == 0 || compare_token(inv[1], "none") == 0)
+	{
+		amount = 0;
+	}
+	else if (sscanf(inv[1], "%lf%7s", &amount, unit) < 1 || amount < 0 || inc > (unit[0] == '\0' ? 3 : 2) ||
+			 (inc > 2 && strlen(inv[2]) >= sizeof(unit)))
+	{
+		snprintf(response, n, "Please give a budget such as \"budget 2 MB\", or \"budget off\".");
+		return 0;
+	}
+	else
+	{
+		if (unit[0] == '\0' && inc > 2)
+		{
+			snprintf(unit, sizeof(unit), "%s", inv[2]);
+		}
+
+		// Any other unit is a mistake, rather than a number of bytes, so the learned responses are not all forgotten
+		if (unit[0] != '\0' && compare_token(unit, "B") != 0 && compare_token(unit, "KB") != 0 &&
+			compare_token(unit, "MB") != 0 && compare_token(unit, "GB") != 0)
+		{
+			snprintf(response, n, "Please give a budget such as \"budget 2 MB\", or \"budget off\".");
+			return 0;
+		}
+		if (compare_token(unit, "KB") == 0)
+		{
+			amount *= 1024;
+		}
+		else if (compare_token(unit, "MB") == 0)
+		{
+			amount *= 1024 * 1024;
+		}
+		else if (compare_token(unit, "GB") == 0)
+		{
+			amount *= 1024.0 * 1024 * 1024;
+		}
+	}
+
+	int evicted = knowledge_set_budget((size_t)amount);
+	knowledge_sizes(entries, &memory);
+	if (amount == 0)
+	{
+		snprintf(response, n, "My knowledge now has no budget, and uses %zu bytes.", memory);
+	}
+	else
+	{
+		snprintf(response, n, "My knowledge now has a budget of %zu bytes, and uses %zu after forgetting %d learned responses.",
+				 (size_t)amount, memory, evicted);
+	}
+
+	return 0;
+}
+
+/*
+ * Determine whether an intent is PUBLISH.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "publish"
+ *  0, otherwise
+ *
+ */
+int chatbot_is_publish(const char *intent)
+{
+	return compare_token(intent, "publish") == 0;
+}
+
+/*
+ * Publish the chatbot's knowledge in shared memory for other chatbots on
+ * this host, e.g. "publish as campus" or "publish campus compressed". The
+ * knowledge is frozen first. Chatbots attached to the same name switch to
+ * it before their next command.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after publishing)
+ *
+ */
+int chatbot_do_publish(int inc, char *inv[], char *response, int n)
+{
+	const char *name = NULL; // Name of the shared knowledge base, taken from the user input
+	int compressed = 0;
+
+	// Take the first word that is not "as" or "compressed" as the name
+	for (int i = 1; i < inc; i++)
+	{
+		if (compare_token(inv[i], "compressed") == 0)
+		{
+			compressed = 1;
+		}
+		else if (name == NULL && compare_token(inv[i], "as") != 0)
+		{
+			name = inv[i];
+		}
+	}
+
+	if (name == NULL)
+	{
+		snprintf(response, n, "Please name the knowledge to publish, e.g. \"publish as campus\".");
+		return 0;
+	}
+
+	int generation = knowledge_publish(name, compressed);
+	if (generation == KB_INVALID)
+	{
+		snprintf(response, n, "\"%s\" cannot be used as a name. Please use only letters, digits, '-' and '_'.", name);
+	}
+	else if (generation == KB_NOMEM)
+	{
+		snprintf(response, n, "There is insufficient memory space to publish my knowledge.");
+	}
+	else
+	{
+		snprintf(response, n, "I have published my knowledge as %s, generation %d.", name, generation);
+	}
+
+	return 0;
+}
+
+/*
+ * Determine whether an intent is ATTACH.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "attach"
+ *  0, otherwise
+ *
+ */
+int chatbot_is_attach(const char *intent)
+{
+	return compare_token(intent, "attach") == 0;
+}
+
+/*
+ * Answer from knowledge published by another chatbot on this host, e.g.
+ * "attach to campus". The shared knowledge is used in place, without a
+ * copy, and whatever the chatbot learns is kept on top of it. The chatbot
+ * follows every new publication until it is reset or frozen.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after attaching)
+ *
+ */
+int chatbot_do_attach(int inc, char *inv[], char *response, int n)
+{
+	// Skip the word "to", if given
+	const char *name = inc > 2 && compare_token(inv[1], "to") == 0 ? inv[2] : inc > 1 ? inv[1] : NULL;
+
+	if (name == NULL)
+	{
+		snprintf(response, n, "Please name the knowledge to attach to, e.g. \"attach to campus\".");
+		return 0;
+	}
+
+	int count = knowledge_attach(name);
+	if (count == KB_NOTFOUND)
+	{
+		snprintf(response, n, "No knowledge has been published as %s.", name);
+	}
+	else
+	{
+		snprintf(response, n, "I am now answering from %d responses published as %s.", count, name);
+	}
+
+	return 0;
+}
+
+/*
+ * Determine whether an intent is TRACE.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "trace"
+ *  0, otherwise
+ *
+ */
+int chatbot_is_trace(const char *intent)
+{
+	return compare_token(intent, "trace") == 0;
+}
+
+/*
+ * Trace where the time of each request goes. "trace on" starts tracing,
+ * optionally with the threshold in microseconds above which a request is
+ * written to the trace file, and the name of that file, e.g.
+ * "trace on 500 slow.log". "trace off" stops it, and "trace" alone
+ * describes what was traced.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after tracing)
+ *
+ */
+int chatbot_do_trace(int inc, char *inv[], char *response, int n)
+{
+	unsigned long long threshold = KB_TRACE_THRESHOLD; // Threshold in microseconds, taken from the user input
+	const char *file_name = "trace.log";				 // Trace file, taken from the user input
+
+	if (inc > 1 && compare_token(inv[1], "on") == 0)
+	{
+		// Take a number as the threshold, and anything else as the file name
+		for (int i = 2; i < inc; i++)
+		{
+			char *end;
+			unsigned long long value = strtoull(inv[i], &end, 10);
+			if (*end == '\0')
+			{
+				threshold = value;
+			}
+			else
+			{
+				file_name = inv[i];
+			}
+		}
+
+		if (trace_start(threshold * 1000, file_name) == KB_OK)
+		{
+			snprintf(response, n, "I am tracing requests, writing those over %llu us to %s.", threshold, file_name);
+		}
+		else
+		{
+			snprintf(response, n, "I am unable to open/create file. Please try again.");
+		}
+	}
+	else if (inc > 1 && compare_token(inv[1], "off") == 0)
+	{
+		trace_stop();
+		trace_report(response, n);
+	}
+	else
+	{
+		trace_report(response, n);
+	}
+
+	return 0;
+}
+
+// Names of the steps of the normalization, in the order of their flags from NORM_SPACE
+static const char *normalize_steps[] = {"space", "punctuation", "articles", "possessives", "plurals", "unicode"};
+
+/*
+ * Determine whether an intent is NORMALIZE.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "normalize"
+ *  0, otherwise
+ *
+ */
+int chatbot_is_normalize(const char *intent)
+{
+	return compare_token(intent, "normalize") == 0;
+}
+
+/*
+ * Choose how entities are normalized before they are matched, e.g.
+ * "normalize space punctuation articles", "normalize default" or
+ * "normalize off", which only ignores case. "normalize" alone shows the
+ * steps in use.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after normalizing)
+ *
+ */
+int chatbot_do_normalize(int inc, char *inv[], char *response, int n)
+{
+	int flags = 0;
+
+	// Read the steps, by name
+	for (int i = 1; i < inc; i++)
+	{
+		int step = -1;
+		for (int j = 0; j < (int)(sizeof(normalize_steps) / sizeof(normalize_steps[0])); j++)
+		{
+			if (compare_token(inv[i], normalize_steps[j]) == 0)
+			{
+				step = j;
+			}
+		}
+
+		if (step >= 0)
+		{
+			flags |= 1 << step;
+		}
+		else if (compare_token(inv[i], "default") == 0)
+		{
+			flags |= NORM_DEFAULT;
+		}
+		else if (compare_token(inv[i], "all") == 0)
+		{
+			flags |= (1 << (int)(sizeof(normalize_steps) / sizeof(normalize_steps[0]))) - 1;
+		}
+		else if (compare_token(inv[i], "off") != 0 && compare_token(inv[i], "none") != 0)
+		{
+			snprintf(response, n, "I don't know how to normalize by \"%s\". Please choose from space, punctuation, articles, possessives, plurals and unicode.", inv[i]);
+			return 0;
+		}
+	}
+
+	int result = inc > 1 ? knowledge_normalize(flags) : KB_OK;
+	if (result == KB_INVALID)
+	{
+		snprintf(response, n, "My knowledge is spread over several backends by its keys, so I cannot change how I match entities.");
+		return 0;
+	}
+	else if (result != KB_OK)
+	{
+		snprintf(response, n, "Memory allocation failure, some entities may not be found until you reset.");
+		return 0;
+	}
+
+	// Describe the steps now in use
+	if (normalize_get() == 0)
+	{
+		snprintf(response, n, "I match entities ignoring case only.");
+		return 0;
+	}
+	int written = snprintf(response, n, "I match entities ignoring case and normalizing");
+	const char *separator = ":";
+	for (int j = 0; j < (int)(sizeof(normalize_steps) / sizeof(normalize_steps[0])) && written >= 0 && written < n; j++)
+	{
+		if (normalize_get() & (1 << j))
+		{
+			written += snprintf(response + written, n - written, "%s %s", separator, normalize_steps[j]);
+			separator = ",";
+		}
+	}
+	if (written >= 0 && written < n)
+	{
+		snprintf(response + written, n - written, ".");
+	}
+
+	return 0;
+}
+
+/*
+ * Determine whether an intent is REPLICATE.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "replicate"
+ *  0, otherwise
+ *
+ */
+int chatbot_is_replicate(const char *intent)
+{
+	return compare_token(intent, "replicate") == 0;
+}
+
+/*
+ * Replicate the chatbot's knowledge between processes on this host.
+ * "replicate lead chatbot.sock" sends every change to the knowledge to the
+ * processes that follow this one; "replicate follow chatbot.sock" replaces
+ * this process's knowledge with the leader's, and keeps it up to date.
+ * "replicate off" stops, and "replicate" alone describes the replication.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after replicating)
+ *
+ */
+int chatbot_do_replicate(int inc, char *inv[], char *response, int n)
+{
+	int result;
+
+	if (inc > 2 && compare_token(inv[1], "lead") == 0)
+	{
+		result = replicate_lead(inv[2]);
+		if (result == KB_OK)
+		{
+			replicate_report(response, n);
+		}
+		else if (result == KB_INVALID)
+		{
+			snprintf(response, n, "I cannot lead on %s. Am I leading already?", inv[2]);
+		}
+		else
+		{
+			snprintf(response, n, "I am unable to create %s. Please try again.", inv[2]);
+		}
+	}
+	else if (inc > 2 && compare_token(inv[1], "follow") == 0)
+	{
+		result = replicate_follow(inv[2]);
+		if (result >= 0)
+		{
+			snprintf(response, n, "I am following %s, starting with its %d responses.", inv[2], result);
+		}
+		else if (result == KB_INVALID)
+		{
+			snprintf(response, n, "I cannot follow %s. Am I following already?", inv[2]);
+		}
+		else if (result == KB_NOMEM)
+		{
+			snprintf(response, n, "Memory allocation failure.");
+		}
+		else
+		{
+			snprintf(response, n, "No chatbot is leading on %s.", inv[2]);
+		}
+	}
+	else if (inc > 1 && compare_token(inv[1], "off") == 0)
+	{
+		replicate_stop();
+		replicate_report(response, n);
+	}
+	else if (inc > 1)
+	{
+		snprintf(response, n, "Please say \"replicate lead FILE\", \"replicate follow FILE\" or \"replicate off\".");
+	}
+	else
+	{
+		replicate_report(response, n);
+	}
+
+	return 0;
+}
+
+/*
+ * Determine whether an intent is SESSION.
+ *
+ * Input:
+ *  intent - the intent
+ *
+ * Returns:
+ *  1, if the intent is "session"
+ *  0, otherwise
+ *
+ */
+int chatbot_is_session(const char *intent)
+{
+	return compare_token(intent, "session") == 0;
+}
+
+/*
+ * Switch between conversations, each of which remembers what it last asked
+ * about. "session NAME" switches to the session NAME, "session forget"
+ * forgets what the current session asked about, and "session" alone
+ * describes it.
+ *
+ * See the comment at the top of the file for a description of how this
+ * function is used.
+ *
+ * Returns:
+ *   0 (the chatbot always continues chatting after switching sessions)
+ *
+ */
+int chatbot_do_session(int inc, char *inv[], char *response, int n)
+{
+	if (inc > 1 && compare_token(inv[1], "forget") == 0)
+	{
+		session_forget();
+	}
+	else if (inc > 1)
+	{
+		session_select(inv[1]);
+	}
+
+	session_report(response, n);
+	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,394 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the compression of responses in frozen images.
+ * Responses are short, so each one is compressed on its own against a
+ * dictionary shared by the whole image. The dictionary is trained from the
+ * responses themselves, so phrases that many responses have in common are
+ * stored once and referred to by every response that uses them.
+ *
+ * A compressed response is a sequence of tokens:
+ *   0x00-0x7F  a run of 1 to 128 literal characters, which follow
+ *   0x80-0xFF  a match of 4 to 131 characters, followed by a 2-byte distance
+ *              (low byte first) back into the dictionary and the output so far
+ *
+ * compressor_init() trains a dictionary and prepares to compress with it.
+ * compress_response() compresses a response.
+ * compress_bound() gives the largest size of a compressed response.
+ * decompress_response() restores a response into a buffer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+
+// Define the shortest and longest match, and the bits of the hash of the first characters of a match
+#define MIN_MATCH 4
+#define MAX_MATCH (MIN_MATCH + 127)
+#define MAX_LITERALS 128
+#define HASH_BITS 14
+
+// Define the length of the segments of responses considered for the dictionary, and of the substrings that score them
+#define SEGMENT_SIZE 64
+#define GRAM_SIZE 8
+#define GRAM_BITS 16
+
+// Define a candidate segment of a response for the dictionary
+typedef struct segment
+{
+	const char *start;
+	size_t len;
+	unsigned long long score;
+} segment;
+
+// Utility function to hash the first MIN_MATCH characters at a position
+static unsigned int hash4(const unsigned char *p)
+{
+	unsigned int v = p[0] | p[1] << 8 | p[2] << 16 | (unsigned int)p[3] << 24;
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// Utility function to hash the GRAM_SIZE characters at a position
+static unsigned int hash_gram(const char *p)
+{
+	return (unsigned int)(intern_hash(p, GRAM_SIZE) >> (64 - GRAM_BITS));
+}
+
+// Utility function to score a segment by how often its substrings occur in all responses
+static unsigned long long score_segment(const segment *seg, const unsigned int *counts)
+{
+	unsigned long long score = 0;
+	for (size_t i = 0; i + GRAM_SIZE <= seg->len; i++)
+	{
+		score += counts[hash_gram(seg->start + i)];
+	}
+	return score;
+}
+
+// Utility function to order segments from the highest score to the lowest
+static int compare_segments(const void *a, const void *b)
+{
+	const segment *x = a, *y = b;
+	return x->score < y->score ? 1 : x->score > y->score ? -1 : 0;
+}
+
+/*
+ * Train a dictionary from responses. Responses are cut into segments, each
+ * segment is scored by how often its substrings occur across all responses,
+ * and the best segments are taken until the dictionary is full. Once a
+ * segment is taken, its substrings no longer count, so the dictionary does
+ * not fill up with copies of the same phrase.
+ *
+ * Input:
+ *   entries    - the entities, whose responses are used
+ *   count      - the number of entities
+ *   dictionary - receives the dictionary, of up to KB_DICTIONARY_SIZE characters
+ *
+ * Returns: the size of the dictionary
+ */
+static size_t train_dictionary(const kb_entry *entries, size_t count, char *dictionary)
+{
+	unsigned int *counts = calloc((size_t)1 << GRAM_BITS, sizeof(unsigned int));
+	size_t segment_count = 0, size = 0;
+
+	for (size_t i = 0; i < count; i++)
+	{
+		segment_count += entries[i].response_len / SEGMENT_SIZE + 1;
+	}
+	segment *segments = malloc(segment_count * sizeof(segment));
+
+	// If there is insufficient memory, go without a dictionary
+	if (counts == NULL || segments == NULL)
+	{
+		free(counts);
+		free(segments);
+		return 0;
+	}
+
+	// Count the substrings of all responses, and cut the responses into segments
+	segment_count = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		const char *response = entries[i].response;
+		size_t len = entries[i].response_len;
+
+		for (size_t j = 0; j + GRAM_SIZE <= len; j++)
+		{
+			counts[hash_gram(response + j)]++;
+		}
+		for (size_t j = 0; j < len; j += SEGMENT_SIZE)
+		{
+			segments[segment_count].start = response + j;
+			segments[segment_count].len = len - j < SEGMENT_SIZE ? len - j : SEGMENT_SIZE;
+			segment_count++;
+		}
+	}
+
+	// Substrings that occur once are of no use in a shared dictionary
+	for (size_t i = 0; i < ((size_t)1 << GRAM_BITS); i++)
+	{
+		if (counts[i] < 2)
+		{
+			counts[i] = 0;
+		}
+	}
+
+	for (size_t i = 0; i < segment_count; i++)
+	{
+		segments[i].score = score_segment(&segments[i], counts);
+	}
+	qsort(segments, segment_count, sizeof(segment), compare_segments);
+
+	// Take the best segments that still score, forgetting the substrings of each one taken
+	for (size_t i = 0; i < segment_count && segments[i].score > 0; i++)
+	{
+		if (size + segments[i].len > KB_DICTIONARY_SIZE || score_segment(&segments[i], counts) == 0)
+		{
+			continue;
+		}
+
+		memcpy(dictionary + size, segments[i].start, segments[i].len);
+		size += segments[i].len;
+		for (size_t j = 0; j + GRAM_SIZE <= segments[i].len; j++)
+		{
+			counts[hash_gram(segments[i].start + j)] = 0;
+		}
+	}
+
+	free(counts);
+	free(segments);
+	return size;
+}
+
+/*
+ * Train a dictionary from responses and prepare to compress with it.
+ *
+ * Input:
+ *   compressor - the compressor
+ *   entries    - the entities, whose responses are used
+ *   count      - the number of entities
+ *
+ * Returns:
+ *   1, if successful
+ *   0, if there was a memory allocation failure
+ */
+int compressor_init(kb_compressor *compressor, const kb_entry *entries, size_t count)
+{
+	compressor->dictionary = malloc(KB_DICTIONARY_SIZE);
+	compressor->dictionary_table = malloc(((size_t)1 << HASH_BITS) * sizeof(int));
+	compressor->window_table = malloc(((size_t)1 << HASH_BITS) * sizeof(int));
+	compressor->window_stamp = calloc((size_t)1 << HASH_BITS, sizeof(unsigned int));
+	compressor->stamp = 0;
+	if (compressor->dictionary == NULL || compressor->dictionary_table == NULL || compressor->window_table == NULL ||
+		compressor->window_stamp == NULL)
+	{
+		compressor_free(compressor);
+		return 0;
+	}
+
+	// Remember the last position of each hash in the dictionary
+	compressor->dictionary_size = train_dictionary(entries, count, compressor->dictionary);
+	for (size_t i = 0; i < ((size_t)1 << HASH_BITS); i++)
+	{
+		compressor->dictionary_table[i] = -1;
+	}
+	for (size_t i = 0; i + MIN_MATCH <= compressor->dictionary_size; i++)
+	{
+		compressor->dictionary_table[hash4((const unsigned char *)compressor->dictionary + i)] = (int)i;
+	}
+
+	return 1;
+}
+
+// Free the tables of a compressor, and its dictionary
+void compressor_free(kb_compressor *compressor)
+{
+	free(compressor->dictionary);
+	free(compressor->dictionary_table);
+	free(compressor->window_table);
+	free(compressor->window_stamp);
+	memset(compressor, 0, sizeof(kb_compressor));
+}
+
+/*
+ * Get the largest size of a compressed response, when nothing matches.
+ *
+ * Input:
+ *   len - the length of the response
+ *
+ * Returns: the size
+ */
+size_t compress_bound(size_t len)
+{
+	return len + len / MAX_LITERALS + 1;
+}
+
+// Utility function to count how many characters match at two positions, up to a limit
+static size_t match_length(const unsigned char *a, const unsigned char *b, size_t limit)
+{
+	size_t len = 0;
+	while (len < limit && a[len] == b[len])
+	{
+		len++;
+	}
+	return len;
+}
+
+/*
+ * Compress a response, greedily taking the longer of the matches found in
+ * the dictionary and earlier in the response.
+ *
+ * Input:
+ *   compressor - the compressor
+ *   in         - the response
+ *   len        - the length of the response
+ *   out        - receives the compressed response, of up to compress_bound(len) bytes
+ *
+ * Returns: the size of the compressed response
+ */
+size_t compress_response(kb_compressor *compressor, const char *in, size_t len, unsigned char *out)
+{
+	const unsigned char *src = (const unsigned char *)in;
+	const unsigned char *dictionary = (const unsigned char *)compressor->dictionary;
+	size_t dictionary_size = compressor->dictionary_size;
+	size_t pos = 0, literal_start = 0, size = 0;
+
+	// Start a new generation of the window table, so that positions of earlier responses are ignored
+	compressor->stamp++;
+
+	while (pos < len)
+	{
+		size_t best_len = 0, best_distance = 0;
+
+		if (pos + MIN_MATCH <= len)
+		{
+			unsigned int h = hash4(src + pos);
+			size_t limit = len - pos < MAX_MATCH ? len - pos : MAX_MATCH;
+
+			// Try the last position of the same hash earlier in the response
+			if (compressor->window_stamp[h] == compressor->stamp)
+			{
+				size_t earlier = compressor->window_table[h];
+				size_t candidate = match_length(src + earlier, src + pos, limit);
+				if (candidate >= MIN_MATCH && pos - earlier <= 0xFFFF)
+				{
+					best_len = candidate;
+					best_distance = pos - earlier;
+				}
+			}
+
+			// Try the last position of the same hash in the dictionary, if it is near enough
+			int in_dictionary = compressor->dictionary_table[h];
+			if (in_dictionary >= 0 && dictionary_size - in_dictionary + pos <= 0xFFFF)
+			{
+				size_t dictionary_limit = dictionary_size - in_dictionary < limit ? dictionary_size - in_dictionary : limit;
+				size_t candidate = match_length(dictionary + in_dictionary, src + pos, dictionary_limit);
+				if (candidate >= MIN_MATCH && candidate > best_len)
+				{
+					best_len = candidate;
+					best_distance = dictionary_size - in_dictionary + pos;
+				}
+			}
+
+			compressor->window_table[h] = (int)pos;
+			compressor->window_stamp[h] = compressor->stamp;
+		}
+
+		// Without a match, the character joins the current run of literals
+		if (best_len == 0)
+		{
+			pos++;
+			if (pos - literal_start == MAX_LITERALS)
+			{
+				out[size++] = (unsigned char)(MAX_LITERALS - 1);
+				memcpy(out + size, src + literal_start, MAX_LITERALS);
+				size += MAX_LITERALS;
+				literal_start = pos;
+			}
+			continue;
+		}
+
+		// Flush the literals before the match, then write the match
+		if (pos > literal_start)
+		{
+			out[size++] = (unsigned char)(pos - literal_start - 1);
+			memcpy(out + size, src + literal_start, pos - literal_start);
+			size += pos - literal_start;
+		}
+		out[size++] = (unsigned char)(0x80 | (best_len - MIN_MATCH));
+		out[size++] = (unsigned char)(best_distance & 0xFF);
+		out[size++] = (unsigned char)(best_distance >> 8);
+		pos += best_len;
+		literal_start = pos;
+	}
+
+	// Flush the last literals
+	if (pos > literal_start)
+	{
+		out[size++] = (unsigned char)(pos - literal_start - 1);
+		memcpy(out + size, src + literal_start, pos - literal_start);
+		size += pos - literal_start;
+	}
+
+	return size;
+}
+
+/*
+ * Restore a compressed response into a buffer.
+ *
+ * Input:
+ *   dictionary      - the dictionary the response was compressed with
+ *   dictionary_size - the size of the dictionary
+ *   in              - the compressed response
+ *   in_len          - the size of the compressed response
+ *   out             - receives the response, null-terminated
+ *   out_len         - the length of the response, so out must have room for out_len + 1 characters
+ *
+ * Returns:
+ *   1, if successful
+ *   0, if the compressed response is damaged
+ */
+int decompress_response(const char *dictionary, size_t dictionary_size, const unsigned char *in, size_t in_len,
+						char *out, size_t out_len)
+{
+	size_t pos = 0, i = 0;
+
+	while (i < in_len)
+	{
+		unsigned char token = in[i++];
+
+		// Copy a run of literals
+		if (token < 0x80)
+		{
+			size_t run = (size_t)token + 1;
+			if (i + run > in_len || pos + run > out_len)
+			{
+				return 0;
+			}
+			memcpy(out + pos, in + i, run);
+			i += run;
+			pos += run;
+			continue;
+		}
+
+		// Copy a match, from the dictionary and then from the output, one character at a time as they may overlap
+		size_t len = (size_t)(token & 0x7F) + MIN_MATCH;
+		if (i + 2 > in_len || pos + len > out_len)
+		{
+			return 0;
+		}
+		size_t distance = in[i] | (size_t)in[i + 1] << 8;
+		i += 2;
+		if (distance == 0 || distance > dictionary_size + pos)
+		{
+			return 0;
+		}
+		for (size_t j = 0; j < len; j++, pos++)
+		{
+			out[pos] = distance > pos ? dictionary[dictionary_size - (distance - pos)] : out[pos - distance];
+		}
+	}
+
+	out[pos] = '\0';
+	return pos == out_len;
+}
@@ -0,0 +1,119 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the generator of embedded knowledge. It is run with
+ * "chatbot --embed [--compressed] file.ini ... embedded.c", loads the given
+ * knowledge files, freezes them into an image, and writes the image out as
+ * C source. Once that source is compiled into the chatbot, the chatbot
+ * starts with the knowledge already in its read-only data: resetting it
+ * only points the knowledge base at the image, with nothing to parse and
+ * nothing to allocate, and whatever is loaded or learned afterwards is kept
+ * on top of it.
+ *
+ * Images are written as they are laid out in memory, so embedded.c must be
+ * generated again whenever the image format changes, and generated on a
+ * machine of the same byte order and word size as the one it is built for.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "chat1002.h"
+
+// Define the number of words written on each line of the generated source
+#define WORDS_PER_LINE 4
+
+/*
+ * Write an image as C source that defines embedded_knowledge.
+ *
+ * Input:
+ *   f          - the file
+ *   image      - the image, or NULL to embed no knowledge
+ *   file_names - the names of the knowledge files, for the comment at the top
+ *   count      - the number of knowledge files
+ */
+static void write_source(FILE *f, const kb_image *image, char *file_names[], int count)
+{
+	fprintf(f, "/*\n * INF1002 (C Language) Group Project.\n *\n");
+	fprintf(f, " * This file was generated by \"chatbot --embed\" from:\n");
+	for (int i = 0; i < count; i++)
+	{
+		fprintf(f, " *   %s\n", file_names[i]);
+	}
+	fprintf(f, " *\n * It holds the knowledge the chatbot starts with, as a frozen image. Do not\n");
+	fprintf(f, " * edit it; generate it again instead.\n */\n\n#include \"chat1002.h\"\n\n");
+
+	if (image == NULL)
+	{
+		fprintf(f, "// No knowledge is embedded\nconst kb_image *const embedded_knowledge = NULL;\n");
+		return;
+	}
+
+	// Write the image as 64-bit words, so that it is aligned as it would be in memory
+	const unsigned long long *words = (const unsigned long long *)image;
+	size_t word_count = image->size / sizeof(unsigned long long);
+	fprintf(f, "// The image, as 64-bit words so that it is aligned like an image built in memory\n");
+	fprintf(f, "static const unsigned long long embedded_words[%zu] = {", word_count);
+	for (size_t i = 0; i < word_count; i++)
+	{
+		fprintf(f, "%s0x%016llxULL,", i % WORDS_PER_LINE == 0 ? "\n\t" : " ", words[i]);
+	}
+	fprintf(f, "\n};\n\n// The knowledge the chatbot starts with\n");
+	fprintf(f, "const kb_image *const embedded_knowledge = (const kb_image *)embedded_words;\n");
+}
+
+/*
+ * Generate embedded knowledge.
+ *
+ * Input:
+ *   argc - the number of arguments, as main()
+ *   argv - the arguments, as main(), starting after "--embed"
+ *
+ * Returns: the exit status of the program
+ */
+int embed_main(int argc, char *argv[])
+{
+	int compressed = argc > 0 && strcmp(argv[0], "--compressed") == 0;
+	char **file_names = argv + compressed;
+	int count = argc - compressed - 1;
+	size_t image_size;
+
+	if (count < 0 || !compare_str_end_with(argv[argc - 1], ".c"))
+	{
+		fprintf(stderr, "usage: chatbot --embed [--compressed] file.ini ... embedded.c\n");
+		return 2;
+	}
+
+	// Load the files into an empty knowledge base, without the knowledge embedded already
+	knowledge_clear();
+	int loaded = count == 0 ? 0 : knowledge_read_files((const char **)file_names, count);
+	if (loaded == KB_NOTFOUND || loaded == KB_NOMEM)
+	{
+		fprintf(stderr, "embed: %s\n", loaded == KB_NOTFOUND ? "cannot open a knowledge file" : "out of memory");
+		return 1;
+	}
+
+	const kb_diagnostic *diagnostics;
+	int diagnostic_count = knowledge_diagnostics(&diagnostics);
+	for (int i = 0; i < diagnostic_count && i < KB_MAX_DIAGNOSTICS; i++)
+	{
+		fprintf(stderr, "embed: %s:%d: %s\n", file_names[diagnostics[i].file], diagnostics[i].line, diagnostics[i].message);
+	}
+
+	if (loaded > 0 && knowledge_freeze(compressed, &image_size) == KB_NOMEM)
+	{
+		fprintf(stderr, "embed: out of memory\n");
+		return 1;
+	}
+
+	FILE *f = fopen(argv[argc - 1], "w");
+	if (f == NULL)
+	{
+		fprintf(stderr, "embed: cannot open %s\n", argv[argc - 1]);
+		return 1;
+	}
+	write_source(f, loaded > 0 ? knowledge_image() : NULL, file_names, count);
+	fclose(f);
+
+	fprintf(stderr, "embed: %d responses in %zu bytes written to %s\n", loaded, loaded > 0 ? image_size : 0, argv[argc - 1]);
+	return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file was generated by "chatbot --embed" from:
+ *   knowledge_base.ini
+ *
+ * It holds the knowledge the chatbot starts with, as a frozen image. Do not
+ * edit it; generate it again instead.
+ */
+
+#include "chat1002.h"
+
+// The image, as 64-bit words so that it is aligned like an image built in memory
+static const unsigned long long embedded_words[195] = {
+	0x0000000b3249424bULL, 0x0000000000000003ULL, 0x0000000000000000ULL, 0x000000000000002fULL,
+	0x0000000000000618ULL, 0x0000000000000068ULL, 0x0000000000000078ULL, 0x0000000000000078ULL,
+	0x0000000000000338ULL, 0x000000000000006dULL, 0x0000000000000007ULL, 0x0000000000000002ULL,
+	0x0000000000000002ULL, 0x000000d60000000bULL, 0x0000000000000005ULL, 0xc8e37eddd49dd7b5ULL,
+	0x00000000000000c4ULL, 0x00000000000000ccULL, 0x00000000000000d4ULL, 0x0000000000000014ULL,
+	0x0000000000000015ULL, 0x0000000700000007ULL, 0x0000000000000000ULL, 0xbb72742fe5034999ULL,
+	0x00000000000000e9ULL, 0x00000000000000f5ULL, 0x0000000000000101ULL, 0x0000000000000058ULL,
+	0x0000000000000059ULL, 0x0000000b0000000bULL, 0x0000000000000000ULL, 0xc8e37bddd49dd29cULL,
+	0x000000000000009aULL, 0x00000000000000a2ULL, 0x00000000000000aaULL, 0x0000000000000019ULL,
+	0x000000000000001aULL, 0x0000000700000007ULL, 0x0000000000000000ULL, 0xc8e37cddd49dd44fULL,
+	0x0000000000000062ULL, 0x000000000000006aULL, 0x0000000000000072ULL, 0x0000000000000027ULL,
+	0x0000000000000028ULL, 0x0000000700000007ULL, 0x0000000000000000ULL, 0x824887195cec987fULL,
+	0x000000000000015aULL, 0x000000000000015eULL, 0x00000000000001feULL, 0x0000000000000053ULL,
+	0x0000000000000054ULL, 0x0000000300000003ULL, 0x0000000000000001ULL, 0x4db5846a8475b37fULL,
+	0x0000000000000252ULL, 0x0000000000000260ULL, 0x000000000000026eULL, 0x000000000000002fULL,
+	0x0000000000000030ULL, 0x0000000d0000000dULL, 0x0000000000000002ULL, 0x86a6496289c4738eULL,
+	0x000000000000029eULL, 0x00000000000002a9ULL, 0x00000000000002b4ULL, 0x0000000000000027ULL,
+	0x0000000000000028ULL, 0x0000000a0000000aULL, 0x0000000000000002ULL, 0xc8e37addd49dd0e9ULL,
+	0x0000000000000000ULL, 0x0000000000000008ULL, 0x0000000000000010ULL, 0x0000000000000023ULL,
+	0x0000000000000024ULL, 0x0000000700000007ULL, 0x0000000000000000ULL, 0xbb72742fe5034999ULL,
+	0x00000000000000e9ULL, 0x00000000000000f5ULL, 0x0000000000000190ULL, 0x000000000000006dULL,
+	0x000000000000006eULL, 0x0000000b0000000bULL, 0x0000000000000001ULL, 0x824887195cec987fULL,
+	0x000000000000015aULL, 0x000000000000015eULL, 0x0000000000000162ULL, 0x000000000000002dULL,
+	0x000000000000002eULL, 0x0000000300000003ULL, 0x0000000000000000ULL, 0xc8e379ddd49dcf36ULL,
+	0x0000000000000034ULL, 0x000000000000003cULL, 0x0000000000000044ULL, 0x000000000000001dULL,
+	0x000000000000001eULL, 0x0000000700000007ULL, 0x0000000000000000ULL, 0x0035303031544349ULL,
+	0x0035303031746369ULL, 0x74616d656874614dULL, 0x20646e6120736369ULL, 0x6974736974617453ULL,
+	0x4920726f66207363ULL, 0x31544349002e5443ULL, 0x3174636900343030ULL, 0x2062655700343030ULL,
+	0x20736d6574737953ULL, 0x6863655420646e61ULL, 0x736569676f6c6f6eULL, 0x303031544349002eULL,
+	0x3030317463690033ULL, 0x7475706d6f430033ULL, 0x6e6167724f207265ULL, 0x206e6f6974617369ULL,
+	0x6863724120646e61ULL, 0x6572757463657469ULL, 0x303031544349002eULL, 0x3030317463690032ULL,
+	0x6172676f72500032ULL, 0x754620676e696d6dULL, 0x61746e656d61646eULL, 0x31544349002e736cULL,
+	0x3174636900313030ULL, 0x72746e4900313030ULL, 0x6e6f69746375646fULL, 0x2e544349206f7420ULL,
+	0x756c432054434900ULL, 0x7463690072657473ULL, 0x72657473756c6320ULL, 0x756c432054434900ULL,
+	0x66666f2072657473ULL, 0x7267656420737265ULL, 0x73206e6920736565ULL, 0x206572617774666fULL,
+	0x7265656e69676e65ULL, 0x666e69202c676e69ULL, 0x6e6f6974616d726fULL, 0x7469727563657320ULL,
+	0x657420646e612079ULL, 0x73636974616d656cULL, 0x697300544953002eULL, 0x7369205449530074ULL,
+	0x6f747561206e6120ULL, 0x752073756f6d6f6eULL, 0x746973726576696eULL, 0x6e6953206e692079ULL,
+	0x002e65726f706167ULL, 0x6572617774666f53ULL, 0x65656e69676e6520ULL, 0x646e6120676e6972ULL,
+	0x616d726f666e6920ULL, 0x636573206e6f6974ULL, 0x7261207974697275ULL, 0x7468677561742065ULL,
+	0x4054495320746120ULL, 0x696877202c50594eULL, 0x6d656c657420656cULL, 0x7369207363697461ULL,
+	0x2074686775617420ULL, 0x4440544953207461ULL, 0x4953002e7265766fULL, 0x2061207361682054ULL,
+	0x6d6163206e69616dULL, 0x4420746120737570ULL, 0x756c70207265766fULL, 0x6c69756220612073ULL,
+	0x20746120676e6964ULL, 0x20666f2068636165ULL, 0x726f7061676e6953ULL, 0x796c6f7020732765ULL,
+	0x7363696e68636574ULL, 0x5a20676e6157002eULL, 0x0069756b676e6568ULL, 0x65687a20676e6177ULL,
+	0x685a0069756b676eULL, 0x742069756b676e65ULL, 0x7420736568636165ULL, 0x6f68747950206568ULL,
+	0x6f6974636573206eULL, 0x54434920666f206eULL, 0x7246002e32303031ULL, 0x6e617547206b6e61ULL,
+	0x67206b6e61726600ULL, 0x6e617246006e6175ULL, 0x656863616574206bULL, 0x2043206568742073ULL,
+	0x206e6f6974636573ULL, 0x303154434920666fULL, 0x00000000002e3230ULL,
+};
+
+// The knowledge the chatbot starts with
+const kb_image *const embedded_knowledge = (const kb_image *)embedded_words;
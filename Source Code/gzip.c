@@ -0,0 +1,168 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements gzip-compressed knowledge files, such as
+ * "knowledge.ini.gz", so that large knowledge bases take less disk space
+ * and less disk I/O.
+ *
+ * gzip_open() opens a compressed file as a stdio stream, which compresses
+ * or decompresses with zlib as the stream is written or read, in blocks of
+ * KB_BLOCK_SIZE bytes. The parser and writer of the knowledge base work on
+ * the stream as on any other file, so the uncompressed file is never
+ * written to disk, or held in memory as a whole.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "chat1002.h"
+
+// zlib includes limits.h, which defines its own MAX_INPUT
+#undef MAX_INPUT
+#include <zlib.h>
+
+// Define the most bytes passed to zlib at once, which takes an unsigned int
+#define GZIP_MAX_CALL (1U << 30)
+
+// Cookie function to read from a compressed file
+static ssize_t gzip_read(void *cookie, char *buf, size_t size)
+{
+	int got = gzread(cookie, buf, size > GZIP_MAX_CALL ? GZIP_MAX_CALL : (unsigned int)size);
+	return got < 0 ? -1 : got;
+}
+
+// Cookie function to write to a compressed file; zlib writes nothing, rather than part, if it fails
+static ssize_t gzip_write(void *cookie, const char *buf, size_t size)
+{
+	int wrote = size == 0 ? 0 : gzwrite(cookie, buf, size > GZIP_MAX_CALL ? GZIP_MAX_CALL : (unsigned int)size);
+	return wrote <= 0 && size > 0 ? -1 : wrote;
+}
+
+// Cookie function to close a compressed file, which finishes compressing it
+static int gzip_close(void *cookie)
+{
+	return gzclose(cookie) == Z_OK ? 0 : EOF;
+}
+
+/*
+ * Determine whether a file is named as gzip-compressed.
+ *
+ * Input:
+ *   file_name - the name of the file
+ *
+ * Returns:
+ *   1, if the name ends in ".gz"
+ *   0, otherwise
+ */
+int gzip_named(const char *file_name)
+{
+	return compare_str_end_with(file_name, ".gz");
+}
+
+// Utility function to wrap an open compressed file in a stream, closing the file if that fails
+static FILE *gzip_stream(gzFile gz, int writing)
+{
+	if (gz == NULL)
+	{
+		return NULL;
+	}
+	gzbuffer(gz, KB_BLOCK_SIZE);
+
+	cookie_io_functions_t functions = {writing ? NULL : gzip_read, writing ? gzip_write : NULL, NULL, gzip_close};
+	FILE *f = fopencookie(gz, writing ? "w" : "r", functions);
+	if (f == NULL)
+	{
+		gzclose(gz);
+		return NULL;
+	}
+
+	// Let the stream pass whole blocks to zlib
+	setvbuf(f, NULL, _IOFBF, KB_BLOCK_SIZE);
+	return f;
+}
+
+/*
+ * Open a file as a stream, compressing what is written to it or
+ * decompressing what is read from it if asked to. A file read as
+ * compressed that is not is read as it is.
+ *
+ * Input:
+ *   file_name  - the name of the file
+ *   mode       - "r" to read, or "w" to write
+ *   compressed - 1 if the file is gzip-compressed, 0 if it is plain
+ *
+ * Returns: the stream, to be closed by fclose(), or NULL if the file could not be opened
+ */
+FILE *gzip_open(const char *file_name, const char *mode, int compressed)
+{
+	if (!compressed)
+	{
+		return fopen(file_name, mode);
+	}
+
+	int writing = mode[0] == 'w';
+	return gzip_stream(gzopen(file_name, writing ? "wb" : "rb"), writing);
+}
+
+/*
+ * Create a new file beside a file, to be written and then renamed into its
+ * place, as a stream that compresses what is written to it if the file is
+ * named *.gz. Its name is unique to the call, so saves of the same file at
+ * the same time never write into one another.
+ *
+ * Input:
+ *   file_name - the name of the file
+ *   temporary - receives the name of the new file, which the caller must free
+ *
+ * Returns: the stream, to be closed by fclose(), or NULL if the file could not be created (*temporary is then NULL)
+ */
+FILE *gzip_create_beside(const char *file_name, char **temporary)
+{
+	static unsigned int created; // Number of files created, which tells apart those of one process
+	size_t size = strlen(file_name) + 32;
+	int fd = -1;
+
+	*temporary = malloc(size);
+	while (*temporary != NULL && fd < 0)
+	{
+		snprintf(*temporary, size, "%s.%ld.%u.tmp", file_name, (long)getpid(), __sync_fetch_and_add(&created, 1));
+		fd = open(*temporary, O_WRONLY | O_CREAT | O_EXCL, 0666);
+		if (fd < 0 && errno != EEXIST)
+		{
+			free(*temporary);
+			*temporary = NULL;
+		}
+	}
+	if (*temporary == NULL)
+	{
+		return NULL;
+	}
+
+	// Wrap the new file in a stream, closing it if that fails
+	gzFile gz = NULL;
+	FILE *f;
+	if (gzip_named(file_name))
+	{
+		if ((gz = gzdopen(fd, "wb")) == NULL)
+		{
+			close(fd);
+		}
+		f = gzip_stream(gz, 1);
+	}
+	else if ((f = fdopen(fd, "wb")) == NULL)
+	{
+		close(fd);
+	}
+
+	if (f == NULL)
+	{
+		remove(*temporary);
+		free(*temporary);
+		*temporary = NULL;
+	}
+	return f;
+}
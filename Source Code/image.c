@@ -0,0 +1,647 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements frozen knowledge images. An image is a read-only
+ * copy of the knowledge base in one contiguous block of memory, indexed by
+ * a minimal perfect hash: every entity has its own slot, found with one
+ * probe and verified against the stored entity. Images use offsets instead
+ * of pointers, so they can be copied, mapped or embedded as they are.
+ *
+ * The perfect hash is built by hash-and-displace. Entities are spread over
+ * buckets of about KB_MPH_BUCKET_SIZE, and for each bucket, largest first,
+ * a seed is searched for that sends all of its entities to free slots.
+ * Looking up an entity hashes it to its bucket, then hashes it again with
+ * the seed of that bucket to find its slot.
+ *
+ * Like the string pool, an image stores each distinct entity and response
+ * once, however many entities share it.
+ *
+ * An image can also be built with its responses compressed (see
+ * compress.c), for knowledge bases whose responses take most of the memory.
+ * Compressed responses are restored on demand, straight into the buffer of
+ * the caller, and the most recently used ones are kept restored in a small
+ * cache so that popular questions do not pay for it every time.
+ *
+ * image_build() compiles entities into an image.
+ * image_free() frees an image.
+ * image_forget() forgets the responses of an image kept restored.
+ * image_find() looks an entity up in an image.
+ * image_entry_at() reads an entity of an image by its slot.
+ * image_response() gets the response in a slot.
+ * image_copy_response() copies the response in a slot into a buffer.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+
+// Define an entity of an image
+typedef struct image_entry
+{
+	unsigned long long hash;			// Hash of the key of the entity, from the knowledge base
+	unsigned long long entity_offset;	// Offset of the entity in the strings
+	unsigned long long key_offset;		// Offset of the key of the entity in the strings, which is often the entity itself
+	unsigned long long response_offset; // Offset of the response in the strings
+	unsigned long long response_len;	// Length of the response
+	unsigned long long response_size;	// Size of the response in the strings, smaller than its length if compressed
+	unsigned int entity_len;			// Length of the entity
+	unsigned int key_len;				// Length of the key
+	unsigned int index;					// Index of the intent in the hashtable
+} image_entry;
+
+// Define a string placed in the strings of an image, so that equal strings are only placed once
+typedef struct placed_string
+{
+	const char *str;		   // The string, or NULL if this part of the table is empty
+	size_t len;				   // Length of the string
+	unsigned long long offset; // Offset of the string in the strings of the image
+	unsigned long long size;   // Size of the string in the strings of the image
+	int compressed;			   // Set to 1 if the string was placed compressed, so it is only shared with other responses
+} placed_string;
+
+// Define the strings of an image while it is being laid out
+typedef struct string_area
+{
+	char *data;		 // The strings
+	size_t used;	 // Size of the strings so far
+	size_t capacity; // Size of the memory allocated for the strings
+} string_area;
+
+// Define a response kept restored from a compressed image
+typedef struct cached_response
+{
+	const kb_image *image; // The image, or NULL if this part of the cache is empty
+	unsigned int slot;	   // The slot of the response
+	size_t capacity;	   // Size of the memory allocated for the response
+	char *data;			   // The response, null-terminated
+} cached_response;
+
+// The responses kept restored, each in the place given by its slot
+static cached_response cache[KB_RESPONSE_CACHE];
+
+// Utility function to scramble the bits of a hash (the finaliser of splitmix64)
+static unsigned long long mix(unsigned long long x)
+{
+	x ^= x >> 30;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 27;
+	x *= 0x94D049BB133111EBULL;
+	x ^= x >> 31;
+	return x;
+}
+
+// Utility function to combine the intent and entity hash into the key of an entity
+static unsigned long long image_key(int index, unsigned long long h)
+{
+	return h ^ mix(index + 1);
+}
+
+// Utility function to find the bucket of a key
+static unsigned int image_bucket(unsigned long long key, unsigned int salt, unsigned int bucket_count)
+{
+	return (unsigned int)(mix(key ^ salt) % bucket_count);
+}
+
+// Utility function to find the slot of a key, given the seed of its bucket
+static unsigned int image_slot(unsigned long long key, unsigned int seed, unsigned int count)
+{
+	return (unsigned int)(mix(key + (seed + 1) * 0x9E3779B97F4A7C15ULL) % count);
+}
+
+// Utility function to round a size up to a multiple of 8, so that everything after it is aligned
+static size_t align8(size_t size)
+{
+	return (size + 7) & ~(size_t)7;
+}
+
+/*
+ * Search for the seed of every bucket, so that every key has a slot of its own.
+ *
+ * Input:
+ *   keys         - the keys
+ *   count        - the number of keys, which is also the number of slots
+ *   salt         - the salt of the bucket hash
+ *   bucket_count - the number of buckets
+ *   seeds        - receives the seed of each bucket
+ *   slots        - receives the index of the key in each slot
+ *
+ * Returns:
+ *   1, if successful
+ *   0, if some bucket has no seed (try another salt), or there was a memory allocation failure
+ */
+static int place_keys(const unsigned long long *keys, unsigned int count, unsigned int salt, unsigned int bucket_count,
+					  unsigned int *seeds, unsigned int *slots)
+{
+	unsigned int *bucket_start = calloc(bucket_count + 1, sizeof(unsigned int));
+	unsigned int *members = malloc(count * sizeof(unsigned int));
+	unsigned int *order = malloc(bucket_count * sizeof(unsigned int));
+	unsigned int *tried = malloc(count * sizeof(unsigned int));
+	unsigned int *size_start = calloc(count + 2, sizeof(unsigned int));
+	int ok = bucket_start != NULL && members != NULL && order != NULL && tried != NULL && size_start != NULL;
+
+	// Group the keys by bucket, with a counting sort
+	for (unsigned int i = 0; ok && i < count; i++)
+	{
+		bucket_start[image_bucket(keys[i], salt, bucket_count) + 1]++;
+	}
+	for (unsigned int b = 0; ok && b < bucket_count; b++)
+	{
+		bucket_start[b + 1] += bucket_start[b];
+	}
+	for (unsigned int i = 0; ok && i < count; i++)
+	{
+		tried[i] = bucket_start[image_bucket(keys[i], salt, bucket_count)]++;
+		members[tried[i]] = i;
+	}
+	for (unsigned int b = bucket_count; ok && b > 0; b--)
+	{
+		bucket_start[b] = bucket_start[b - 1];
+	}
+	if (ok)
+	{
+		bucket_start[0] = 0;
+	}
+
+	// Order the buckets from largest to smallest, also with a counting sort
+	for (unsigned int b = 0; ok && b < bucket_count; b++)
+	{
+		size_start[count - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+	}
+	for (unsigned int i = 0; ok && i <= count; i++)
+	{
+		size_start[i + 1] += size_start[i];
+	}
+	for (unsigned int b = 0; ok && b < bucket_count; b++)
+	{
+		order[size_start[count - (bucket_start[b + 1] - bucket_start[b])]++] = b;
+	}
+
+	// Mark every slot as free; tried[] remembers which attempt last looked at a slot
+	for (unsigned int i = 0; ok && i < count; i++)
+	{
+		slots[i] = (unsigned int)-1;
+		tried[i] = (unsigned int)-1;
+	}
+
+	// Search the seed of each bucket, largest first while there are still many free slots
+	unsigned int attempt = 0;
+	for (unsigned int o = 0; ok && o < bucket_count; o++)
+	{
+		unsigned int b = order[o];
+		unsigned int first = bucket_start[b], last = bucket_start[b + 1];
+		unsigned int seed;
+
+		seeds[b] = 0;
+		if (first == last)
+		{
+			continue;
+		}
+
+		for (seed = 0; seed < KB_MPH_MAX_SEED; seed++)
+		{
+			// The seed works if every key lands on a slot that is free and not taken by another key of the bucket
+			unsigned int i;
+			unsigned int mark = attempt++;
+			for (i = first; i < last; i++)
+			{
+				unsigned int slot = image_slot(keys[members[i]], seed, count);
+				if (slots[slot] != (unsigned int)-1 || tried[slot] == mark)
+				{
+					break;
+				}
+				tried[slot] = mark;
+			}
+
+			if (i == last)
+			{
+				break;
+			}
+		}
+
+		// If no seed works, give up on this salt
+		if (seed == KB_MPH_MAX_SEED)
+		{
+			ok = 0;
+			break;
+		}
+
+		seeds[b] = seed;
+		for (unsigned int i = first; i < last; i++)
+		{
+			slots[image_slot(keys[members[i]], seed, count)] = members[i];
+		}
+	}
+
+	free(bucket_start);
+	free(members);
+	free(order);
+	free(tried);
+	free(size_start);
+	return ok;
+}
+
+/*
+ * Place a string in the strings of an image, unless an equal string has
+ * already been placed.
+ *
+ * Input:
+ *   table      - open-addressed table of the strings placed so far, with a power of two of slots
+ *   mask       - the number of slots of the table, minus one
+ *   str        - the string
+ *   len        - the length of the string
+ *   compressor - the compressor to compress the string with, or NULL to place it as it is
+ *   area       - the strings so far, which grow if the string is new
+ *
+ * Returns: where the string was placed, or NULL if there was a memory allocation failure
+ */
+static const placed_string *place_string(placed_string *table, size_t mask, const char *str, size_t len,
+										 kb_compressor *compressor, string_area *area)
+{
+	size_t i = intern_hash(str, len) & mask;
+
+	// Probe until an equal string or an empty slot is found
+	while (table[i].str != NULL)
+	{
+		if (table[i].len == len && table[i].compressed == (compressor != NULL) && memcmp(table[i].str, str, len) == 0)
+		{
+			return &table[i];
+		}
+		i = (i + 1) & mask;
+	}
+
+	// Make room for the string, even if it does not compress
+	size_t needed = (compressor != NULL ? compress_bound(len) : len) + 1;
+	if (area->used + needed > area->capacity)
+	{
+		size_t capacity = area->capacity < 4096 ? 4096 : area->capacity * 2;
+		while (capacity < area->used + needed)
+		{
+			capacity *= 2;
+		}
+		char *data = realloc(area->data, capacity);
+		if (data == NULL)
+		{
+			return NULL;
+		}
+		area->data = data;
+		area->capacity = capacity;
+	}
+
+	// Copy the string, compressed or null-terminated
+	table[i].str = str;
+	table[i].len = len;
+	table[i].offset = area->used;
+	table[i].compressed = compressor != NULL;
+	if (compressor != NULL)
+	{
+		table[i].size = compress_response(compressor, str, len, (unsigned char *)area->data + area->used);
+	}
+	else
+	{
+		memcpy(area->data + area->used, str, len);
+		area->data[area->used + len] = '\0';
+		table[i].size = len + 1;
+	}
+	area->used += table[i].size;
+	return &table[i];
+}
+
+/*
+ * Compile entities into an image. The entities must all be different.
+ *
+ * Input:
+ *   entries    - the entities
+ *   count      - the number of entities
+ *   compressed - 1 to compress the responses, 0 to store them as they are
+ *
+ * Returns: the image, which the caller must free with image_free(), or NULL if there was a memory allocation failure
+ */
+kb_image *image_build(const kb_entry *entries, size_t count, int compressed)
+{
+	unsigned int bucket_count = (unsigned int)(count / KB_MPH_BUCKET_SIZE) + 1;
+	unsigned long long *keys = malloc((count + 1) * sizeof(unsigned long long));
+	unsigned int *seeds = malloc(bucket_count * sizeof(unsigned int));
+	unsigned int *slots = malloc((count + 1) * sizeof(unsigned int));
+	const placed_string **placed = malloc((count + 1) * 3 * sizeof(placed_string *));
+	size_t table_size = 16;
+	while (table_size < count * 6)
+	{
+		table_size *= 2;
+	}
+	placed_string *table = calloc(table_size, sizeof(placed_string));
+	string_area area = {NULL, 0, 0};
+	kb_compressor compressor = {0};
+	unsigned int salt = 0;
+	kb_image *image = NULL;
+
+	if (keys == NULL || seeds == NULL || slots == NULL || placed == NULL || table == NULL ||
+		(compressed && !compressor_init(&compressor, entries, count)))
+	{
+		goto done;
+	}
+
+	// Search the perfect hash, with a new salt whenever some bucket cannot be placed
+	for (size_t i = 0; i < count; i++)
+	{
+		keys[i] = image_key(entries[i].index, entries[i].hash);
+	}
+	while (count > 0 && !place_keys(keys, (unsigned int)count, salt, bucket_count, seeds, slots))
+	{
+		if (++salt == KB_MPH_MAX_SALT)
+		{
+			goto done;
+		}
+	}
+
+	// Place each distinct entity, key and response once, compressing the responses if asked to
+	for (size_t i = 0; i < count; i++)
+	{
+		placed[i * 3] = place_string(table, table_size - 1, entries[i].entity, entries[i].entity_len, NULL, &area);
+		placed[i * 3 + 1] = place_string(table, table_size - 1, entries[i].key, entries[i].key_len, NULL, &area);
+		placed[i * 3 + 2] = place_string(table, table_size - 1, entries[i].response, entries[i].response_len,
+										 compressed ? &compressor : NULL, &area);
+		if (placed[i * 3] == NULL || placed[i * 3 + 1] == NULL || placed[i * 3 + 2] == NULL)
+		{
+			goto done;
+		}
+	}
+
+	// Lay the image out as its header, seeds, dictionary, entries and strings
+	size_t seeds_offset = align8(sizeof(kb_image));
+	size_t dictionary_offset = align8(seeds_offset + bucket_count * sizeof(unsigned int));
+	size_t entries_offset = align8(dictionary_offset + compressor.dictionary_size);
+	size_t strings_offset = entries_offset + count * sizeof(image_entry);
+	size_t size = align8(strings_offset + area.used);
+
+	image = calloc(1, size);
+	if (image == NULL)
+	{
+		goto done;
+	}
+
+	image->magic = KB_IMAGE_MAGIC;
+	image->count = (unsigned int)count;
+	image->bucket_count = bucket_count;
+	image->salt = salt;
+	image->flags = compressed ? KB_IMAGE_COMPRESSED : 0;
+	image->dictionary_size = (unsigned int)compressor.dictionary_size;
+	image->normalization = (unsigned int)normalize_get();
+	image->size = size;
+	image->seeds_offset = seeds_offset;
+	image->dictionary_offset = dictionary_offset;
+	image->entries_offset = entries_offset;
+	image->strings_offset = strings_offset;
+	memcpy((char *)image + seeds_offset, seeds, bucket_count * sizeof(unsigned int));
+	if (compressor.dictionary_size > 0)
+	{
+		memcpy((char *)image + dictionary_offset, compressor.dictionary, compressor.dictionary_size);
+	}
+	if (area.used > 0)
+	{
+		memcpy((char *)image + strings_offset, area.data, area.used);
+	}
+
+	// Fill each slot with its entity
+	image_entry *slot_entries = (image_entry *)((char *)image + entries_offset);
+	for (size_t s = 0; s < count; s++)
+	{
+		const kb_entry *entry = &entries[slots[s]];
+		image_entry *out = &slot_entries[s];
+
+		out->hash = entry->hash;
+		out->index = entry->index;
+		out->entity_len = (unsigned int)entry->entity_len;
+		out->entity_offset = placed[slots[s] * 3]->offset;
+		out->key_len = (unsigned int)entry->key_len;
+		out->key_offset = placed[slots[s] * 3 + 1]->offset;
+		out->response_len = entry->response_len;
+		out->response_offset = placed[slots[s] * 3 + 2]->offset;
+		out->response_size = placed[slots[s] * 3 + 2]->size;
+
+		image->intent_count[entry->index]++;
+		if (entry->response_len > image->max_response)
+		{
+			image->max_response = entry->response_len;
+		}
+	}
+
+done:
+	free(keys);
+	free(seeds);
+	free(slots);
+	free(placed);
+	free(table);
+	free(area.data);
+	compressor_free(&compressor);
+	return image;
+}
+
+/*
+ * Forget the responses of an image kept restored, before the image goes
+ * away.
+ *
+ * Input:
+ *   image - the image, or NULL
+ */
+void image_forget(const kb_image *image)
+{
+	for (int i = 0; image != NULL && i < KB_RESPONSE_CACHE; i++)
+	{
+		if (cache[i].image == image)
+		{
+			cache[i].image = NULL;
+		}
+	}
+}
+
+/*
+ * Free an image built by image_build().
+ *
+ * Input:
+ *   image - the image, or NULL
+ */
+void image_free(kb_image *image)
+{
+	image_forget(image);
+	free(image);
+}
+
+/*
+ * Look an entity up in an image by its key, with one probe.
+ *
+ * Input:
+ *   image   - the image
+ *   index   - the index of the intent in the hashtable
+ *   key     - the key of the entity, normalized as the keys of the image were
+ *   key_len - the length of the key
+ *   h       - the hash of the key, as used when the image was built
+ *
+ * Returns:
+ *   the slot of the entity, if it is in the image
+ *   KB_NOTFOUND, otherwise
+ */
+int image_find(const kb_image *image, int index, const char *key, size_t key_len, unsigned long long h)
+{
+	if (image == NULL || image->count == 0)
+	{
+		return KB_NOTFOUND;
+	}
+
+	// Find the slot of the entity through the seed of its bucket
+	unsigned long long slot_key = image_key(index, h);
+	const unsigned int *seeds = (const unsigned int *)((const char *)image + image->seeds_offset);
+	unsigned int seed = seeds[image_bucket(slot_key, image->salt, image->bucket_count)];
+	unsigned int slot = image_slot(slot_key, seed, image->count);
+	const image_entry *in = (const image_entry *)((const char *)image + image->entries_offset) + slot;
+	const char *strings = (const char *)image + image->strings_offset;
+
+	// Every key has a slot, so verify that the slot really holds this key
+	if (in->hash != h || in->index != (unsigned int)index || in->key_len != key_len ||
+		memcmp(strings + in->key_offset, key, key_len) != 0)
+	{
+		return KB_NOTFOUND;
+	}
+
+	return (int)slot;
+}
+
+/*
+ * Read an entity of an image by its slot.
+ *
+ * Input:
+ *   image - the image
+ *   slot  - the slot, from 0 to image->count - 1
+ *   entry - receives the entity, whose strings are valid as long as the image; the response is NULL
+ *           if it is compressed, and must be got with image_response() or image_copy_response()
+ */
+void image_entry_at(const kb_image *image, unsigned int slot, kb_entry *entry)
+{
+	const image_entry *in = (const image_entry *)((const char *)image + image->entries_offset) + slot;
+	const char *strings = (const char *)image + image->strings_offset;
+
+	entry->index = in->index;
+	entry->hash = in->hash;
+	entry->entity = strings + in->entity_offset;
+	entry->entity_len = in->entity_len;
+	entry->key = strings + in->key_offset;
+	entry->key_len = in->key_len;
+	entry->response = (image->flags & KB_IMAGE_COMPRESSED) ? NULL : strings + in->response_offset;
+	entry->response_len = in->response_len;
+}
+
+// Utility function to restore a compressed response into a buffer with room for its length and a null
+static int restore_response(const kb_image *image, const image_entry *in, char *buf)
+{
+	return decompress_response((const char *)image + image->dictionary_offset, image->dictionary_size,
+							   (const unsigned char *)image + image->strings_offset + in->response_offset,
+							   in->response_size, buf, in->response_len);
+}
+
+/*
+ * Get the response in a slot of an image, restoring it and keeping it in
+ * the cache if it is compressed.
+ *
+ * Input:
+ *   image - the image
+ *   slot  - the slot, from 0 to image->count - 1
+ *   len   - receives the length of the response
+ *
+ * Returns: the response, valid as long as the image if it is not compressed, or else until the next call
+ *          to this function; NULL if there was a memory allocation failure or the response is damaged
+ */
+const char *image_response(const kb_image *image, unsigned int slot, size_t *len)
+{
+	const image_entry *in = (const image_entry *)((const char *)image + image->entries_offset) + slot;
+	*len = in->response_len;
+
+	// Responses that are not compressed are used where they are
+	if (!(image->flags & KB_IMAGE_COMPRESSED))
+	{
+		return (const char *)image + image->strings_offset + in->response_offset;
+	}
+
+	// Use the restored response if it is still in the cache
+	cached_response *cached = &cache[slot % KB_RESPONSE_CACHE];
+	if (cached->image == image && cached->slot == slot)
+	{
+		return cached->data;
+	}
+
+	// Otherwise restore it in place of whatever was there, reusing its memory if it is large enough
+	if (cached->capacity < in->response_len + 1)
+	{
+		char *data = realloc(cached->data, in->response_len + 1);
+		if (data == NULL)
+		{
+			return NULL;
+		}
+		cached->data = data;
+		cached->capacity = in->response_len + 1;
+	}
+	cached->image = NULL;
+	if (!restore_response(image, in, cached->data))
+	{
+		return NULL;
+	}
+	cached->image = image;
+	cached->slot = slot;
+	return cached->data;
+}
+
+/*
+ * Copy the response in a slot of an image into a buffer, restoring it
+ * straight into the buffer if it is compressed.
+ *
+ * Input:
+ *   image - the image
+ *   slot  - the slot, from 0 to image->count - 1
+ *   buf   - a buffer to receive the response, null-terminated
+ *   n     - the size of the buffer
+ *   keep  - 1 to keep the restored response in the cache, 0 when reading many responses only once
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_TOOLONG, if the response does not fit into the buffer
+ *   KB_INVALID, if the response is damaged
+ */
+int image_copy_response(const kb_image *image, unsigned int slot, char *buf, size_t n, int keep)
+{
+	const image_entry *in = (const image_entry *)((const char *)image + image->entries_offset) + slot;
+
+	if (in->response_len >= n)
+	{
+		return KB_TOOLONG;
+	}
+
+	// Copy responses that are not compressed, or that are still in the cache
+	cached_response *cached = &cache[slot % KB_RESPONSE_CACHE];
+	if (!(image->flags & KB_IMAGE_COMPRESSED) || (cached->image == image && cached->slot == slot))
+	{
+		size_t len;
+		memcpy(buf, image_response(image, slot, &len), in->response_len + 1);
+		return KB_OK;
+	}
+
+	if (!restore_response(image, in, buf))
+	{
+		return KB_INVALID;
+	}
+
+	// Keep a copy of the restored response for the next time it is asked for
+	if (keep && cached->capacity < in->response_len + 1)
+	{
+		char *data = realloc(cached->data, in->response_len + 1);
+		if (data != NULL)
+		{
+			cached->data = data;
+			cached->capacity = in->response_len + 1;
+		}
+	}
+	if (keep && cached->capacity >= in->response_len + 1)
+	{
+		memcpy(cached->data, buf, in->response_len + 1);
+		cached->image = image;
+		cached->slot = slot;
+	}
+	return KB_OK;
+}
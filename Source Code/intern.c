@@ -0,0 +1,167 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the string pool of the knowledge base. Every entity
+ * and response is interned: identical strings are stored once and shared,
+ * with a reference count, so that aliases with the same response, or the
+ * same entity under several intents, cost one copy. A string is freed when
+ * its last reference is released, e.g. when a response is overwritten or
+ * the knowledge base is reset.
+ *
+ * intern() returns the pooled copy of a string, adding a reference.
+ * intern_release() drops a reference.
+ * intern_hash() hashes a string exactly, as the pool does.
+ * intern_memory() reports the memory used by the pool.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "chat1002.h"
+
+// Declare the pool as a hashtable of chains, which doubles when it holds more strings than chains
+static kb_string **pool;
+static size_t pool_size;
+static size_t pool_count;
+static size_t pool_memory;
+
+/*
+ * Hash a string exactly, including its case.
+ *
+ * Input:
+ *   str - the string
+ *   len - the length of the string
+ *
+ * Returns: the 64-bit FNV-1a hash of the string
+ */
+unsigned long long intern_hash(const char *str, size_t len)
+{
+	unsigned long long h = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= (unsigned char)str[i];
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+// Double the number of chains of the pool, moving every string to its new chain
+static int grow_pool()
+{
+	size_t size = pool_size == 0 ? 1024 : pool_size * 2;
+	kb_string **bigger = calloc(size, sizeof(kb_string *));
+	if (bigger == NULL)
+	{
+		return 0;
+	}
+
+	for (size_t i = 0; i < pool_size; i++)
+	{
+		kb_string *cursor = pool[i];
+		while (cursor != NULL)
+		{
+			kb_string *next = cursor->next;
+			cursor->next = bigger[cursor->hash % size];
+			bigger[cursor->hash % size] = cursor;
+			cursor = next;
+		}
+	}
+
+	free(pool);
+	pool = bigger;
+	pool_memory += (size - pool_size) * sizeof(kb_string *);
+	pool_size = size;
+	return 1;
+}
+
+/*
+ * Get the pooled copy of a string, adding a reference to it. The string is
+ * copied into the pool the first time it is seen.
+ *
+ * Input:
+ *   str - the string
+ *   len - the length of the string
+ *
+ * Returns: the pooled string, or NULL if there was a memory allocation failure
+ */
+const kb_string *intern(const char *str, size_t len)
+{
+	unsigned long long h = intern_hash(str, len);
+
+	// Grow the pool when it has more strings than chains; if it cannot grow, carry on with longer chains
+	if (pool_count >= pool_size && !grow_pool() && pool_size == 0)
+	{
+		return NULL;
+	}
+
+	// If the string is already pooled, share it
+	for (kb_string *cursor = pool[h % pool_size]; cursor != NULL; cursor = cursor->next)
+	{
+		if (cursor->hash == h && cursor->len == len && memcmp(cursor->data, str, len) == 0)
+		{
+			cursor->refs++;
+			return cursor;
+		}
+	}
+
+	// Otherwise copy it into the pool
+	kb_string *copy = malloc(sizeof(kb_string) + len + 1);
+	if (copy == NULL)
+	{
+		return NULL;
+	}
+	copy->hash = h;
+	copy->len = len;
+	copy->refs = 1;
+	memcpy(copy->data, str, len);
+	copy->data[len] = '\0';
+
+	copy->next = pool[h % pool_size];
+	pool[h % pool_size] = copy;
+	pool_count++;
+	pool_memory += sizeof(kb_string) + len + 1;
+	return copy;
+}
+
+/*
+ * Drop a reference to a pooled string, freeing it when it was the last.
+ *
+ * Input:
+ *   str - the pooled string, or NULL
+ */
+void intern_release(const kb_string *str)
+{
+	if (str == NULL || --((kb_string *)str)->refs > 0)
+	{
+		return;
+	}
+
+	// Unlink the string from its chain and free it
+	for (kb_string **cursor = &pool[str->hash % pool_size]; *cursor != NULL; cursor = &(*cursor)->next)
+	{
+		if (*cursor == str)
+		{
+			*cursor = str->next;
+			break;
+		}
+	}
+
+	pool_count--;
+	pool_memory -= sizeof(kb_string) + str->len + 1;
+	free((kb_string *)str);
+}
+
+/*
+ * Get the memory used by the pool.
+ *
+ * Input:
+ *   count - receives the number of distinct strings in the pool
+ *
+ * Returns: the number of bytes used by the strings and the chains
+ */
+size_t intern_memory(size_t *count)
+{
+	*count = pool_count;
+	return pool_memory;
+}
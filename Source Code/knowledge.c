@@ -4,387 +4,2911 @@
  * This file implements the chatbot's knowledge base.
  *
  * knowledge_get() retrieves the response to a question.
+ * knowledge_get_ref() retrieves the response to a question without copying it.
  * knowledge_put() inserts a new response to a question.
+ * knowledge_learn() inserts a response learned from the user, which may be evicted to stay within the memory budget.
+ * knowledge_set_budget() limits the memory of the knowledge base.
  * knowledge_read() reads the knowledge base from a file.
- * knowledge_reset() erases all of the knowledge.
+ * knowledge_read_files() reads the knowledge base from several files in parallel.
+ * knowledge_diagnostics() reports the lines of the last load that could not be read.
+ * knowledge_reset() erases all of the knowledge, except the knowledge embedded in the program.
+ * knowledge_clear() erases all of the knowledge, including the knowledge embedded in the program.
+ * knowledge_freeze() compiles the knowledge into a read-only image.
+ * knowledge_publish() shares the frozen knowledge with other processes.
+ * knowledge_attach() answers from knowledge shared by another process.
+ * knowledge_refresh() switches to the latest knowledge shared by that process.
  * knowledge_write() saves the knowledge base in a file.
  *
  * You may add helper functions as necessary.
  */
 
 #include <ctype.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include "chat1002.h"
 
-// Define a node strucutre that has an entity, intent, response and a pointer to the next node
+// Define a node strucutre that has an entity, response and a pointer to the next node. The intent is given by the question list the node is in.
+// The entity and response are interned, so they are shared with every other node that has the same string.
+// Nodes learned from the user are also kept in a list from least to most recently used, so that the least
+// recently used ones can be evicted when the knowledge base outgrows its memory budget. Nodes loaded from
+// files or put by other means are pinned and never evicted.
 typedef struct node
 {
-	char intent[MAX_INTENT];
-	char entity[MAX_ENTITY];
-	char response[MAX_RESPONSE];
+	unsigned long long hash;	// Hash of the key, from entity_hash()
+	const kb_string *entity;	// Entity, from the string pool, as it was first put
+	const kb_string *key;		// Key the entity is matched by, from normalize_entity(), also from the string pool
+	const kb_string *response;	// Response, from the string pool
 	struct node *next;
+	struct node *older;			// Previous node in the list of learned nodes, if learned
+	struct node *newer;			// Next node in the list of learned nodes, if learned
+	int index;					// Index of the intent in the hashtable
+	int learned;				// Set to 1 if the node was learned from the user and can be evicted
 } node;
 
 // Declare a hashtable to store the question list headers
 node *hashtable[MAX_HASHTABLE];
 
+// Define a blocked Bloom filter over the entities of a question list, so that most unknown entities are
+// rejected by reading one 64-byte block instead of walking the whole list
+typedef struct bloom_filter
+{
+	unsigned long long *blocks; // Blocks of 512 bits, or NULL if there is no filter
+	size_t block_count;			// Number of blocks
+	size_t capacity;			// Number of entities the filter was sized for
+} bloom_filter;
+
+// Declare a Bloom filter for each question list
+static bloom_filter filters[MAX_HASHTABLE];
+
+// Frozen image of the knowledge base, or NULL. The question lists are a small overlay on top of it: they
+// hold what was put since the last freeze, and their responses take precedence.
+static kb_image *frozen;
+
+// Define where the frozen image comes from, which decides how to let go of it
+#define FROZEN_BUILT    0 // Built by knowledge_freeze(), and freed
+#define FROZEN_SHARED   1 // A generation of a shared knowledge base, mapped read-only and unmapped
+#define FROZEN_EMBEDDED 2 // Embedded in the program by "chatbot --embed", and left alone
+static int frozen_source;
+
+// Number of entities in each question list that override an entity of the frozen image
+static size_t shadowed[MAX_HASHTABLE];
+
+// Length of the longest response put since the last reset
+static size_t max_response;
+
+// Number of entities in each question list, and the memory used by all nodes (not counting the string pool)
+static size_t entry_count[MAX_HASHTABLE];
+static size_t memory_used;
+
+// Learned nodes, from least to most recently used
+static node *least_recent;
+static node *most_recent;
+
+// Most bytes the knowledge base may use before learned nodes are evicted, or 0 for no limit
+static size_t memory_budget;
+
+// Define the section index of lines whose section is opened by an earlier chunk of the file
+#define SECTION_UNRESOLVED -2
+
+// Section names of the intents, in the same order as their index in the hashtable
+static const char *intent_names[MAX_HASHTABLE] = {"what", "where", "who"};
+
+// Define a streaming parser, which keeps its state between the blocks of a knowledge file
+typedef struct kb_parser
+{
+	int index;										// Index of the open section, -1 if none, or SECTION_UNRESOLVED
+	int seen_section;								// Set to 1 once a section header has been read
+	int line;										// Number of lines read
+	char *carry;									// Partial line carried over from the end of the previous block
+	size_t carry_len;								// Length of the partial line
+	size_t carry_capacity;							// Number of characters allocated for the partial line
+	int (*emit)(void *, int, const char *, size_t, const char *, size_t); // Receives each entity and response read, returns KB_NOMEM to stop
+	void *context;									// Passed to emit
+	int result;										// Number of responses emitted, or KB_NOMEM
+	kb_diagnostic diagnostics[KB_MAX_DIAGNOSTICS];	// The first lines that could not be read
+	int diagnostic_count;							// Number of lines that could not be read
+} kb_parser;
+
+// Define a run of entities loaded in order of their keys into a question list that was empty, as written by
+// knowledge_write(); none of them can already be in the list, so they are put without searching it
+typedef struct sorted_run
+{
+	int index;		   // Index of the section being loaded, or -1 before the first
+	int sorted;		   // Set to 1 while the section has been in order since it started an empty question list
+	const node *last;  // Node of the last entity loaded in the section, or NULL
+} sorted_run;
+
+// Define a staged entity and response parsed by a loader thread, waiting to be merged into memory
+typedef struct staged_entry
+{
+	int index;			  // Index of the intent in the hashtable, or SECTION_UNRESOLVED if the section is opened by an earlier chunk
+	const char *entity;	  // Entity, pointing into the file buffer
+	size_t entity_len;	  // Length of the entity
+	const char *response; // Response, pointing into the file buffer
+	size_t response_len;  // Length of the response
+} staged_entry;
+
+// Define a chunk of a knowledge file that is parsed by a single loader thread
+typedef struct load_chunk
+{
+	char *start;			// First character of the chunk
+	char *end;				// One past the last character of the chunk
+	int file;				// Index of the file the chunk belongs to
+	int first;				// Set to 1 if the chunk is the start of a file
+	kb_parser parser;		// Parser state at the end of the chunk
+	staged_entry *entries;	// Entities and responses parsed from the chunk, in file order
+	int count;				// Number of entries parsed
+	int capacity;			// Number of entries allocated
+} load_chunk;
+
+// Define a parallel load shared by all loader threads
+typedef struct load_job
+{
+	load_chunk *chunks;	  // Chunks of all files, in load order
+	int count;			  // Number of chunks
+	int next;			  // Index of the next chunk to be parsed
+	pthread_mutex_t lock; // Lock protecting next
+} load_job;
+
+// Declare the lines of the last load that could not be read
+static kb_diagnostic diagnostics[KB_MAX_DIAGNOSTICS];
+static int diagnostic_count;
+
+/*
+ * Hash the key of an entity. Keys are already folded to lower case, so
+ * entities that differ only in case have equal hashes.
+ *
+ * Input:
+ *   key     - the key
+ *   key_len - the length of the key
+ *
+ * Returns: the 64-bit FNV-1a hash of the key
+ */
+static unsigned long long entity_hash(const char *key, size_t key_len)
+{
+	unsigned long long h = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < key_len; i++)
+	{
+		h ^= (unsigned char)key[i];
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+// Utility function to order keys as knowledge_write() does, byte by byte, with a shorter key before a longer one it starts
+static int compare_keys(const char *a, size_t a_len, const char *b, size_t b_len)
+{
+	int order = memcmp(a, b, a_len < b_len ? a_len : b_len);
+	if (order != 0)
+	{
+		return order;
+	}
+	return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/*
+ * Get the key an entity is matched by, and its hash.
+ *
+ * Input:
+ *   entity     - the entity
+ *   entity_len - the length of the entity
+ *   key_len    - receives the length of the key
+ *   h          - receives the hash of the key
+ *
+ * Returns: the key, valid until the next entity is normalized; or NULL if there was a memory allocation failure
+ */
+static const char *entity_key(const char *entity, size_t entity_len, size_t *key_len, unsigned long long *h)
+{
+	const char *key = normalize_cached(entity, entity_len, key_len);
+
+	if (key != NULL)
+	{
+		*h = entity_hash(key, *key_len);
+	}
+
+	return key;
+}
+
+// Utility function to find the block of a Bloom filter an entity hash belongs to, and the mixed hash that picks its bits;
+// the block comes from the high bits of a second mix, so keys of one block do not share the low bits that pick their bits
+static unsigned long long *bloom_block(const bloom_filter *filter, unsigned long long h, unsigned long long *bits)
+{
+	unsigned long long spread = (h * 0xC2B2AE3D27D4EB4FULL) >> 32;
+
+	*bits = h * 0x9E3779B97F4A7C15ULL;
+	return filter->blocks + ((spread * filter->block_count) >> 32) * 8;
+}
+
+// Add an entity hash to a Bloom filter, setting KB_BLOOM_HASHES bits of its block
+static void bloom_add(bloom_filter *filter, unsigned long long h)
+{
+	unsigned long long bits;
+	unsigned long long *block = bloom_block(filter, h, &bits);
+
+	// Each 9 bits of the mixed hash pick one of the 512 bits of the block
+	for (int i = 0; i < KB_BLOOM_HASHES; i++, bits >>= 9)
+	{
+		block[(bits & 511) >> 6] |= 1ULL << (bits & 63);
+	}
+}
+
+/*
+ * Check whether an entity hash may be in a Bloom filter. A filter that
+ * could not be allocated may contain anything.
+ *
+ * Returns:
+ *   1, if the entity may be in the question list
+ *   0, if the entity is definitely not in the question list
+ */
+static int bloom_may_contain(const bloom_filter *filter, unsigned long long h)
+{
+	if (filter->blocks == NULL)
+	{
+		return 1;
+	}
+
+	unsigned long long bits;
+	const unsigned long long *block = bloom_block(filter, h, &bits);
+
+	for (int i = 0; i < KB_BLOOM_HASHES; i++, bits >>= 9)
+	{
+		if ((block[(bits & 511) >> 6] & (1ULL << (bits & 63))) == 0)
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Rebuild the Bloom filter of a question list, sized for the given number
+ * of entities, from the hashes stored in its nodes.
+ *
+ * Input:
+ *   index    - the index of the question list in the hashtable
+ *   capacity - the number of entities to size the filter for
+ */
+static void bloom_rebuild(int index, size_t capacity)
+{
+	bloom_filter *filter = &filters[index];
+	size_t block_count = (capacity * KB_BLOOM_BITS_PER_KEY + 511) / 512;
+
+	free(filter->blocks);
+	filter->blocks = calloc(block_count, 8 * sizeof(unsigned long long));
+	filter->block_count = block_count;
+	filter->capacity = capacity;
+
+	// If there is insufficient memory, go without the filter until the next rebuild
+	if (filter->blocks == NULL)
+	{
+		return;
+	}
+
+	for (node *cursor = hashtable[index]; cursor != NULL; cursor = cursor->next)
+	{
+		bloom_add(filter, cursor->hash);
+	}
+}
+
+/*
+ * Find the node holding an entity in a question list, by its key. Keys
+ * that are not in the Bloom filter of the list are rejected without
+ * walking the list, and hashes and lengths are compared before characters,
+ * so most nodes are skipped without reading their key.
+ *
+ * Input:
+ *   index   - the index of the question list in the hashtable
+ *   key     - the key of the entity
+ *   key_len - the length of the key
+ *   h       - the hash of the key, from entity_hash()
+ *   probes  - receives the number of nodes compared
+ *
+ * Returns: the node, or NULL if the entity is not in the list
+ */
+static node *find_node(int index, const char *key, size_t key_len, unsigned long long h, int *probes)
+{
+	*probes = 0;
+
+	// Return NULL straight away if the Bloom filter knows the entity is not in the list
+	if (!bloom_may_contain(&filters[index], h))
+	{
+		return NULL;
+	}
+
+	// Iterate through the linked list at index
+	for (node *cursor = hashtable[index]; cursor != NULL; cursor = cursor->next)
+	{
+		(*probes)++;
+
+		// Check if the key matches
+		if (cursor->hash == h && cursor->key->len == key_len && memcmp(cursor->key->data, key, key_len) == 0)
+		{
+			return cursor;
+		}
+	}
+
+	return NULL;
+}
+
+// Utility function to take a learned node out of the list of learned nodes
+static void unlink_learned(node *n)
+{
+	if (n->older != NULL)
+	{
+		n->older->newer = n->newer;
+	}
+	else
+	{
+		least_recent = n->newer;
+	}
+
+	if (n->newer != NULL)
+	{
+		n->newer->older = n->older;
+	}
+	else
+	{
+		most_recent = n->older;
+	}
+
+	n->older = NULL;
+	n->newer = NULL;
+}
+
+// Utility function to put a learned node at the most recently used end of the list of learned nodes
+static void touch_learned(node *n)
+{
+	if (most_recent == n)
+	{
+		return;
+	}
+	if (n->older != NULL || n->newer != NULL || least_recent == n)
+	{
+		unlink_learned(n);
+	}
+
+	n->older = most_recent;
+	if (most_recent != NULL)
+	{
+		most_recent->newer = n;
+	}
+	else
+	{
+		least_recent = n;
+	}
+	most_recent = n;
+}
+
+// Utility function to get the memory used by the knowledge base, as limited by the budget
+static size_t memory_total()
+{
+	size_t strings;
+	return memory_used + intern_memory(&strings) + (frozen == NULL ? 0 : frozen->size);
+}
+
+/*
+ * Evict a learned node: remove it from its question list and free it. Its
+ * entity stays in the Bloom filter, which only costs a wasted search until
+ * the filter is next rebuilt.
+ *
+ * Input:
+ *   victim - the node
+ */
+static void evict_node(node *victim)
+{
+	int index = victim->index;
+
+	// Find the link to the node in its question list, and skip over it
+	node **link = &hashtable[index];
+	while (*link != victim)
+	{
+		link = &(*link)->next;
+	}
+	*link = victim->next;
+	unlink_learned(victim);
+
+	// Forget the node, uncounting it from the frozen image it may override
+	entry_count[index]--;
+	memory_used -= sizeof(node);
+	if (frozen != NULL && image_find(frozen, index, victim->key->data, victim->key->len, victim->hash) >= 0)
+	{
+		shadowed[index]--;
+	}
+	stats_count(STAT_EVICTED);
+
+	intern_release(victim->entity);
+	intern_release(victim->key);
+	intern_release(victim->response);
+	free(victim);
+}
+
+/*
+ * Evict the least recently used learned nodes until the knowledge base fits
+ * in its memory budget, sparing one node for as long as others can go.
+ *
+ * Input:
+ *   spare - the node to evict last, or NULL
+ *
+ * Returns:
+ *   1, if the knowledge base fits in its budget, or has no budget
+ *   0, if it does not fit even with every learned node evicted (except for the spared one)
+ */
+static int enforce_budget(node *spare)
+{
+	while (memory_budget > 0 && memory_total() > memory_budget)
+	{
+		node *victim = spare != NULL && least_recent == spare ? spare->newer : least_recent;
+		if (victim == NULL)
+		{
+			return 0;
+		}
+		evict_node(victim);
+	}
+
+	return 1;
+}
+
+/*
+ * Look up the response to a question, in the question list first and then
+ * in the frozen image with a single probe, counting the lookup in the
+ * statistics.
+ *
+ * Input:
+ *   intent - the question word
+ *   entity - the entity
+ *   found  - receives the node of the entity, or NULL if it is only in the frozen image
+ *   slot   - receives the slot of the entity in the frozen image, if it is only there
+ *
+ * Returns:
+ *   KB_OK, if a response was found for the intent and entity
+ *   KB_NOTFOUND, if no response could be found
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ */
+static int lookup(const char *intent, const char *entity, node **found, int *slot)
+{
+	// Hash the intent
+	int index = hash(intent);
+
+	// Return KB_INVALID if intent is invalid
+	if (index == -1)
+	{
+		return KB_INVALID;
+	}
+
+	unsigned long long start = stats_clock();
+	int probes = 0;
+	size_t key_len;
+	unsigned long long h;
+	const char *key = entity_key(entity, strlen(entity), &key_len, &h);
+	int result = KB_OK;
+
+	// An entity that cannot be normalized for lack of memory cannot be found either
+	*found = key == NULL ? NULL : find_node(index, key, key_len, h, &probes);
+
+	// Count the entities the Bloom filter rejected without walking the list
+	if (key != NULL && *found == NULL && probes == 0 && hashtable[index] != NULL)
+	{
+		stats_count(STAT_FILTERED);
+	}
+
+	if (key == NULL)
+	{
+		result = KB_NOTFOUND;
+	}
+	else if (*found != NULL && (*found)->learned)
+	{
+		touch_learned(*found);
+	}
+	else if (*found == NULL && frozen != NULL)
+	{
+		probes++;
+		*slot = image_find(frozen, index, key, key_len, h);
+		result = *slot >= 0 ? KB_OK : KB_NOTFOUND;
+	}
+	else if (*found == NULL)
+	{
+		result = KB_NOTFOUND;
+	}
+	stats_probe(probes);
+	stats_time(STAT_TIME_GET, start);
+
+	// Return KB_NOTFOUND if question is not found in either
+	stats_count(result == KB_OK ? STAT_HIT : STAT_MISS);
+	return result;
+}
+
+/*
+ * Get the response to a question from the backend of a sharded knowledge
+ * base that owns it, counting it as a lookup.
+ *
+ * Input:
+ *   intent   - the question word
+ *   entity   - the entity
+ *   response - receives a pointer to the response, valid until the next request to a backend
+ *   len      - receives the length of the response
+ *
+ * Returns: as knowledge_get_ref()
+ */
+static int routed_get(const char *intent, const char *entity, const char **response, size_t *len)
+{
+	int index = hash(intent);
+	if (index == -1)
+	{
+		return KB_INVALID;
+	}
+
+	unsigned long long start = stats_clock();
+	int result = route_get(index, entity, response, len);
+	stats_time(STAT_TIME_GET, start);
+	stats_count(result == KB_OK ? STAT_HIT : STAT_MISS);
+	return result;
+}
+
+/*
+ * Get the response to a question without copying it.
+ *
+ * Input:
+ *   intent   - the question word
+ *   entity   - the entity
+ *   response - receives a pointer to the response, valid until the knowledge base is next used
+ *   len      - receives the length of the response
+ *
+ * Returns:
+ *   KB_OK, if a response was found for the intent and entity
+ *   KB_NOTFOUND, if no response could be found
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ *   KB_NOMEM, if the response is compressed and there is no memory to restore it
+ *   KB_UNAVAILABLE, if the knowledge base is sharded and the backend that owns the entity cannot be reached
+ */
+int knowledge_get_ref(const char *intent, const char *entity, const char **response, size_t *len)
+{
+	if (route_enabled)
+	{
+		return routed_get(intent, entity, response, len);
+	}
+
+	node *found;
+	int slot;
+	int result = lookup(intent, entity, &found, &slot);
+
+	if (result == KB_OK && found != NULL)
+	{
+		*response = found->response->data;
+		*len = found->response->len;
+	}
+	else if (result == KB_OK)
+	{
+		*response = image_response(frozen, slot, len);
+		result = *response != NULL ? KB_OK : KB_NOMEM;
+	}
+
+	return result;
+}
+
+/*
+ * Get the response to a question. Compressed responses of the frozen image
+ * are restored straight into the response buffer.
+ *
+ * Input:
+ *   intent   - the question word
+ *   entity   - the entity
+ *   response - a buffer to receive the response
+ *   n        - the maximum number of characters to write to the response buffer
+ *
+ * Returns:
+ *   KB_OK, if a response was found for the intent and entity (the response is copied to the response buffer)
+ *   KB_NOTFOUND, if no response could be found
+ *   KB_INVALID, if 'intent' is not a recognised question word
+ *   KB_TOOLONG, if the response does not fit into the response buffer (see knowledge_max_response())
+ *   KB_UNAVAILABLE, if the knowledge base is sharded and the backend that owns the entity cannot be reached
+ */
+int knowledge_get(const char *intent, const char *entity, char *response, int n)
+{
+	// A sharded knowledge base copies the response from the reply of its backend
+	if (route_enabled)
+	{
+		const char *routed;
+		size_t len;
+		int result = routed_get(intent, entity, &routed, &len);
+		if (result == KB_OK && len >= (size_t)n)
+		{
+			return KB_TOOLONG;
+		}
+		if (result == KB_OK)
+		{
+			memcpy(response, routed, len + 1);
+		}
+		return result;
+	}
+
+	node *found;
+	int slot;
+	int result = lookup(intent, entity, &found, &slot);
+
+	// If the response is only in the frozen image, let the image copy it
+	if (result == KB_OK && found == NULL)
+	{
+		return image_copy_response(frozen, slot, response, n, 1);
+	}
+
+	// Otherwise copy it from the node into the response buffer when it fits
+	if (result == KB_OK)
+	{
+		if (found->response->len >= (size_t)n)
+		{
+			return KB_TOOLONG;
+		}
+		memcpy(response, found->response->data, found->response->len + 1);
+	}
+
+	return result;
+}
+
+/*
+ * Insert a new response to a question, as knowledge_put_len(), pinning the
+ * node or keeping it as learned.
+ *
+ * Input:
+ *   index        - the index of the intent in the hashtable
+ *   entity       - the entity, null-terminated
+ *   entity_len   - the length of the entity
+ *   response     - the response for this question and entity, null-terminated
+ *   response_len - the length of the response
+ *   learned      - 1 if the response was learned from the user, 0 to pin it
+ *   unique       - 1 if the caller knows the entity is not in the question list, which skips searching it
+ *   stored       - receives the node of the entity
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int put_node(int index, const char *entity, size_t entity_len, const char *response, size_t response_len,
+					int learned, int unique, node **stored)
+{
+	// Intern the response, sharing the copy of any other node with the same response
+	const kb_string *pooled = intern(response, response_len);
+	if (pooled == NULL)
+	{
+		return KB_NOMEM;
+	}
+
+	// Keep track of the longest response, so callers can size their buffers
+	if (response_len > max_response)
+	{
+		max_response = response_len;
+	}
+
+	// Normalize the entity into the key it is matched by
+	size_t key_len;
+	unsigned long long h;
+	const char *key = entity_key(entity, entity_len, &key_len, &h);
+	if (key == NULL)
+	{
+		intern_release(pooled);
+		return KB_NOMEM;
+	}
+
+	// If the question is already known, replace current response for question with new response
+	int probes;
+	node *found = unique ? NULL : find_node(index, key, key_len, h, &probes);
+	if (found != NULL)
+	{
+		stats_count(STAT_OVERWRITE);
+		intern_release(found->response);
+		found->response = pooled;
+
+		// A node stays pinned once pinned; a learned node is used again, or pinned if put by other means
+		if (found->learned && learned)
+		{
+			touch_learned(found);
+		}
+		else if (found->learned)
+		{
+			unlink_learned(found);
+			found->learned = 0;
+		}
+		if (replicate_leading && !learned)
+		{
+			replicate_put(index, entity, entity_len, response, response_len, learned);
+		}
+		*stored = found;
+		return KB_OK;
+	}
+
+	// Create a new node, with the entity and its key interned too
+	node *new_node = malloc(sizeof(node));
+	const kb_string *pooled_key = new_node == NULL ? NULL : intern(key, key_len);
+	const kb_string *pooled_entity = pooled_key == NULL ? NULL : intern(entity, entity_len);
+
+	// Return KB_NOMEM if there is insufficient memory for allocation
+	if (pooled_entity == NULL)
+	{
+		free(new_node);
+		intern_release(pooled_key);
+		intern_release(pooled);
+		return KB_NOMEM;
+	}
+
+	// Point the new node at the pooled entity, key and response
+	new_node->hash = h;
+	new_node->entity = pooled_entity;
+	new_node->key = pooled_key;
+	new_node->response = pooled;
+	new_node->index = index;
+	new_node->learned = learned;
+	new_node->older = NULL;
+	new_node->newer = NULL;
+	if (learned)
+	{
+		touch_learned(new_node);
+	}
+
+	// Add new node to the start of the question list
+	new_node->next = hashtable[index];
+	hashtable[index] = new_node;
+
+	stats_count(STAT_INSERT);
+	entry_count[index]++;
+	memory_used += sizeof(node);
+
+	// Count the entity only once if it overrides an entity of the frozen image
+	if (frozen != NULL && image_find(frozen, index, key, key_len, h) >= 0)
+	{
+		shadowed[index]++;
+	}
+
+	// Add the entity to the Bloom filter, doubling the filter when the list outgrows it
+	if (entry_count[index] > filters[index].capacity)
+	{
+		bloom_rebuild(index, filters[index].capacity < 1024 ? 1024 : filters[index].capacity * 2);
+	}
+	else if (filters[index].blocks != NULL)
+	{
+		bloom_add(&filters[index], h);
+	}
+
+	// Log the response for the followers, if leading any; knowledge_learn() logs a learned one once it fits the budget
+	if (replicate_leading && !learned)
+	{
+		replicate_put(index, entity, entity_len, response, response_len, learned);
+	}
+
+	*stored = new_node;
+	return KB_OK;
+}
+
+/*
+ * Insert a new response to a question, given the lengths of the entity and
+ * response. If a response already exists for the given intent and entity,
+ * it will be overwritten. Otherwise, it will be added to the knowledge base.
+ * The response is pinned: it is never evicted to stay within the memory
+ * budget.
+ *
+ * Input:
+ *   intent       - the question word
+ *   entity       - the entity, null-terminated
+ *   entity_len   - the length of the entity
+ *   response     - the response for this question and entity, null-terminated
+ *   response_len - the length of the response
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the intent is not a valid question word
+ *   KB_UNAVAILABLE, if the knowledge base is sharded and the backend that owns the entity cannot be reached
+ */
+int knowledge_put_len(const char *intent, const char *entity, size_t entity_len, const char *response, size_t response_len)
+{
+	// Hash the intent
+	int index = hash(intent);
+
+	// Return KB_INVALID if intent is invalid
+	if (index == -1)
+	{
+		return KB_INVALID;
+	}
+
+	// A sharded knowledge base puts it into the backend that owns it
+	if (route_enabled)
+	{
+		return route_put(index, entity, entity_len, response, response_len, 0, 0);
+	}
+
+	node *stored;
+	return put_node(index, entity, entity_len, response, response_len, 0, 0, &stored);
+}
+
+/*
+ * Insert a response learned from the user. Unlike knowledge_put(), the
+ * response may be evicted later, least recently used first, to keep the
+ * knowledge base within its memory budget; making room for it may evict
+ * other learned responses.
+ *
+ * Input:
+ *   intent    - the question word
+ *   entity    - the entity
+ *   response  - the response for this question and entity
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure, or the response does not fit in the budget
+ *   KB_INVALID, if the intent is not a valid question word
+ *   KB_UNAVAILABLE, if the knowledge base is sharded and the backend that owns the entity cannot be reached
+ */
+int knowledge_learn(const char *intent, const char *entity, const char *response)
+{
+	// Hash the intent
+	int index = hash(intent);
+
+	// Return KB_INVALID if intent is invalid
+	if (index == -1)
+	{
+		return KB_INVALID;
+	}
+
+	// A sharded knowledge base leaves the budget to the backend that owns it
+	if (route_enabled)
+	{
+		return route_put(index, entity, strlen(entity), response, strlen(response), 1, 0);
+	}
+
+	node *stored;
+	int result = put_node(index, entity, strlen(entity), response, strlen(response), 1, 0, &stored);
+	if (result != KB_OK)
+	{
+		return result;
+	}
+
+	// Make room for the response; if even that is not enough, do not keep it
+	if (!enforce_budget(stored))
+	{
+		if (stored->learned)
+		{
+			evict_node(stored);
+		}
+		return KB_NOMEM;
+	}
+
+	// Log the response for the followers only now, so they never keep one refused here
+	if (replicate_leading)
+	{
+		replicate_put(index, entity, strlen(entity), response, strlen(response), 1);
+	}
+
+	return KB_OK;
+}
+
+/*
+ * Limit the memory of the knowledge base, evicting learned responses at
+ * once if it is already over the new budget. Responses loaded from files
+ * are never evicted, so they can still take the knowledge base over it.
+ *
+ * Input:
+ *   budget - the most bytes to use, counted as by knowledge_sizes(), or 0 for no limit
+ *
+ * Returns: the number of learned responses evicted
+ */
+int knowledge_set_budget(size_t budget)
+{
+	size_t before = 0, after = 0;
+	for (int i = 0; i < MAX_HASHTABLE; i++)
+	{
+		before += entry_count[i];
+	}
+
+	memory_budget = budget;
+	enforce_budget(NULL);
+
+	for (int i = 0; i < MAX_HASHTABLE; i++)
+	{
+		after += entry_count[i];
+	}
+	return (int)(before - after);
+}
+
+/*
+ * Get the memory budget of the knowledge base.
+ *
+ * Returns: the most bytes to use, or 0 for no limit
+ */
+size_t knowledge_budget()
+{
+	return memory_budget;
+}
+
+/*
+ * Insert a new response to a question. If a response already exists for the
+ * given intent and entity, it will be overwritten. Otherwise, it will be added
+ * to the knowledge base.
+ *
+ * Input:
+ *   intent    - the question word
+ *   entity    - the entity
+ *   response  - the response for this question and entity
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ *   KB_INVALID, if the intent is not a valid question word
+ */
+int knowledge_put(const char *intent, const char *entity, const char *response)
+{
+	return knowledge_put_len(intent, entity, strlen(entity), response, strlen(response));
+}
+
+/*
+ * Get the length of the longest response put since the last reset.
+ *
+ * Returns: the length, not counting the terminating null
+ */
+size_t knowledge_max_response()
+{
+	return route_enabled && route_max_response() > max_response ? route_max_response() : max_response;
+}
+
+/*
+ * Get the size of the knowledge base.
+ *
+ * Input:
+ *   entries - receives the number of entities known for each intent, in hashtable order
+ *   memory  - receives the number of bytes used by all entities and responses, including the string pool
+ */
+void knowledge_sizes(size_t entries[MAX_HASHTABLE], size_t *memory)
+{
+	size_t strings;
+
+	memcpy(entries, entry_count, sizeof(entry_count));
+	*memory = memory_used + intern_memory(&strings);
+
+	// Add the entities of the frozen image that are not overridden in the question lists
+	if (frozen != NULL)
+	{
+		for (int i = 0; i < MAX_HASHTABLE; i++)
+		{
+			entries[i] += frozen->intent_count[i] - shadowed[i];
+		}
+		*memory += frozen->size;
+	}
+}
+
+/*
+ * Get the name of an intent from its index in the hashtable.
+ *
+ * Input:
+ *   index - the index, as returned by hash()
+ *
+ * Returns: the name, as used for its section in knowledge files
+ */
+const char *knowledge_intent_name(int index)
+{
+	return intent_names[index];
+}
+
+/*
+ * Record a line of a knowledge file that could not be read. Only the first
+ * KB_MAX_DIAGNOSTICS lines are kept, but all of them are counted.
+ *
+ * Input:
+ *   parser  - the parser
+ *   message - what is wrong with the line
+ */
+static void parser_diagnose(kb_parser *parser, const char *message)
+{
+	if (parser->diagnostic_count < KB_MAX_DIAGNOSTICS)
+	{
+		parser->diagnostics[parser->diagnostic_count].file = 0;
+		parser->diagnostics[parser->diagnostic_count].line = parser->line;
+		parser->diagnostics[parser->diagnostic_count].message = message;
+	}
+	parser->diagnostic_count++;
+}
+
+// Utility function to remove spaces and tabs from both ends of a string, in place, and null-terminate it
+static char *trim(char *start, char *end)
+{
+	while (start < end && (*start == ' ' || *start == '\t'))
+	{
+		start++;
+	}
+	while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+	{
+		end--;
+	}
+	*end = '\0';
+	return start;
+}
+
+/*
+ * Parse one line of a knowledge file. The line is split in place, so the
+ * character after the line must be writable.
+ *
+ * Blank lines and lines starting with ';' or '#' are ignored. A section
+ * header opens the section of its intent, and every entity=response line
+ * up to the next header belongs to it. Any other line is reported as a
+ * diagnostic and skipped.
+ *
+ * Input:
+ *   parser - the parser
+ *   line   - the line, without its newline
+ *   len    - the length of the line
+ */
+static void parse_line(kb_parser *parser, char *line, size_t len)
+{
+	char *end = line + len;
+	parser->line++;
+
+	// Remove the carriage return of CRLF line endings
+	if (end > line && end[-1] == '\r')
+	{
+		end--;
+	}
+
+	// Skip leading spaces, then ignore blank lines and comments
+	while (line < end && (*line == ' ' || *line == '\t'))
+	{
+		line++;
+	}
+	if (line == end || *line == ';' || *line == '#')
+	{
+		return;
+	}
+
+	// If line starts with '[', means found section header
+	if (*line == '[')
+	{
+		char *close = memchr(line, ']', end - line);
+		if (close == NULL)
+		{
+			parser_diagnose(parser, "missing ']' in section header");
+			close = end;
+		}
+
+		// Hash the section name as the intent
+		parser->index = hash(trim(line + 1, close));
+		parser->seen_section = 1;
+		if (parser->index == -1)
+		{
+			parser_diagnose(parser, "unknown section");
+		}
+		return;
+	}
+
+	// Any other line must be an entity and response pair
+	char *equals = memchr(line, '=', end - line);
+	if (equals == NULL)
+	{
+		parser_diagnose(parser, "expected entity=response");
+		return;
+	}
+
+	// Lines in an unknown section were reported with its header, but lines before any section are reported here
+	if (parser->index == -1)
+	{
+		if (!parser->seen_section)
+		{
+			parser_diagnose(parser, "entity outside of a section");
+		}
+		return;
+	}
+
+	char *entity = trim(line, equals);
+	char *response = trim(equals + 1, end);
+	size_t entity_len = strlen(entity);
+	if (entity_len == 0)
+	{
+		parser_diagnose(parser, "missing entity");
+	}
+	// Pass the entity and response on, unless an earlier one ran out of memory
+	else if (parser->result != KB_NOMEM)
+	{
+		int result = parser->emit(parser->context, parser->index, entity, entity_len, response, strlen(response));
+		parser->result = result == KB_NOMEM ? KB_NOMEM : parser->result + (result == KB_OK);
+	}
+}
+
+/*
+ * Parse a block of a knowledge file. Complete lines are parsed straight
+ * from the block, and a partial line at the end of the block is carried
+ * over and completed by the next block, so lines may be of any length and
+ * every character is read once.
+ *
+ * Input:
+ *   parser - the parser
+ *   block  - the block, which is split in place, followed by one writable character
+ *   len    - the length of the block
+ *
+ * Returns: the number of responses emitted so far, or KB_NOMEM
+ */
+static int parser_feed(kb_parser *parser, char *block, size_t len)
+{
+	char *line = block, *end = block + len;
+
+	while (line < end && parser->result != KB_NOMEM)
+	{
+		char *eol = memchr(line, '\n', end - line);
+		size_t part = (eol == NULL ? end : eol) - line;
+
+		// If a partial line is being carried over, or this line is not complete, carry the line over
+		if (parser->carry_len > 0 || eol == NULL)
+		{
+			if (parser->carry_len + part + 1 > parser->carry_capacity)
+			{
+				size_t capacity = (parser->carry_len + part + 1) * 2;
+				char *carry = realloc(parser->carry, capacity);
+				if (carry == NULL)
+				{
+					parser->result = KB_NOMEM;
+					break;
+				}
+				parser->carry = carry;
+				parser->carry_capacity = capacity;
+			}
+			memcpy(parser->carry + parser->carry_len, line, part);
+			parser->carry_len += part;
+
+			// Parse the carried line once its newline is found
+			if (eol != NULL)
+			{
+				parse_line(parser, parser->carry, parser->carry_len);
+				parser->carry_len = 0;
+			}
+		}
+		else
+		{
+			parse_line(parser, line, part);
+		}
+
+		line += part + 1;
+	}
+
+	return parser->result;
+}
+
+/*
+ * Finish parsing a knowledge file, parsing a last line that has no newline.
+ *
+ * Input:
+ *   parser - the parser
+ *
+ * Returns: the number of responses emitted, or KB_NOMEM
+ */
+static int parser_finish(kb_parser *parser)
+{
+	if (parser->carry_len > 0 && parser->result != KB_NOMEM)
+	{
+		parse_line(parser, parser->carry, parser->carry_len);
+	}
+
+	free(parser->carry);
+	parser->carry = NULL;
+	parser->carry_len = parser->carry_capacity = 0;
+	return parser->result;
+}
+
+// Initialise a parser that starts in the given section and passes each entity and response to emit
+static void parser_init(kb_parser *parser, int index, int (*emit)(void *, int, const char *, size_t, const char *, size_t), void *context)
+{
+	memset(parser, 0, sizeof(kb_parser));
+	parser->index = index;
+	parser->emit = emit;
+	parser->context = context;
+}
+
+/*
+ * Put an entity and response read from a knowledge file, as
+ * knowledge_put_len(), without searching the question list while the
+ * section is in order of key and started an empty list.
+ *
+ * Input:
+ *   run          - the run of the file being loaded, with index -1 at the start of the file
+ *   index        - the index of the section in the hashtable
+ *   entity       - the entity
+ *   entity_len   - the length of the entity
+ *   response     - the response
+ *   response_len - the length of the response
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int put_loaded(sorted_run *run, int index, const char *entity, size_t entity_len, const char *response, size_t response_len)
+{
+	// A sharded knowledge base sends it to the backend that owns it, with others, leaving the result to route_flush()
+	if (route_enabled)
+	{
+		return route_put(index, entity, entity_len, response, response_len, 0, 1);
+	}
+
+	// A new section starts a run if its question list is still empty
+	if (index != run->index)
+	{
+		run->index = index;
+		run->sorted = hashtable[index] == NULL;
+		run->last = NULL;
+	}
+
+	// The run ends at the first entity out of order, or equal to the one before
+	if (run->sorted && run->last != NULL)
+	{
+		size_t key_len;
+		unsigned long long h;
+		const char *key = entity_key(entity, entity_len, &key_len, &h);
+		if (key == NULL)
+		{
+			return KB_NOMEM;
+		}
+		run->sorted = compare_keys(run->last->key->data, run->last->key->len, key, key_len) < 0;
+	}
+
+	node *stored;
+	int result = put_node(index, entity, entity_len, response, response_len, 0, run->sorted, &stored);
+	if (result == KB_OK)
+	{
+		run->last = stored;
+	}
+	return result;
+}
+
+// Emit function that puts each entity and response straight into memory
+static int emit_put(void *context, int index, const char *entity, size_t entity_len, const char *response, size_t response_len)
+{
+	return put_loaded(context, index, entity, entity_len, response, response_len);
+}
+
+// Emit function that stages each entity and response of a chunk, to be merged into memory later
+static int emit_stage(void *context, int index, const char *entity, size_t entity_len, const char *response, size_t response_len)
+{
+	load_chunk *chunk = context;
+
+	// Grow the staged entries when full
+	if (chunk->count == chunk->capacity)
+	{
+		int capacity = chunk->capacity == 0 ? 256 : chunk->capacity * 2;
+		staged_entry *entries = realloc(chunk->entries, capacity * sizeof(staged_entry));
+		if (entries == NULL)
+		{
+			return KB_NOMEM;
+		}
+		chunk->entries = entries;
+		chunk->capacity = capacity;
+	}
+
+	chunk->entries[chunk->count].index = index;
+	chunk->entries[chunk->count].entity = entity;
+	chunk->entries[chunk->count].entity_len = entity_len;
+	chunk->entries[chunk->count].response = response;
+	chunk->entries[chunk->count].response_len = response_len;
+	chunk->count++;
+	return KB_OK;
+}
+
+// Loader thread, which parses chunks until there are none left
+static void *load_worker(void *arg)
+{
+	load_job *job = arg;
+
+	while (1)
+	{
+		// Take the next chunk to be parsed
+		pthread_mutex_lock(&job->lock);
+		int i = job->next++;
+		pthread_mutex_unlock(&job->lock);
+
+		// Stop when all chunks have been taken
+		if (i >= job->count)
+		{
+			return NULL;
+		}
+
+		// A chunk that does not start a file does not know which section it starts in
+		load_chunk *chunk = &job->chunks[i];
+		parser_init(&chunk->parser, chunk->first ? -1 : SECTION_UNRESOLVED, emit_stage, chunk);
+		chunk->parser.seen_section = !chunk->first;
+		parser_feed(&chunk->parser, chunk->start, chunk->end - chunk->start);
+		parser_finish(&chunk->parser);
+	}
+}
+
+/*
+ * Read a whole stream into a buffer that ends with a newline and one
+ * writable character, so that it can be parsed in place.
+ *
+ * Input:
+ *   f   - the file
+ *   len - receives the number of characters in the buffer
+ *
+ * Returns: the buffer, which the caller must free, or NULL if there was a memory allocation failure
+ */
+static char *read_stream(FILE *f, size_t *len)
+{
+	size_t capacity = KB_BLOCK_SIZE, size = 0, got;
+	char *buffer = malloc(capacity + 2);
+
+	// Read the stream in large blocks, growing the buffer as needed
+	while (buffer != NULL && (got = fread(buffer + size, 1, capacity - size, f)) > 0)
+	{
+		size += got;
+		if (size == capacity)
+		{
+			char *bigger = realloc(buffer, capacity * 2 + 2);
+			if (bigger == NULL)
+			{
+				free(buffer);
+				return NULL;
+			}
+			buffer = bigger;
+			capacity *= 2;
+		}
+	}
+
+	if (buffer != NULL)
+	{
+		// End the last line with a newline, so no chunk ends with a partial line
+		if (size > 0 && buffer[size - 1] != '\n')
+		{
+			buffer[size++] = '\n';
+		}
+		buffer[size] = '\0';
+		*len = size;
+	}
+	return buffer;
+}
+
+// Record the diagnostics of a parser as those of the last load, numbering lines from the given line of the given file
+static void add_diagnostics(const kb_parser *parser, int file, int first_line)
+{
+	for (int i = 0; i < parser->diagnostic_count; i++)
+	{
+		if (diagnostic_count < KB_MAX_DIAGNOSTICS && i < KB_MAX_DIAGNOSTICS)
+		{
+			diagnostics[diagnostic_count] = parser->diagnostics[i];
+			diagnostics[diagnostic_count].file = file;
+			diagnostics[diagnostic_count].line += first_line;
+		}
+		diagnostic_count++;
+	}
+}
+
+/*
+ * Parse buffers holding whole files. Large files are split at line
+ * boundaries into chunks, and all chunks are parsed in parallel. Parsing
+ * changes nothing but the buffers and the chunks, so it may run on any
+ * thread while the knowledge base is in use.
+ *
+ * Input:
+ *   job     - receives the parsed chunks, to be merged by merge_chunks()
+ *   buffers - the file contents, as returned by read_stream()
+ *   lens    - the length of each buffer
+ *   count   - the number of buffers
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+static int parse_buffers(load_job *job, char *buffers[], const size_t lens[], int count)
+{
+	// Count the chunks needed to split every file
+	job->count = 0;
+	for (int i = 0; i < count; i++)
+	{
+		job->count += (int)(lens[i] / KB_CHUNK_SIZE) + 1;
+	}
+
+	job->chunks = calloc(job->count, sizeof(load_chunk));
+	if (job->chunks == NULL)
+	{
+		return KB_NOMEM;
+	}
+
+	// Split each file into chunks that end just after a newline
+	job->count = 0;
+	for (int i = 0; i < count; i++)
+	{
+		char *start = buffers[i], *end = buffers[i] + lens[i];
+		int first = 1;
+
+		while (first || start < end)
+		{
+			char *split = start + KB_CHUNK_SIZE < end ? start + KB_CHUNK_SIZE : end;
+			char *eol = memchr(split, '\n', end - split);
+			split = eol == NULL ? end : eol + 1;
+
+			job->chunks[job->count].start = start;
+			job->chunks[job->count].end = split;
+			job->chunks[job->count].file = i;
+			job->chunks[job->count].first = first;
+			job->count++;
+
+			start = split;
+			first = 0;
+		}
+	}
+
+	// Start one loader thread per processor, but no more than there are chunks
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	int threads = processors < 1 ? 1 : processors > KB_MAX_THREADS ? KB_MAX_THREADS : (int)processors;
+	if (threads > job->count)
+	{
+		threads = job->count;
+	}
+
+	pthread_t workers[KB_MAX_THREADS];
+	int started = 0;
+	job->next = 0;
+	pthread_mutex_init(&job->lock, NULL);
+	while (started < threads - 1 && pthread_create(&workers[started], NULL, load_worker, job) == 0)
+	{
+		started++;
+	}
+
+	// This thread parses chunks too, then waits for the others to finish
+	load_worker(job);
+	for (int i = 0; i < started; i++)
+	{
+		pthread_join(workers[i], NULL);
+	}
+	pthread_mutex_destroy(&job->lock);
+
+	return KB_OK;
+}
+
+/*
+ * Merge parsed chunks into memory in file order, so when an entity appears
+ * more than once, the last one read wins no matter how the chunks were
+ * scheduled. The chunks are freed.
+ *
+ * Input:
+ *   job - the chunks, from parse_buffers()
+ *
+ * Returns: the number of entity/response pairs successful read, or KB_NOMEM
+ */
+static int merge_chunks(load_job *job)
+{
+	int success_read = 0; // Counter for number of successful entity and response read into memory
+
+	// Merge the staged entries into memory in file order
+	int index = -1, line = 0;
+	sorted_run run = {-1, 0, NULL};
+	for (int i = 0; i < job->count; i++)
+	{
+		load_chunk *chunk = &job->chunks[i];
+
+		// If the loader thread ran out of memory, stop writing to memory and return KB_NOMEM
+		if (chunk->parser.result == KB_NOMEM)
+		{
+			success_read = KB_NOMEM;
+			break;
+		}
+
+		// Each file starts outside of any section, on its first line
+		if (chunk->first)
+		{
+			index = -1;
+			line = 0;
+			run.index = -1;
+		}
+
+		add_diagnostics(&chunk->parser, chunk->file, line);
+		line += chunk->parser.line;
+
+		for (int j = 0; j < chunk->count && success_read != KB_NOMEM; j++)
+		{
+			// Entries before the first section header in the chunk belong to the section open at the end of the previous chunk
+			int entry_index = chunk->entries[j].index == SECTION_UNRESOLVED ? index : chunk->entries[j].index;
+			if (entry_index == -1)
+			{
+				continue;
+			}
+
+			// Put the intent, entity and response into memory, and get the result of the operation
+			staged_entry *entry = &chunk->entries[j];
+			int result = put_loaded(&run, entry_index, entry->entity, entry->entity_len, entry->response, entry->response_len);
+
+			// If knowledge_put operation was successful, add 1 to number of successful read ins
+			if (result == KB_OK)
+			{
+				success_read++;
+			}
+			// If knowledge_put operation indicate a lack of memory, stop writing to memory and return KB_NOMEM
+			else if (result == KB_NOMEM)
+			{
+				success_read = KB_NOMEM;
+			}
+		}
+
+		// Carry the section open at the end of this chunk into the next chunk
+		if (chunk->parser.index != SECTION_UNRESOLVED)
+		{
+			index = chunk->parser.index;
+		}
+	}
+
+	for (int i = 0; i < job->count; i++)
+	{
+		free(job->chunks[i].entries);
+	}
+	free(job->chunks);
+
+	// Return the number of successful read into memory
+	return success_read;
+}
+
+// Define files parsed by knowledge_parse(), waiting to be merged into memory
+struct kb_parsed
+{
+	load_job job;	 // The parsed chunks
+	char **buffers; // The file contents, which the chunks point into
+	int count;		 // The number of files
+};
+
+/*
+ * Parse files read into memory, without changing the knowledge base, so
+ * that it may be done on another thread while the chatbot keeps answering.
+ * knowledge_merge() then puts what was parsed into memory.
+ *
+ * Input:
+ *   buffers - the file contents, each ending with a newline followed by a writable character, with the array
+ *             holding them; all are taken over, and freed by knowledge_merge() or if parsing fails
+ *   lens    - the length of each buffer
+ *   count   - the number of buffers
+ *
+ * Returns: the parsed files, or NULL if there was a memory allocation failure
+ */
+kb_parsed *knowledge_parse(char *buffers[], const size_t lens[], int count)
+{
+	kb_parsed *parsed = malloc(sizeof(kb_parsed));
+
+	if (parsed == NULL || parse_buffers(&parsed->job, buffers, lens, count) != KB_OK)
+	{
+		for (int i = 0; i < count; i++)
+		{
+			free(buffers[i]);
+		}
+		free(buffers);
+		free(parsed);
+		return NULL;
+	}
+
+	parsed->buffers = buffers;
+	parsed->count = count;
+	return parsed;
+}
+
+// Utility function to put parsed files into memory and free them, for knowledge_merge() and knowledge_read_files()
+static int merge_parsed(kb_parsed *parsed)
+{
+	diagnostic_count = 0;
+	int success_read = merge_chunks(&parsed->job);
+
+	// The responses that backends failed to put were not read after all
+	if (route_enabled && success_read >= 0)
+	{
+		success_read -= route_flush();
+	}
+
+	for (int i = 0; i < parsed->count; i++)
+	{
+		free(parsed->buffers[i]);
+	}
+	free(parsed->buffers);
+	free(parsed);
+
+	// Make room for what was loaded by evicting learned responses, if there is a budget
+	enforce_budget(NULL);
+	return success_read;
+}
+
+/*
+ * Put files parsed by knowledge_parse() into memory, as knowledge_read_files()
+ * would, and free them.
+ *
+ * Lines that cannot be read are skipped, and are reported by
+ * knowledge_diagnostics().
+ *
+ * Input:
+ *   parsed - the parsed files
+ *
+ * Returns: the number of entity/response pairs successful read from the files, or KB_NOMEM
+ */
+int knowledge_merge(kb_parsed *parsed)
+{
+	unsigned long long start = stats_clock();
+	int success_read = merge_parsed(parsed);
+	stats_time(STAT_TIME_READ, start);
+	return success_read;
+}
+
+/*
+ * Stream a file through the parser in large blocks, putting what it holds
+ * into memory, so that it is never held in memory as a whole.
+ *
+ * Input:
+ *   f    - the file
+ *   file - the index of the file among those being loaded, for its diagnostics
+ *
+ * Returns: the number of entity/response pairs successful read from the file, or KB_NOMEM
+ */
+static int stream_file(FILE *f, int file)
+{
+	kb_parser parser;
+	char *block = malloc(KB_BLOCK_SIZE + 1); // Block of the file, with room for the parser to terminate its last line
+	size_t got;
+
+	// Return KB_NOMEM if there is insufficient memory for the block
+	if (block == NULL)
+	{
+		return KB_NOMEM;
+	}
+
+	// Read blocks from the file until it hits end of file, or memory runs out
+	sorted_run run = {-1, 0, NULL};
+	parser_init(&parser, -1, emit_put, &run);
+	while ((got = fread(block, 1, KB_BLOCK_SIZE, f)) > 0 && parser_feed(&parser, block, got) != KB_NOMEM)
+	{
+	}
+	int success_read = parser_finish(&parser);
+
+	add_diagnostics(&parser, file, 0);
+	free(block);
+
+	// The responses that backends failed to put were not read after all
+	if (route_enabled && success_read >= 0)
+	{
+		success_read -= route_flush();
+	}
+
+	return success_read;
+}
+
+/*
+ * Read a knowledge base from a file. The file is streamed through the
+ * parser in large blocks, so it is never held in memory as a whole.
+ *
+ * Lines that cannot be read are skipped, and are reported by
+ * knowledge_diagnostics().
+ *
+ * Input:
+ *   f - the file
+ *
+ * Returns: the number of entity/response pairs successful read from the file, or KB_NOMEM
+ */
+int knowledge_read(FILE *f)
+{
+	unsigned long long start = stats_clock();
+
+	diagnostic_count = 0;
+	int success_read = stream_file(f, 0);
+
+	// Make room for what was loaded by evicting learned responses, if there is a budget
+	enforce_budget(NULL);
+	stats_time(STAT_TIME_READ, start);
+
+	// Return the number of successful read into memory
+	return success_read;
+}
+
+/*
+ * Read knowledge files one after the other, streaming each through the
+ * parser, as knowledge_read_files() does when any of them is compressed.
+ * Every file is opened before any knowledge is changed.
+ *
+ * Input:
+ *   file_names - the names of the files
+ *   count      - the number of files
+ *
+ * Returns: as knowledge_read_files()
+ */
+static int read_streamed(const char *file_names[], int count)
+{
+	FILE **files = calloc(count, sizeof(FILE *));
+	int success_read = files == NULL ? KB_NOMEM : 0;
+
+	for (int i = 0; i < count && success_read == 0; i++)
+	{
+		files[i] = gzip_open(file_names[i], "rb", gzip_named(file_names[i]));
+		success_read = files[i] == NULL ? KB_NOTFOUND : 0;
+	}
+
+	// Each file is put into memory in turn, so a later file overwrites the responses of an earlier one
+	for (int i = 0; i < count && success_read >= 0; i++)
+	{
+		int result = stream_file(files[i], i);
+		success_read = result < 0 ? result : success_read + result;
+	}
+
+	for (int i = 0; files != NULL && i < count; i++)
+	{
+		if (files[i] != NULL)
+		{
+			fclose(files[i]);
+		}
+	}
+	free(files);
+	return success_read;
+}
+
+/*
+ * Read a knowledge base from several files. All files are parsed in
+ * parallel, then merged in the order given, so a later file overwrites the
+ * responses of an earlier one. Files named *.gz are gzip-compressed; since
+ * they are decompressed as they are parsed, rather than into memory, a
+ * load with any of them parses its files one after the other instead.
+ *
+ * Lines that cannot be read are skipped, and are reported by
+ * knowledge_diagnostics().
+ *
+ * Input:
+ *   file_names - the names of the files
+ *   count      - the number of files
+ *
+ * Returns:
+ *   the number of entity/response pairs successful read from the files
+ *   KB_NOTFOUND, if any file could not be opened (nothing is read)
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int knowledge_read_files(const char *file_names[], int count)
+{
+	char **buffers = calloc(count, sizeof(char *));
+	size_t *lens = calloc(count, sizeof(size_t));
+	int success_read = 0;
+	unsigned long long start = stats_clock();
+
+	diagnostic_count = 0;
+
+	if (buffers == NULL || lens == NULL)
+	{
+		success_read = KB_NOMEM;
+	}
+
+	// Stream the files instead if any is compressed
+	for (int i = 0; i < count && success_read == 0; i++)
+	{
+		if (gzip_named(file_names[i]))
+		{
+			success_read = read_streamed(file_names, count);
+			enforce_budget(NULL);
+			stats_time(STAT_TIME_READ, start);
+			free(buffers);
+			free(lens);
+			return success_read;
+		}
+	}
+
+	// Read every file into memory before any knowledge is changed
+	for (int i = 0; i < count && success_read == 0; i++)
+	{
+		FILE *f = fopen(file_names[i], "r");
+
+		// If file does not open, return KB_NOTFOUND
+		if (f == NULL)
+		{
+			success_read = KB_NOTFOUND;
+			break;
+		}
+
+		buffers[i] = read_stream(f, &lens[i]);
+		fclose(f);
+
+		if (buffers[i] == NULL)
+		{
+			success_read = KB_NOMEM;
+		}
+	}
+
+	// Parse the files, then merge them into memory; the buffers are taken over either way
+	if (success_read == 0)
+	{
+		kb_parsed *parsed = knowledge_parse(buffers, lens, count);
+		success_read = parsed == NULL ? KB_NOMEM : merge_parsed(parsed);
+		buffers = NULL;
+	}
+
+	for (int i = 0; buffers != NULL && i < count; i++)
+	{
+		free(buffers[i]);
+	}
+	free(buffers);
+	free(lens);
+
+	stats_time(STAT_TIME_READ, start);
+	return success_read;
+}
+
+/*
+ * Get the lines of the last load that could not be read.
+ *
+ * Input:
+ *   list - receives the first KB_MAX_DIAGNOSTICS of them, in file order
+ *
+ * Returns: the number of lines that could not be read
+ */
+int knowledge_diagnostics(const kb_diagnostic **list)
+{
+	*list = diagnostics;
+	return diagnostic_count;
+}
+
+// Free every node of the question lists and their Bloom filters, leaving the frozen image alone
+static void free_lists()
+{
+	// Iterate through through the hashtable
+	for (int i = 0; i < MAX_HASHTABLE; i++)
+	{
+		// Create a cursor to iterate through the linked list
+		node *cursor = hashtable[i];
+
+		// Iterate through the linked list at index
+		while (cursor != NULL)
+		{
+			// Free the memory of the current node and move the cursor to the next node
+			node *next_node = cursor->next;
+			intern_release(cursor->entity);
+			intern_release(cursor->key);
+			intern_release(cursor->response);
+			free(cursor);
+			cursor = next_node;
+		}
+
+		// Reset index in hashtable to NULL, and drop its Bloom filter until entities are added again
+		hashtable[i] = NULL;
+		entry_count[i] = 0;
+		shadowed[i] = 0;
+		free(filters[i].blocks);
+		memset(&filters[i], 0, sizeof(bloom_filter));
+	}
+
+	memory_used = 0;
+	least_recent = NULL;
+	most_recent = NULL;
+}
+
+// Let go of the frozen image, wherever it comes from
+static void release_frozen()
+{
+	if (frozen != NULL && frozen_source == FROZEN_SHARED)
+	{
+		shared_unmap(frozen);
+	}
+	else if (frozen_source == FROZEN_EMBEDDED)
+	{
+		image_forget(frozen);
+	}
+	else
+	{
+		image_free(frozen);
+	}
+
+	frozen = NULL;
+	frozen_source = FROZEN_BUILT;
+}
+
+// Count again the entities of the question lists that override an entity of the frozen image
+static void count_shadowed()
+{
+	for (int i = 0; i < MAX_HASHTABLE; i++)
+	{
+		shadowed[i] = 0;
+		for (node *cursor = hashtable[i]; cursor != NULL && frozen != NULL; cursor = cursor->next)
+		{
+			if (image_find(frozen, i, cursor->key->data, cursor->key->len, cursor->hash) >= 0)
+			{
+				shadowed[i]++;
+			}
+		}
+	}
+}
+
+// Define a node of a question list while the list is being keyed again
+typedef struct rekeyed_node
+{
+	node *n;		 // The node
+	size_t position; // Position of the node in its list, from the newest
+} rekeyed_node;
+
+// Utility function to order nodes by their keys, and nodes with equal keys from the newest
+static int compare_rekeyed(const void *a, const void *b)
+{
+	const rekeyed_node *x = a, *y = b;
+
+	if (x->n->hash != y->n->hash)
+	{
+		return x->n->hash < y->n->hash ? -1 : 1;
+	}
+	if (x->n->key->len != y->n->key->len)
+	{
+		return x->n->key->len < y->n->key->len ? -1 : 1;
+	}
+	int order = memcmp(x->n->key->data, y->n->key->data, x->n->key->len);
+	if (order != 0)
+	{
+		return order;
+	}
+	return x->position < y->position ? -1 : x->position > y->position;
+}
+
+/*
+ * Make the keys of the question lists again, after the steps of the
+ * normalization have changed. Entities that now have the same key are
+ * merged, keeping the one put last, and the Bloom filters are rebuilt.
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure; some nodes may keep their old keys
+ */
+static int rekey_lists()
+{
+	int result = KB_OK;
+
+	for (int i = 0; i < MAX_HASHTABLE; i++)
+	{
+		if (hashtable[i] == NULL)
+		{
+			continue;
+		}
+
+		// Normalize each entity again
+		for (node *cursor = hashtable[i]; cursor != NULL; cursor = cursor->next)
+		{
+			size_t key_len;
+			unsigned long long h;
+			const char *key = entity_key(cursor->entity->data, cursor->entity->len, &key_len, &h);
+			const kb_string *pooled_key = key == NULL ? NULL : intern(key, key_len);
+			if (pooled_key == NULL)
+			{
+				result = KB_NOMEM;
+				continue;
+			}
+			intern_release(cursor->key);
+			cursor->key = pooled_key;
+			cursor->hash = h;
+		}
+
+		// Find the nodes whose key is also the key of a newer node, by sorting the nodes by key
+		rekeyed_node *sorted = malloc(entry_count[i] * sizeof(rekeyed_node));
+		unsigned char *merged = calloc(entry_count[i], 1);
+		if (sorted == NULL || merged == NULL)
+		{
+			free(sorted);
+			free(merged);
+			result = KB_NOMEM;
+			continue;
+		}
+		size_t count = 0;
+		for (node *cursor = hashtable[i]; cursor != NULL; cursor = cursor->next, count++)
+		{
+			sorted[count].n = cursor;
+			sorted[count].position = count;
+		}
+		qsort(sorted, count, sizeof(rekeyed_node), compare_rekeyed);
+		for (size_t j = 1; j < count; j++)
+		{
+			if (compare_rekeyed(&(rekeyed_node){sorted[j - 1].n, 0}, &(rekeyed_node){sorted[j].n, 0}) == 0)
+			{
+				merged[sorted[j].position] = 1;
+			}
+		}
+
+		// Free the merged nodes
+		node **link = &hashtable[i];
+		for (size_t position = 0; *link != NULL; position++)
+		{
+			node *cursor = *link;
+			if (!merged[position])
+			{
+				link = &cursor->next;
+				continue;
+			}
+			*link = cursor->next;
+			if (cursor->learned)
+			{
+				unlink_learned(cursor);
+			}
+			intern_release(cursor->entity);
+			intern_release(cursor->key);
+			intern_release(cursor->response);
+			free(cursor);
+			entry_count[i]--;
+			memory_used -= sizeof(node);
+		}
+		free(sorted);
+		free(merged);
+
+		// The old keys are still in the Bloom filter, so fill it again
+		if (filters[i].capacity > 0)
+		{
+			bloom_rebuild(i, filters[i].capacity);
+		}
+	}
+
+	return result;
+}
+
+// Utility function to order the entities of an image by intent and key
+static int compare_entries(const void *a, const void *b)
+{
+	const kb_entry *x = a, *y = b;
+
+	if (x->index != y->index)
+	{
+		return x->index < y->index ? -1 : 1;
+	}
+	if (x->hash != y->hash)
+	{
+		return x->hash < y->hash ? -1 : 1;
+	}
+	if (x->key_len != y->key_len)
+	{
+		return x->key_len < y->key_len ? -1 : 1;
+	}
+	return memcmp(x->key, y->key, x->key_len);
+}
+
+/*
+ * Make the keys of the frozen image again, after the steps of the
+ * normalization have changed, by building a new image of its own. An
+ * image embedded in the program or shared by other processes is left as
+ * it is, and a shared one is no longer followed.
+ *
+ * Returns:
+ *   KB_OK, if successful, or if the keys of the image did not need to change
+ *   KB_NOMEM, if there was a memory allocation failure (nothing is changed)
+ */
+static int rekey_frozen()
+{
+	if (frozen == NULL || frozen->normalization == (unsigned int)normalize_get())
+	{
+		return KB_OK;
+	}
+
+	// Measure the room needed for the new keys, and for the responses if they have to be restored
+	size_t count = frozen->count, keys_size = 0, restored_size = 0;
+	int compressed = (frozen->flags & KB_IMAGE_COMPRESSED) != 0;
+	kb_entry *entries = malloc((count + 1) * sizeof(kb_entry));
+	if (entries == NULL)
+	{
+		return KB_NOMEM;
+	}
+	for (unsigned int slot = 0; slot < count; slot++)
+	{
+		image_entry_at(frozen, slot, &entries[slot]);
+		keys_size += entries[slot].entity_len + 1;
+		restored_size += compressed ? entries[slot].response_len + 1 : 0;
+	}
+	char *keys = malloc(keys_size + 1);
+	char *restored = compressed ? malloc(restored_size + 1) : NULL;
+	if (keys == NULL || (compressed && restored == NULL))
+	{
+		free(entries);
+		free(keys);
+		free(restored);
+		return KB_NOMEM;
+	}
+
+	// Normalize each entity again, restoring its response if it is compressed
+	char *key_cursor = keys, *restored_cursor = restored;
+	for (unsigned int slot = 0; slot < count; slot++)
+	{
+		kb_entry *entry = &entries[slot];
+		entry->key = key_cursor;
+		entry->key_len = normalize_entity(entry->entity, entry->entity_len, key_cursor);
+		entry->hash = entity_hash(entry->key, entry->key_len);
+		key_cursor += entry->key_len + 1;
+		if (compressed)
+		{
+			image_copy_response(frozen, slot, restored_cursor, entry->response_len + 1, 0);
+			entry->response = restored_cursor;
+			restored_cursor += entry->response_len + 1;
+		}
+	}
+
+	// Keep one of the entities that now have the same key, found next to each other once sorted by key; an image
+	// does not know which was put last
+	qsort(entries, count, sizeof(kb_entry), compare_entries);
+	size_t kept = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (kept == 0 || compare_entries(&entries[kept - 1], &entries[i]) != 0)
+		{
+			entries[kept++] = entries[i];
+		}
+	}
+
+	kb_image *image = image_build(entries, kept, compressed);
+	free(entries);
+	free(keys);
+	free(restored);
+	if (image == NULL)
+	{
+		return KB_NOMEM;
+	}
+
+	// Replace the old image with the new one, which is no longer the shared one
+	int was_shared = frozen_source == FROZEN_SHARED;
+	release_frozen();
+	if (was_shared)
+	{
+		shared_close();
+	}
+	frozen = image;
+	return KB_OK;
+}
+
+// Use a generation of a shared knowledge base as the frozen image, under the question lists
+static void use_shared(kb_image *image)
+{
+	release_frozen();
+	frozen = image;
+	frozen_source = FROZEN_SHARED;
+
+	// Normalize entities as the image does, so that its keys can be used as they are
+	if (frozen->normalization != (unsigned int)normalize_get())
+	{
+		normalize_set((int)frozen->normalization);
+		rekey_lists();
+	}
+
+	// Count again the entities of the question lists that override the new image
+	count_shadowed();
+
+	// Make sure callers size their buffers for the responses of the image too
+	if (frozen->max_response > max_response)
+	{
+		max_response = frozen->max_response;
+	}
+}
+
+/*
+ * Empty the knowledge base completely, removing all known entities from all
+ * intents, including those embedded in the program.
+ */
+void knowledge_clear()
+{
+	free_lists();
+
+	release_frozen();
+	shared_close();
+	max_response = 0;
+}
+
+// Utility function to send every entity of the frozen image to the backend of a sharded knowledge base that owns it,
+// unless that backend already knew something after the reset
+static void route_frozen()
+{
+	char *restored = malloc(frozen->max_response + 1);
+
+	for (unsigned int slot = 0; slot < frozen->count; slot++)
+	{
+		kb_entry entry;
+		image_entry_at(frozen, slot, &entry);
+		if (!route_fresh(entry.index, entry.entity, entry.entity_len))
+		{
+			continue;
+		}
+		if (entry.response == NULL)
+		{
+			if (restored == NULL || image_copy_response(frozen, slot, restored, frozen->max_response + 1, 0) != KB_OK)
+			{
+				continue;
+			}
+			entry.response = restored;
+		}
+		route_put(entry.index, entry.entity, entry.entity_len, entry.response, entry.response_len, 0, 1);
+	}
+	route_flush();
+
+	free(restored);
+}
+
+/*
+ * Reset the knowledge base, removing all know entitities from all intents.
+ * The knowledge embedded in the program, if any, is put back as the frozen
+ * image, which only takes pointing at it.
+ */
+void knowledge_reset()
+{
+	knowledge_clear();
+	if (replicate_leading)
+	{
+		replicate_reset();
+	}
+	if (route_enabled)
+	{
+		route_reset();
+	}
+
+	if (embedded_knowledge != NULL && embedded_knowledge->magic == KB_IMAGE_MAGIC)
+	{
+		frozen = (kb_image *)embedded_knowledge;
+		frozen_source = FROZEN_EMBEDDED;
+		max_response = frozen->max_response;
+
+		// If entities are normalized differently from when the program was built, it takes a copy after all
+		if (rekey_frozen() != KB_OK)
+		{
+			release_frozen();
+		}
+	}
+
+	// A sharded knowledge base keeps the embedded knowledge in its backends instead
+	if (route_enabled && frozen != NULL)
+	{
+		route_frozen();
+		release_frozen();
+	}
+}
+
 /*
- * Get the response to a question.
+ * Choose how entities are normalized into the keys they are matched by,
+ * and make the keys of everything known again. Entities that now have the
+ * same key are merged. A shared knowledge base is copied, and no longer
+ * followed; attaching to one normalizes entities as it does.
  *
  * Input:
- *   intent   - the question word
- *   entity   - the entity
- *   response - a buffer to receive the response
- *   n        - the maximum number of characters to write to the response buffer
+ *   flags - any of NORM_SPACE, NORM_PUNCT, NORM_ARTICLES, NORM_POSSESSIVES, NORM_PLURALS and NORM_UNICODE
  *
  * Returns:
- *   KB_OK, if a response was found for the intent and entity (the response is copied to the response buffer)
- *   KB_NOTFOUND, if no response could be found
- *   KB_INVALID, if 'intent' is not a recognised question word
+ *   KB_OK, if successful
+ *   KB_INVALID, if the knowledge base is sharded, as the keys place entities on their backends
+ *   KB_NOMEM, if there was a memory allocation failure; some entities may not be found until the next reset
  */
-int knowledge_get(const char *intent, const char *entity, char *response, int n)
+int knowledge_normalize(int flags)
 {
-	// Hash the intent
-	int index = hash(intent);
+	// Changing the keys of a sharded knowledge base would move entities to other backends than the ones holding them
+	if (route_enabled)
+	{
+		return flags == normalize_get() ? KB_OK : KB_INVALID;
+	}
 
-	// If the intent is valid, iterate through the question list
-	if (index != -1)
+	normalize_set(flags);
+	if (replicate_leading)
 	{
-		// Create a cursor to iterate through the linked list
-		node *cursor = hashtable[index];
+		replicate_normalize(flags);
+	}
+
+	int result = rekey_lists();
+	if (rekey_frozen() != KB_OK)
+	{
+		result = KB_NOMEM;
+	}
+	count_shadowed();
+
+	return result;
+}
+
+/*
+ * Get the frozen image of the knowledge base.
+ *
+ * Returns: the image, or NULL if the knowledge base has not been frozen
+ */
+const kb_image *knowledge_image()
+{
+	return frozen;
+}
+
+/*
+ * Freeze the knowledge base: compile everything known into a read-only
+ * image indexed by a minimal perfect hash, and empty the question lists.
+ * Questions are then answered with one probe and no pointer chasing.
+ * Responses put afterwards go into the question lists, which override the
+ * image until the next freeze folds them in.
+ *
+ * Input:
+ *   compressed - 1 to compress the responses in the image, 0 to store them as they are
+ *   image_size - receives the size of the image in bytes
+ *
+ * Returns:
+ *   the number of entity/response pairs in the image
+ *   KB_NOMEM, if there was a memory allocation failure (nothing is changed)
+ */
+int knowledge_freeze(int compressed, size_t *image_size)
+{
+	size_t count = frozen == NULL ? 0 : frozen->count;
+	for (int i = 0; i < MAX_HASHTABLE; i++)
+	{
+		count += entry_count[i];
+	}
+
+	kb_entry *entries = malloc((count + 1) * sizeof(kb_entry));
+	if (entries == NULL)
+	{
+		return KB_NOMEM;
+	}
 
-		// If question list at index is empty, return question not found
-		if (cursor == NULL)
+	// Collect the entities of the question lists
+	count = 0;
+	for (int i = 0; i < MAX_HASHTABLE; i++)
+	{
+		for (node *cursor = hashtable[i]; cursor != NULL; cursor = cursor->next)
 		{
-			return KB_NOTFOUND;
+			kb_entry *entry = &entries[count++];
+			entry->index = i;
+			entry->hash = cursor->hash;
+			entry->entity = cursor->entity->data;
+			entry->entity_len = cursor->entity->len;
+			entry->key = cursor->key->data;
+			entry->key_len = cursor->key->len;
+			entry->response = cursor->response->data;
+			entry->response_len = cursor->response->len;
 		}
+	}
 
-		// Iterate through the linked list at index
-		while (cursor != NULL)
+	// Collect the entities of the old image, except those overridden in the question lists
+	size_t from_lists = count, restored_size = 0;
+	for (unsigned int slot = 0; frozen != NULL && slot < frozen->count; slot++)
+	{
+		int probes;
+		image_entry_at(frozen, slot, &entries[count]);
+		if (find_node(entries[count].index, entries[count].key, entries[count].key_len, entries[count].hash, &probes) == NULL)
 		{
-			// Check if the entity and intent matches
-			if (compare_token(cursor->entity, entity) == 0 && compare_token(cursor->intent, intent) == 0)
-			{
-				// Check if response length is less than MAX_RESPONSE length
-				if (strlen(cursor->response) < n)
-				{
-					// Copy the response into the response buffer and return KB_OK since question is found
-					strcpy(response, cursor->response);
-					return KB_OK;
-				}
-			}
+			restored_size += entries[count].response_len + 1;
+			count++;
+		}
+	}
+
+	// If the old image is compressed, restore the responses it keeps, as the new image is built from them
+	char *restored = NULL;
+	if (frozen != NULL && (frozen->flags & KB_IMAGE_COMPRESSED) && count > from_lists)
+	{
+		restored = malloc(restored_size);
+		if (restored == NULL)
+		{
+			free(entries);
+			return KB_NOMEM;
+		}
 
-			// Move the cursor to the next node
-			cursor = cursor->next;
+		char *cursor = restored;
+		for (size_t i = from_lists; i < count; i++)
+		{
+			int slot = image_find(frozen, entries[i].index, entries[i].key, entries[i].key_len, entries[i].hash);
+			image_copy_response(frozen, slot, cursor, entries[i].response_len + 1, 0);
+			entries[i].response = cursor;
+			cursor += entries[i].response_len + 1;
 		}
+	}
 
-		// Return KB_NOTFOUND if question is not found after iterating through all available nodes in the question list
-		return KB_NOTFOUND;
+	kb_image *image = image_build(entries, count, compressed);
+	free(entries);
+	free(restored);
+	if (image == NULL)
+	{
+		return KB_NOMEM;
 	}
 
-	// Return KB_INVALID if intent is invalid
-	return KB_INVALID;
+	// Replace the old image with the new one, which now holds everything
+	free_lists();
+	release_frozen();
+	shared_close();
+	frozen = image;
+
+	*image_size = image->size;
+	return (int)count;
 }
 
 /*
- * Insert a new response to a question. If a response already exists for the
- * given intent and entity, it will be overwritten. Otherwise, it will be added
- * to the knowledge base.
+ * Publish the knowledge base for other chatbot processes on this host:
+ * freeze it, then copy the image into shared memory as the next generation
+ * of the shared knowledge base called 'name'. Processes attached to it
+ * switch to the new generation before their next command.
  *
  * Input:
- *   intent    - the question word
- *   entity    - the entity
- *   response  - the response for this question and entity
+ *   name       - the name of the shared knowledge base, of letters, digits, '-' and '_'
+ *   compressed - 1 to compress the responses in the image, 0 to store them as they are
  *
  * Returns:
- *   KB_FOUND, if successful
- *   KB_NOMEM, if there was a memory allocation failure
- *   KB_INVALID, if the intent is not a valid question word
+ *   the number of the new generation, from 1
+ *   KB_INVALID, if the name cannot be used
+ *   KB_NOMEM, if there was a memory allocation failure or the shared memory could not be created
  */
-int knowledge_put(const char *intent, const char *entity, const char *response)
+int knowledge_publish(const char *name, int compressed)
 {
-	// Hash the intent
-	int index = hash(intent);
+	size_t image_size;
 
-	// If the index is valid, put the knowledge into the question list
-	if (index != -1)
+	if (knowledge_freeze(compressed, &image_size) == KB_NOMEM)
 	{
-		// If question list at index is not empty, iterate through the linked list
-		if (hashtable[index] != NULL)
-		{
-			// Create a cursor to iterate through the linked list
-			node *cursor = hashtable[index];
+		return KB_NOMEM;
+	}
 
-			// Iterate through the linked list at index
-			while (cursor != NULL)
-			{
-				// Check if the entity and intent matches
-				if (compare_token(cursor->entity, entity) == 0 && compare_token(cursor->intent, intent) == 0)
-				{
-					// Replace current response for question with new response and return KB_OK since question is found
-					strcpy(cursor->response, response);
-					return KB_OK;
-				}
+	return shared_publish(name, frozen);
+}
 
-				// Move the cursor to the next node
-				cursor = cursor->next;
-			}
-		}
+/*
+ * Answer from a shared knowledge base published by another process. Its
+ * current generation replaces the frozen image, without copying it, and the
+ * question lists stay on top of it, so responses learned here are still
+ * kept here. Freezing or resetting lets go of the shared knowledge base.
+ *
+ * Input:
+ *   name - the name of the shared knowledge base
+ *
+ * Returns:
+ *   the number of entity/response pairs in the shared knowledge base
+ *   KB_NOTFOUND, if no shared knowledge base of that name has been published
+ */
+int knowledge_attach(const char *name)
+{
+	unsigned int generation;
+	kb_image *image = shared_attach(name, &generation);
 
-		// Create a new node
-		node *new_node = malloc(sizeof(node));
+	if (image == NULL)
+	{
+		return KB_NOTFOUND;
+	}
 
-		// Return KB_NOMEM if there is insufficient memory for allocation
-		if (new_node == NULL)
-		{
-			return KB_NOMEM;
-		}
+	use_shared(image);
+	return (int)frozen->count;
+}
 
-		// Copy the entity, intent, and response into the new node
-		strcpy(new_node->intent, intent);
-		strcpy(new_node->entity, entity);
-		strcpy(new_node->response, response);
+/*
+ * Switch to the latest generation of the shared knowledge base, if one has
+ * been published since the last switch. This is cheap when nothing has
+ * changed, and is meant to be called before each command.
+ */
+void knowledge_refresh()
+{
+	unsigned int generation;
 
-		// Initialize the next pointer in new node to NULL
-		new_node->next = NULL;
+	if (frozen_source != FROZEN_SHARED)
+	{
+		return;
+	}
 
-		// If question list is empty, add the new node to the hashtable
-		if (hashtable[index] == NULL)
-		{
-			// Add new node to be the header of the question list and return KB_OK since new node was successful added
-			hashtable[index] = new_node;
-			return KB_OK;
-		}
-		// If linked list already exist, add new node to start of the list
-		else
-		{
-			// Point new node to current header node and replace current header node in hashtable with new node, and return KB_OK since new node was successful added
-			new_node->next = hashtable[index];
-			hashtable[index] = new_node;
-			return KB_OK;
-		}
+	kb_image *image = shared_refresh(&generation);
+	if (image != NULL)
+	{
+		use_shared(image);
 	}
+}
 
-	// Return KB_INVALID if intent is invalid
-	return KB_INVALID;
+// Utility function to write an entity and its response to a file as one line
+static void write_entry(FILE *f, const char *entity, size_t entity_len, const char *response, size_t response_len)
+{
+	fwrite(entity, 1, entity_len, f);
+	fputc('=', f);
+	fwrite(response, 1, response_len, f);
+	fputc('\n', f);
+}
+
+static int write_routed(FILE *f);
+
+// Utility function to order entities by key, as they are written to a file
+static int compare_written(const void *a, const void *b)
+{
+	const kb_entry *x = a, *y = b;
+	return compare_keys(x->key, x->key_len, y->key, y->key_len);
 }
 
 /*
- * Read a knowledge base from a file.
+ * Write the knowledge base to a file. Sections are written in a fixed
+ * order, and the entities of each in order of their keys, so saving the
+ * same knowledge always writes the same file, whatever order it was put
+ * in, and a small change to the knowledge is a small change to the file.
  *
  * Input:
  *   f - the file
  *
- * Returns: the number of entity/response pairs successful read from the file
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure (nothing is written)
+ *   KB_UNAVAILABLE, if the knowledge base is sharded and a backend cannot be reached (nothing is written)
  */
-int knowledge_read(FILE *f)
+int knowledge_write(FILE *f)
 {
-	const int buff_size = MAX_ENTITY + 1 + MAX_RESPONSE + 1;
-	char buffer[buff_size]; // Buffer to hold read data from file
-	const char *delimiters = "=[]\n"; 
-	char intent[MAX_INTENT], entity[MAX_ENTITY], response[MAX_RESPONSE]; // Temp storage for intent, entity and response
-	intent[0] = '\0';
-	entity[0] ='\0';
-	response[0] = '\0';
-	int success_read = 0; // Counter for number of successful entity and response read into memory
+	unsigned long long start = stats_clock();
+
+	// A sharded knowledge base merges the knowledge of its backends
+	if (route_enabled)
+	{
+		int result = write_routed(f);
+		stats_time(STAT_TIME_WRITE, start);
+		return result;
+	}
 
-	// Read line in file until it hits end of file
-	while (!feof(f))
+	// Make room to sort the entities of the largest section, and to restore the responses of the frozen image if they are compressed
+	size_t most = 0;
+	for (int i = 0; i < MAX_HASHTABLE; i++)
+	{
+		size_t count = entry_count[i] + (frozen == NULL ? 0 : frozen->intent_count[i]);
+		most = count > most ? count : most;
+	}
+	kb_entry *entries = malloc((most + 1) * sizeof(kb_entry));
+	char *restored = NULL;
+	if (frozen != NULL && (frozen->flags & KB_IMAGE_COMPRESSED))
 	{
-		// Read line from file
-		fgets(buffer, buff_size, f);
+		restored = malloc(frozen->max_response + 1);
+	}
+	if (entries == NULL || (frozen != NULL && (frozen->flags & KB_IMAGE_COMPRESSED) && restored == NULL))
+	{
+		free(entries);
+		free(restored);
+		return KB_NOMEM;
+	}
 
-		// If line starts with '[' and ends with ']', means found section header
-		if (buffer[0] == '[' && buffer[strlen(buffer - 2) == ']'])
+	// Iterate through through the hashtable
+	for (int i = 0; i < MAX_HASHTABLE; i++)
+	{
+		// If the intent has no entities in its question list or the frozen image, skip its section
+		if (hashtable[i] == NULL && (frozen == NULL || frozen->intent_count[i] == 0))
 		{
-			// Remove special characters from section header and assign to intent
-			strcpy(intent, strtok(buffer, delimiters));
-			intent[strlen(intent)] = '\0';
+			continue;
+		}
 
-			// Hash the intent
-			int index = hash(intent);
+		// Collect the entities of the question list
+		size_t count = 0;
+		for (node *cursor = hashtable[i]; cursor != NULL; cursor = cursor->next)
+		{
+			kb_entry *entry = &entries[count++];
+			entry->index = i;
+			entry->hash = cursor->hash;
+			entry->entity = cursor->entity->data;
+			entry->entity_len = cursor->entity->len;
+			entry->key = cursor->key->data;
+			entry->key_len = cursor->key->len;
+			entry->response = cursor->response->data;
+			entry->response_len = cursor->response->len;
+		}
 
-			// If intent is valid, read subsequent lines in file for all the entities and responses for that intent
-			if (index != -1)
+		// Collect the entities of the intent in the frozen image, except those overridden in the question list
+		for (unsigned int slot = 0; frozen != NULL && slot < frozen->count; slot++)
+		{
+			int probes;
+			image_entry_at(frozen, slot, &entries[count]);
+			if (entries[count].index == i && find_node(i, entries[count].key, entries[count].key_len, entries[count].hash, &probes) == NULL)
 			{
-				// Create validator to check if read line is a valid entity and response
-				int valid_line;
+				count++;
+			}
+		}
 
-				// Read line for entity and response until it hits a line that does not contain an entity and response
-				do
+		// Write section header of the intent to file, then each entity and response in order of key
+		fprintf(f, "[%s]\n", intent_names[i]);
+		qsort(entries, count, sizeof(kb_entry), compare_written);
+		for (size_t j = 0; j < count; j++)
+		{
+			// Restore a compressed response without disturbing the cache
+			if (entries[j].response == NULL)
+			{
+				int slot = image_find(frozen, i, entries[j].key, entries[j].key_len, entries[j].hash);
+				if (image_copy_response(frozen, slot, restored, frozen->max_response + 1, 0) != KB_OK)
 				{
-					// Reset validator to default False
-					valid_line = 0;
-
-					// Read line from file
-					fgets(buffer, buff_size, f);
-
-					// If line is a valid entity and response pair, read into memory
-					if (strchr(buffer, '=') != NULL)
-					{
-						// Set validator to True
-						valid_line = 1;
-
-						// Remove special characters and trailing newline and assign to entity and response
-						strcpy(entity, strtok(buffer, delimiters));
-						strcpy(response, strtok(NULL, delimiters));
-						entity[strlen(entity)] = '\0';
-						response[strlen(response)] = '\0';
-
-						// Put the intent, entity and response into memory, and get the result of the operation
-						int result = knowledge_put(intent, entity, response);
-
-						// If knowledge_put operation was successful, add 1 to number of successful read ins
-						if (result == KB_OK)
-						{
-							success_read++;
-						}
-						// If knowledge_put operation indicate a lack of memory, stop writing to memory and return KB_NOMEM
-						else if (result == KB_NOMEM)
-						{
-							return KB_NOMEM;
-						}
-					}
-
-				} while (valid_line);
+					continue;
+				}
+				entries[j].response = restored;
 			}
+			write_entry(f, entries[j].entity, entries[j].entity_len, entries[j].response, entries[j].response_len);
 		}
+
+		// Add a space between each section in the file
+		fputc('\n', f);
 	}
 
-	// Return the number of successful read into memory
-	return success_read;
+	free(entries);
+	free(restored);
+	stats_time(STAT_TIME_WRITE, start);
+	return KB_OK;
+}
+
+// Define the next entity of a knowledge file being compared by knowledge_save()
+typedef struct saved_line
+{
+	char *cursor;		 // Where to read the next line from
+	char *end;			 // End of the file
+	int index;			 // Index of the section of the entity, or -1 if the section is not an intent
+	const char *line;	 // The line of the entity, or NULL at the end of the file
+	size_t line_len;	 // Length of the line, without its newline
+	char *key;			 // Key of the entity
+	size_t key_len;		 // Length of the key
+	size_t key_size;	 // Number of characters allocated for the key
+	char *spare;		 // Buffer the next key is normalized into, before it becomes the key
+	size_t spare_size;	 // Number of characters allocated for the spare buffer
+	int last_index;		 // Index of the section of the entity before, to check the order
+	size_t count;		 // Number of entities read
+	int in_order;		 // Set to 0 once an entity is not after the one before it
+} saved_line;
+
+// Utility function to start reading the entities of a knowledge file held in memory
+static void saved_start(saved_line *saved, char *data, size_t len)
+{
+	memset(saved, 0, sizeof(saved_line));
+	saved->cursor = data;
+	saved->end = data == NULL ? NULL : data + len;
+	saved->index = -1;
+	saved->in_order = 1;
 }
 
 /*
- * Reset the knowledge base, removing all know entitities from all intents.
+ * Read the next entity of a knowledge file, skipping section headers and
+ * lines without an entity, and check that it is in order.
+ *
+ * Returns:
+ *   KB_OK, if an entity was read, or the end of the file was reached
+ *   KB_NOMEM, if there was a memory allocation failure
  */
-void knowledge_reset()
+static int saved_next(saved_line *saved)
 {
-	// Iterate through through the hashtable
-	for (int i = 0; i < MAX_HASHTABLE; i++)
+	saved->line = NULL;
+
+	while (saved->cursor < saved->end)
 	{
-		// If question list at index is not empty, iterate through the linked list
-		if (hashtable[i] != NULL)
+		char *line = saved->cursor;
+		char *eol = memchr(line, '\n', saved->end - line);
+		size_t len = (eol == NULL ? saved->end : eol) - line;
+		saved->cursor = eol == NULL ? saved->end : eol + 1;
+		if (len > 0 && line[len - 1] == '\r')
+		{
+			len--;
+		}
+
+		// Follow the section headers
+		if (len > 1 && line[0] == '[' && line[len - 1] == ']')
 		{
-			// Create a cursor to iterate through the linked list
-			node *cursor = hashtable[i];
+			char name[MAX_INTENT];
+			snprintf(name, sizeof(name), "%.*s", (int)(len - 2), line + 1);
+			saved->index = hash(name);
+			continue;
+		}
 
-			// Iterate through the linked list at index
-			while (cursor != NULL)
+		// Normalize the entity of the line into the spare buffer
+		char *equals = memchr(line, '=', len);
+		if (equals == NULL)
+		{
+			continue;
+		}
+		size_t entity_len = equals - line;
+		if (saved->spare_size < entity_len + 1)
+		{
+			char *bigger = realloc(saved->spare, entity_len + 1);
+			if (bigger == NULL)
 			{
-				// Free the memory of the current node and move the cursor to the next node
-				node *next_node = cursor->next;
-				free(cursor);
-				cursor = next_node;
+				return KB_NOMEM;
 			}
+			saved->spare = bigger;
+			saved->spare_size = entity_len + 1;
 		}
+		size_t key_len = normalize_entity(line, entity_len, saved->spare);
 
-		// Reset index in hashtable to NULL
-		hashtable[i] = NULL;
+		// An entity must come after the one before it, in a later section or with a greater key
+		if (saved->count > 0 && (saved->index < saved->last_index ||
+								 (saved->index == saved->last_index && compare_keys(saved->key, saved->key_len, saved->spare, key_len) >= 0)))
+		{
+			saved->in_order = 0;
+		}
+
+		// The new key becomes the key, and the old one's buffer is spare
+		char *key = saved->key;
+		size_t key_size = saved->key_size;
+		saved->key = saved->spare;
+		saved->key_size = saved->spare_size;
+		saved->key_len = key_len;
+		saved->spare = key;
+		saved->spare_size = key_size;
+
+		saved->last_index = saved->index;
+		saved->line = line;
+		saved->line_len = len;
+		saved->count++;
+		return KB_OK;
+	}
+
+	return KB_OK;
+}
+
+// Utility function to order the entities of two knowledge files as knowledge_write() does, with the end of a file last
+static int compare_saved(const saved_line *a, const saved_line *b)
+{
+	if (a->line == NULL || b->line == NULL)
+	{
+		return (a->line == NULL) - (b->line == NULL);
+	}
+	if (a->index != b->index)
+	{
+		return a->index < b->index ? -1 : 1;
 	}
+	return compare_keys(a->key, a->key_len, b->key, b->key_len);
 }
 
 /*
- * Write the knowledge base to a file.
+ * Write the knowledge of every backend of a sharded knowledge base to a
+ * file, as knowledge_write() writes its own. Each backend writes its part
+ * in order of key, so the parts are merged in a single pass; no entity is
+ * in more than one part, since each key has one backend.
  *
  * Input:
  *   f - the file
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if there was a memory allocation failure, or a backend could not write its part
+ *   KB_UNAVAILABLE, if a backend cannot be reached (nothing is written)
  */
-void knowledge_write(FILE *f)
+static int write_routed(FILE *f)
 {
-	char entity[MAX_ENTITY + 1], response[MAX_RESPONSE + 1]; // Temp storage for entity and response, +1 to compensate for '=' and '\n'
+	int count = route_shards();
+	char **data = calloc(count, sizeof(char *));
+	size_t *lens = calloc(count, sizeof(size_t));
+	saved_line *parts = calloc(count, sizeof(saved_line));
+	int result = data == NULL || lens == NULL || parts == NULL ? KB_NOMEM : KB_OK;
 
-	// Iterate through through the hashtable
-	for (int i = 0; i < MAX_HASHTABLE; i++)
+	// Get every part before writing any of them
+	for (int i = 0; i < count && result == KB_OK; i++)
 	{
-		// If question list at index is not empty, iterate through the linked list
-		if (hashtable[i] != NULL)
-		{
-			// Create a cursor to iterate through the linked list
-			node *cursor = hashtable[i];
+		result = route_dump(i, &data[i], &lens[i]);
+	}
+	for (int i = 0; i < count && result == KB_OK; i++)
+	{
+		saved_start(&parts[i], data[i], lens[i]);
+		result = saved_next(&parts[i]);
+	}
 
-			// If index is 0, write question list of "what" to file
-			if (i == 0)
+	// Write the first entity of the parts each time, with the header of each section before its first
+	int section = -1;
+	while (result == KB_OK)
+	{
+		saved_line *first = NULL;
+		for (int i = 0; i < count; i++)
+		{
+			// Skip any entity outside the sections of the intents
+			while (result == KB_OK && parts[i].line != NULL && parts[i].index < 0)
 			{
-				// Write section header "what" to file
-				fputs("[what]\n", f);
-
-				// Iterate through the linked list at index
-				while (cursor != NULL)
-				{
-					// Copy entity and response from current node
-					strcpy(entity, cursor->entity);
-					strcpy(response, cursor->response);
-
-					// Write entity and response to file
-					strcat(entity, "=");
-					fputs(entity, f);
-					strcat(response, "\n");
-					fputs(response, f);
-
-					// Move the cursor to the next node
-					cursor = cursor->next;
-				}
-
-				// Add a space between each section in the file
-				fputc('\n', f);
+				result = saved_next(&parts[i]);
 			}
-			// If index is 1, write question list of "where" to file
-			else if (i == 1)
+			if (parts[i].line != NULL && (first == NULL || compare_saved(&parts[i], first) < 0))
 			{
-				// Write section header "where" to file
-				fputs("[where]\n", f);
+				first = &parts[i];
+			}
+		}
+		if (first == NULL || result != KB_OK)
+		{
+			break;
+		}
 
-				// Iterate through the linked list at index
-				while (cursor != NULL)
-				{
-					// Copy entity and response from current node
-					strcpy(entity, cursor->entity);
-					strcpy(response, cursor->response);
-
-					// Write entity and response to file
-					strcat(entity, "=");
-					fputs(entity, f);
-					strcat(response, "\n");
-					fputs(response, f);
-					
-					// Move the cursor to the next node
-					cursor = cursor->next;
-				}
+		if (first->index != section)
+		{
+			fprintf(f, section < 0 ? "[%s]\n" : "\n[%s]\n", intent_names[first->index]);
+			section = first->index;
+		}
+		fwrite(first->line, 1, first->line_len, f);
+		fputc('\n', f);
+		if (saved_next(first) != KB_OK)
+		{
+			result = KB_NOMEM;
+		}
+	}
+	if (section >= 0)
+	{
+		fputc('\n', f);
+	}
 
-				// Add a space between each section in the file
-				fputc('\n', f);
-			}
-			// If index is 2, write question list of "who" to file
-			else if (i == 2)
-			{
-				// Write section header "who" to file
-				fputs("[who]\n", f);
+	for (int i = 0; i < count; i++)
+	{
+		free(data == NULL ? NULL : data[i]);
+		free(parts == NULL ? NULL : parts[i].key);
+		free(parts == NULL ? NULL : parts[i].spare);
+	}
+	free(data);
+	free(lens);
+	free(parts);
+	return result;
+}
 
-				// Iterate through the linked list at index
-				while (cursor != NULL)
-				{
-					// Copy entity and response from current node
-					strcpy(entity, cursor->entity);
-					strcpy(response, cursor->response);
-
-					// Write entity and response to file
-					strcat(entity, "=");
-					fputs(entity, f);
-					strcat(response, "\n");
-					fputs(response, f);
-
-					// Move the cursor to the next node
-					cursor = cursor->next;
-				}
+/*
+ * Save the knowledge base to a file as knowledge_write() would, but only
+ * if it differs from what the file holds, and count what changed. The old
+ * file is merged against the new one in a single pass, which works because
+ * both are in order of key; a file that is not, such as one written by
+ * hand, is counted as replaced entirely. The new file replaces the old one
+ * only once it has been written completely.
+ *
+ * Input:
+ *   file_name - the name of the file
+ *   diff      - receives the numbers of entities added, removed and changed
+ *
+ * Returns:
+ *   KB_OK, if the file now holds the knowledge base, whether or not it had to be written
+ *   KB_NOTFOUND, if the file could not be written
+ *   KB_NOMEM, if there was a memory allocation failure (the file is left as it was)
+ *   KB_UNAVAILABLE, if the knowledge base is sharded and a backend cannot be reached (the file is left as it was)
+ */
+int knowledge_save(const char *file_name, kb_save_diff *diff)
+{
+	memset(diff, 0, sizeof(kb_save_diff));
 
-				// Add a space between each section in the file
-				fputc('\n', f);
+	// Write the knowledge base into memory
+	char *data = NULL;
+	size_t len = 0;
+	FILE *f = open_memstream(&data, &len);
+	if (f == NULL)
+	{
+		return KB_NOMEM;
+	}
+	int result = knowledge_write(f);
+	fclose(f);
+
+	// Read the old file, which is empty if it does not exist yet
+	char *old = NULL;
+	size_t old_len = 0;
+	f = gzip_open(file_name, "rb", gzip_named(file_name));
+	if (f != NULL)
+	{
+		old = read_stream(f, &old_len);
+		fclose(f);
+		if (old == NULL)
+		{
+			result = KB_NOMEM;
+		}
+	}
+
+	// Merge the entities of both files in order of key, counting those only in one and those whose line differs
+	saved_line before, after;
+	saved_start(&before, old, old_len);
+	saved_start(&after, data, len);
+	if (result == KB_OK && (saved_next(&before) != KB_OK || saved_next(&after) != KB_OK))
+	{
+		result = KB_NOMEM;
+	}
+	while (result == KB_OK && (before.line != NULL || after.line != NULL))
+	{
+		int order = compare_saved(&before, &after);
+		if (order < 0)
+		{
+			diff->removed++;
+		}
+		else if (order > 0)
+		{
+			diff->added++;
+		}
+		else if (before.line_len != after.line_len || memcmp(before.line, after.line, after.line_len) != 0)
+		{
+			diff->changed++;
+		}
+
+		// Move on in each file whose entity was counted
+		if ((order <= 0 && saved_next(&before) != KB_OK) || (order >= 0 && saved_next(&after) != KB_OK))
+		{
+			result = KB_NOMEM;
+		}
+	}
+
+	// The counts of a file out of order mean nothing, so count it as replaced
+	if (!before.in_order)
+	{
+		diff->added = after.count;
+		diff->removed = before.count;
+		diff->changed = 0;
+	}
+	free(before.key);
+	free(before.spare);
+	free(after.key);
+	free(after.spare);
+
+	// Write the new file beside the old one and put it in its place, unless nothing has changed
+	if (result == KB_OK && (old == NULL || old_len != len || memcmp(old, data, len) != 0))
+	{
+		char *temporary;
+		f = gzip_create_beside(file_name, &temporary);
+		if (f == NULL)
+		{
+			result = KB_NOTFOUND;
+		}
+		else
+		{
+			int written = fwrite(data, 1, len, f) == len;
+			if (fclose(f) != 0 || !written || rename(temporary, file_name) != 0)
+			{
+				remove(temporary);
+				result = KB_NOTFOUND;
 			}
 		}
+		free(temporary);
 	}
+
+	free(data);
+	free(old);
+	return result;
 }
 
 // Function to hash the intent into index in the hashtable
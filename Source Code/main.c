@@ -16,23 +16,62 @@
 /* word delimiters */
 const char *delimiters = " ?\t\n";
 
+/* where prompt_user() takes answers from instead of the user, e.g. when replaying a log; NULL for stdin */
+char *(*answer_source)() = NULL;
+
 /*
  * Main loop.
  */
 int main(int argc, char *argv[])
 {
 
-	char input[MAX_INPUT];	   /* buffer for holding the user input */
-	int inc;				   /* the number of words in the user input */
-	char *inv[MAX_INPUT];	   /* pointers to the beginning of each word of input */
-	char output[MAX_RESPONSE]; /* the chatbot's output */
-	int len;				   /* length of a word */
-	int done = 0;			   /* set to 1 to end the main loop */
+	char *input = NULL;		  /* buffer for holding the user input */
+	size_t input_size = 0;	  /* size of the input buffer */
+	int inc = 0;			  /* the number of words in the user input */
+	char **inv = NULL;		  /* pointers to the beginning of each word of input */
+	size_t inv_size = 0;	  /* number of pointers allocated for inv */
+	char *output;			  /* the chatbot's output */
+	size_t output_size;		  /* size of the output buffer */
+	char *reset[] = {"reset", NULL};
+	long len;				  /* length of a word, or of the line of input */
+	int done = 0;			  /* set to 1 to end the main loop */
+
+	/* run the benchmarks instead of chatting, if asked to */
+	if (argc > 1 && strcmp(argv[1], "--benchmark") == 0)
+		return benchmark_main(argc - 2, argv + 2);
+
+	/* generate embedded knowledge instead of chatting, if asked to */
+	if (argc > 1 && strcmp(argv[1], "--embed") == 0)
+		return embed_main(argc - 2, argv + 2);
+
+	/* replay a log of requests instead of chatting, if asked to */
+	if (argc > 1 && strcmp(argv[1], "--replay") == 0)
+		return replay_main(argc - 2, argv + 2);
+
+	/* serve part of a sharded knowledge base instead of chatting, if asked to */
+	if (argc > 1 && strcmp(argv[1], "--serve") == 0)
+		return serve_main(argc - 2, argv + 2);
+
+	/* record every request in a log while chatting, if asked to */
+	if (argc > 2 && strcmp(argv[1], "--capture") == 0 && capture_start(argv[2]) != KB_OK)
+	{
+		fprintf(stderr, "cannot create %s\n", argv[2]);
+		return 1;
+	}
+
+	/* keep the knowledge in the backends of a sharded knowledge base, if asked to, from the first reset on */
+	if (argc > 2 && strcmp(argv[1], "--route") == 0 && route_start(argc - 2, argv + 2) != KB_OK)
+	{
+		fprintf(stderr, "cannot reach the backends\n");
+		return 1;
+	}
 
 	/* initialise the chatbot */
-	inv[0] = "reset";
-	inv[1] = NULL;
-	chatbot_do_reset(1, inv, output, MAX_RESPONSE);
+	output_size = MAX_RESPONSE;
+	output = malloc(output_size);
+	if (output == NULL)
+		return 1;
+	chatbot_do_reset(1, reset, output, (int)output_size);
 
 	/* print a welcome message */
 	printf("%s: Hello, I'm %s.\n", chatbot_botname(), chatbot_botname());
@@ -43,39 +82,162 @@ int main(int argc, char *argv[])
 
 		do
 		{
-			/* read the line */
+			/* read the line, stopping at the end of input */
 			printf("%s: ", chatbot_username());
-			fgets(input, MAX_INPUT, stdin);
+			len = read_line(&input, &input_size, stdin);
+			if (len < 0)
+				break;
 
-			/* split it into words */
-			inc = 0;
-			inv[inc] = strtok(input, delimiters);
-			while (inv[inc] != NULL)
-			{
+			/* start timing the request, if tracing is on, and keep it before it is split if capturing */
+			if (trace_enabled)
+				trace_begin(input);
+			if (capture_enabled)
+				capture_begin(input);
 
-				/* remove trailing punctuation */
-				len = strlen(inv[inc]);
-				while (len > 0 && ispunct(inv[inc][len - 1]))
+			/* make sure there is a pointer for every word, which is at most one for every two characters */
+			if (inv_size < (size_t)len / 2 + 2)
+			{
+				char **bigger = realloc(inv, (len / 2 + 2) * sizeof(char *));
+				if (bigger == NULL)
 				{
-					inv[inc][len - 1] = '\0';
-					len--;
+					/* skip the line, leaving no words that point into the old one */
+					printf("%s: There is insufficient memory space to read that.\n", chatbot_botname());
+					inc = 0;
+					continue;
 				}
-
-				/* go to the next word */
-				inc++;
-				inv[inc] = strtok(NULL, delimiters);
+				inv = bigger;
+				inv_size = len / 2 + 2;
 			}
+
+			/* split it into words */
+			inc = tokenize_input(input, inv);
+			TRACE_MARK(TRACE_TOKENIZE);
 		} while (inc < 1);
 
+		/* stop at the end of input, as if the user had typed exit */
+		if (len < 0 || inc < 1)
+			break;
+
+		/* apply the changes of the leader, if following one, and switch to the latest shared knowledge, if attached to any */
+		replicate_begin();
+		knowledge_refresh();
+
+		/* put the knowledge loaded in the background into memory, and say what was loaded and saved */
+		while (async_begin(output, (int)output_size))
+			printf("%s: %s\n", chatbot_botname(), output);
+
+		/* make sure the output buffer can hold the longest response the chatbot knows */
+		if (knowledge_max_response() + 1 > output_size)
+		{
+			char *bigger = realloc(output, knowledge_max_response() + 1);
+			if (bigger != NULL)
+			{
+				output = bigger;
+				output_size = knowledge_max_response() + 1;
+			}
+		}
+
 		/* invoke the chatbot */
-		done = chatbot_main(inc, inv, output, MAX_RESPONSE);
+		done = chatbot_main(inc, inv, output, (int)output_size);
+		replicate_end();
+		TRACE_MARK(TRACE_HANDLER);
+		if (capture_enabled)
+			capture_end(chatbot_outcome());
 		printf("%s: %s\n", chatbot_botname(), output);
+		TRACE_MARK(TRACE_OUTPUT);
+		if (trace_enabled)
+			trace_end();
 
 	} while (!done);
 
+	/* finish loading and saving in the background before exiting */
+	async_stop();
+	replicate_begin();
+	while (async_begin(output, (int)output_size))
+		printf("%s: %s\n", chatbot_botname(), output);
+	replicate_end();
+
+	capture_stop();
+	replicate_stop();
+	route_stop();
+	free(input);
+	free(inv);
+	free(output);
 	return 0;
 }
 
+/*
+ * Split a line of input into words, removing trailing punctuation from each.
+ *
+ * Input:
+ *   input - the line, which is split in place
+ *   inv   - receives a pointer to each word, followed by NULL; must have room for strlen(input) / 2 + 2 pointers
+ *
+ * Returns: the number of words
+ */
+int tokenize_input(char *input, char *inv[])
+{
+	int inc = 0;
+	int len;
+
+	inv[inc] = strtok(input, delimiters);
+	while (inv[inc] != NULL)
+	{
+
+		/* remove trailing punctuation */
+		len = strlen(inv[inc]);
+		while (len > 0 && ispunct(inv[inc][len - 1]))
+		{
+			inv[inc][len - 1] = '\0';
+			len--;
+		}
+
+		/* go to the next word */
+		inc++;
+		inv[inc] = strtok(NULL, delimiters);
+	}
+
+	return inc;
+}
+
+/*
+ * Read a line of any length, growing the buffer as needed.
+ *
+ * Input:
+ *   buf  - the buffer, which may be NULL, and is reallocated if the line does not fit
+ *   size - the size of the buffer
+ *   f    - the file to read from
+ *
+ * Returns: the length of the line, including its newline, or -1 at the end of input
+ */
+long read_line(char **buf, size_t *size, FILE *f)
+{
+	size_t len = 0;
+
+	while (1)
+	{
+		/* grow the buffer when it is full, starting from MAX_INPUT */
+		if (*size - len < 2)
+		{
+			size_t bigger_size = *size < MAX_INPUT ? MAX_INPUT : *size * 2;
+			char *bigger = realloc(*buf, bigger_size);
+			if (bigger == NULL)
+				return len > 0 ? (long)len : -1;
+			*buf = bigger;
+			*size = bigger_size;
+		}
+
+		/* read as much of the line as fits */
+		if (fgets(*buf + len, (int)(*size - len), f) == NULL)
+			return len > 0 ? (long)len : -1;
+		len += strlen(*buf + len);
+
+		/* stop once the whole line has been read */
+		if ((*buf)[len - 1] == '\n')
+			return (long)len;
+	}
+}
+
 /*
  * Utility function for comparing string case-insensitively.
  *
@@ -111,13 +273,23 @@ int compare_token(const char *token1, const char *token2)
  * Prompt the user.
  *
  * Input:
- *   buf    - a buffer into which to store the answer
- *   n      - the maximum number of characters to write to the buffer
  *   format - format string, as printf
  *   ...    - as printf
+ *
+ * Returns: the answer, of any length, which is valid until the next call, or NULL at the end of input
  */
-void prompt_user(char *buf, int n, const char *format, ...)
+char *prompt_user(const char *format, ...)
 {
+	static char *buf = NULL; /* buffer holding the answer */
+	static size_t size = 0;	 /* size of the buffer */
+
+	/* take the answer from elsewhere, if the user is not there */
+	if (answer_source != NULL)
+		return answer_source();
+
+	/* the time waiting for the user is not part of the request */
+	TRACE_MARK(TRACE_HANDLER);
+	unsigned long long asked = stats_clock();
 
 	/* print the prompt */
 	va_list args;
@@ -129,8 +301,17 @@ void prompt_user(char *buf, int n, const char *format, ...)
 	printf("\n%s: ", chatbot_username());
 
 	/* get the response from the user */
-	fgets(buf, n, stdin);
+	long len = read_line(&buf, &size, stdin);
+	if (trace_enabled)
+		trace_skip();
+	if (capture_enabled)
+		capture_skip(asked);
+	if (len < 0)
+		return NULL;
 	char *nl = strchr(buf, '\n');
 	if (nl != NULL)
 		*nl = '\0';
-}
\ No newline at end of file
+	if (capture_enabled)
+		capture_answer(buf);
+	return buf;
+}
@@ -0,0 +1,327 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the normalization of entities. Every entity, when
+ * it is put and when it is asked about, is turned into a canonical key,
+ * and entities are matched by their keys, so that trivial variants such as
+ * "the SIT", "SIT's" and "sit  ." all find the same response instead of
+ * being learned again. The entity itself is kept as it was first given,
+ * for saving.
+ *
+ * The steps of the normalization can be chosen (see NORM_SPACE etc. in
+ * chat1002.h). Letters are always folded to lower case, as entities have
+ * always been matched ignoring case. The key is never longer than the
+ * entity.
+ *
+ * Questions tend to repeat, so the keys of recent short entities are kept
+ * in a small cache and reused instead of normalizing them again.
+ *
+ * normalize_entity() turns an entity into its key.
+ * normalize_cached() does the same through the cache.
+ * normalize_set() and normalize_get() choose the steps.
+ */
+
+#include <string.h>
+#include <stdlib.h>
+#include "chat1002.h"
+
+// Define the longest entity kept in the cache
+#define CACHE_ENTITY 64
+
+// Define an entity and its key kept in the cache
+typedef struct cached_key
+{
+	unsigned int generation; // The steps the key was made with, or 0 if this part of the cache is empty
+	unsigned int entity_len; // Length of the entity
+	unsigned int key_len;	 // Length of the key
+	char entity[CACHE_ENTITY];
+	char key[CACHE_ENTITY + 1];
+} cached_key;
+
+// The steps of the normalization
+static int steps = NORM_DEFAULT;
+
+// Number of times the steps have been changed, so that keys made with older steps are not used; never 0
+static unsigned int generation = 1;
+
+// The keys of recent entities, each in the place given by the hash of its entity
+static cached_key cache[KB_NORMALIZE_CACHE];
+
+// Buffer for the keys of entities too long for the cache
+static char *long_key;
+static size_t long_key_size;
+
+/*
+ * Choose the steps of the normalization.
+ *
+ * Input:
+ *   flags - any of NORM_SPACE, NORM_PUNCT, NORM_ARTICLES, NORM_POSSESSIVES, NORM_PLURALS and NORM_UNICODE
+ */
+void normalize_set(int flags)
+{
+	if (flags != steps)
+	{
+		steps = flags;
+		generation++;
+	}
+}
+
+/*
+ * Get the steps of the normalization.
+ *
+ * Returns: the flags, as given to normalize_set()
+ */
+int normalize_get()
+{
+	return steps;
+}
+
+// Utility function to fold the case of a letter from the two-byte range of UTF-8, keeping it two bytes long
+static unsigned int fold_code_point(unsigned int c)
+{
+	// Latin-1 letters, except the multiplication sign
+	if (c >= 0xC0 && c <= 0xDE && c != 0xD7)
+		return c + 0x20;
+	// Latin Extended-A, which mostly pairs an upper-case letter with the lower-case one after it; the dotted
+	// capital I folds to a one-byte "i", so it and the dotless small i are left as they are
+	if ((c >= 0x100 && c <= 0x12F) || (c >= 0x132 && c <= 0x137) || (c >= 0x14A && c <= 0x177))
+		return c | 1;
+	// The capital Y with diaeresis, whose small letter is in Latin-1
+	if (c == 0x178)
+		return 0xFF;
+	if (((c >= 0x139 && c <= 0x148) || (c >= 0x179 && c <= 0x17E)) && (c & 1))
+		return c + 1;
+	// Greek, except the final sigma's empty place
+	if (c >= 0x391 && c <= 0x3AB && c != 0x3A2)
+		return c + 0x20;
+	// Cyrillic
+	if (c >= 0x400 && c <= 0x40F)
+		return c + 0x50;
+	if (c >= 0x410 && c <= 0x42F)
+		return c + 0x20;
+	return c;
+}
+
+// Utility function to check for the punctuation that is stripped from the ends of words; "C++" and "C#" keep theirs
+static int is_stripped(char c)
+{
+	return c != '\0' && strchr(".,;:!?\"'()[]", c) != NULL;
+}
+
+// Utility function to check whether a word ends with a suffix
+static int ends_with(const char *word, size_t len, const char *suffix)
+{
+	size_t suffix_len = strlen(suffix);
+	return len >= suffix_len && memcmp(word + len - suffix_len, suffix, suffix_len) == 0;
+}
+
+/*
+ * Normalize a word that has been copied into the key, folding its case
+ * and trimming it in place.
+ *
+ * Input:
+ *   word  - the word
+ *   len   - the length of the word
+ *   flags - the steps
+ *
+ * Returns: the new length of the word
+ */
+static size_t normalize_word(char *word, size_t len, int flags)
+{
+	// Fold the case of ASCII letters always, and of other letters if asked to
+	for (size_t i = 0; i < len; i++)
+	{
+		unsigned char c = (unsigned char)word[i];
+		if (c >= 'A' && c <= 'Z')
+		{
+			word[i] = (char)(c + 'a' - 'A');
+		}
+		else if ((flags & NORM_UNICODE) && (c & 0xE0) == 0xC0 && i + 1 < len && ((unsigned char)word[i + 1] & 0xC0) == 0x80)
+		{
+			unsigned int folded = fold_code_point((c & 0x1F) << 6 | ((unsigned char)word[i + 1] & 0x3F));
+			word[i] = (char)(0xC0 | folded >> 6);
+			word[i + 1] = (char)(0x80 | (folded & 0x3F));
+			i++;
+		}
+	}
+
+	// Strip punctuation from both ends
+	if (flags & NORM_PUNCT)
+	{
+		size_t start = 0;
+		while (start < len && is_stripped(word[start]))
+		{
+			start++;
+		}
+		while (len > start && is_stripped(word[len - 1]))
+		{
+			len--;
+		}
+		memmove(word, word + start, len - start);
+		len -= start;
+	}
+
+	// Fold "sit's" to "sit", also with a typographic apostrophe; "students'" has lost its apostrophe above
+	if (flags & NORM_POSSESSIVES)
+	{
+		if (len > 2 && ends_with(word, len, "'s"))
+		{
+			len -= 2;
+		}
+		else if (len > 4 && ends_with(word, len, "\xE2\x80\x99s"))
+		{
+			len -= 4;
+		}
+		else if (len > 2 && ends_with(word, len, "s'"))
+		{
+			len -= 1;
+		}
+	}
+
+	// Fold plurals to singular: "universities" to "university", "classes" to "class", "modules" to "module"
+	if ((flags & NORM_PLURALS) && len > 3)
+	{
+		if (ends_with(word, len, "ies"))
+		{
+			word[len - 3] = 'y';
+			len -= 2;
+		}
+		else if (ends_with(word, len, "sses") || ends_with(word, len, "shes") || ends_with(word, len, "ches") ||
+				 ends_with(word, len, "xes") || ends_with(word, len, "zes"))
+		{
+			len -= 2;
+		}
+		else if (ends_with(word, len, "s") && !ends_with(word, len, "ss") && !ends_with(word, len, "us") &&
+				 !ends_with(word, len, "is"))
+		{
+			len -= 1;
+		}
+	}
+
+	return len;
+}
+
+// Utility function to check for the articles dropped from entities
+static int is_article(const char *word, size_t len)
+{
+	return (len == 1 && word[0] == 'a') || (len == 2 && memcmp(word, "an", 2) == 0) || (len == 3 && memcmp(word, "the", 3) == 0);
+}
+
+// Utility function to normalize an entity with the given steps, into a key with room for len + 1 characters
+static size_t normalize_with(const char *entity, size_t len, char *key, int flags)
+{
+	size_t out = 0, i = 0;
+	int words = 0;
+
+	while (i <= len)
+	{
+		// Find the next word; without NORM_SPACE, words are only split at single spaces, and may be empty
+		size_t start = i;
+		if (flags & NORM_SPACE)
+		{
+			while (start < len && (entity[start] == ' ' || entity[start] == '\t' || entity[start] == '\r' || entity[start] == '\n'))
+			{
+				start++;
+			}
+			if (start == len)
+			{
+				break;
+			}
+		}
+		size_t end = start;
+		while (end < len && entity[end] != ' ' && (!(flags & NORM_SPACE) || (entity[end] != '\t' && entity[end] != '\r' && entity[end] != '\n')))
+		{
+			end++;
+		}
+		i = end + 1;
+
+		// Copy the word after a space, normalize it, and take it back out if it is an article or has gone
+		size_t word_start = out + (words > 0);
+		if (words > 0)
+		{
+			key[out] = ' ';
+		}
+		memcpy(key + word_start, entity + start, end - start);
+		size_t word_len = normalize_word(key + word_start, end - start, flags);
+		if ((flags & NORM_ARTICLES) && is_article(key + word_start, word_len))
+		{
+			continue;
+		}
+		if (word_len == 0 && (flags & (NORM_SPACE | NORM_PUNCT)) && end > start)
+		{
+			continue;
+		}
+		out = word_start + word_len;
+		words++;
+	}
+
+	key[out] = '\0';
+	return out;
+}
+
+/*
+ * Turn an entity into its key.
+ *
+ * Input:
+ *   entity - the entity
+ *   len    - the length of the entity
+ *   key    - receives the key, null-terminated; must have room for len + 1 characters
+ *
+ * Returns: the length of the key
+ */
+size_t normalize_entity(const char *entity, size_t len, char *key)
+{
+	size_t key_len = normalize_with(entity, len, key, steps);
+
+	// An entity that is nothing but articles, such as "The A", keeps them
+	if (key_len == 0 && (steps & NORM_ARTICLES))
+	{
+		key_len = normalize_with(entity, len, key, steps & ~NORM_ARTICLES);
+	}
+
+	return key_len;
+}
+
+/*
+ * Turn an entity into its key, reusing the key made last time the same
+ * entity was seen if it is still in the cache.
+ *
+ * Input:
+ *   entity  - the entity
+ *   len     - the length of the entity
+ *   key_len - receives the length of the key
+ *
+ * Returns: the key, null-terminated, valid until the next call; or NULL if there was a memory allocation failure
+ */
+const char *normalize_cached(const char *entity, size_t len, size_t *key_len)
+{
+	// Keys of long entities are made every time, into a buffer of their own
+	if (len >= CACHE_ENTITY)
+	{
+		if (long_key_size < len + 1)
+		{
+			char *bigger = realloc(long_key, len + 1);
+			if (bigger == NULL)
+			{
+				return NULL;
+			}
+			long_key = bigger;
+			long_key_size = len + 1;
+		}
+		*key_len = normalize_entity(entity, len, long_key);
+		return long_key;
+	}
+
+	// Use the key in the cache if it was made from the same entity with the same steps
+	cached_key *cached = &cache[intern_hash(entity, len) % KB_NORMALIZE_CACHE];
+	if (cached->generation != generation || cached->entity_len != len || memcmp(cached->entity, entity, len) != 0)
+	{
+		memcpy(cached->entity, entity, len);
+		cached->entity_len = (unsigned int)len;
+		cached->key_len = (unsigned int)normalize_entity(entity, len, cached->key);
+		cached->generation = generation;
+	}
+
+	*key_len = cached->key_len;
+	return cached->key;
+}
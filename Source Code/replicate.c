@@ -0,0 +1,846 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the replication of the knowledge base from one
+ * chatbot process, the leader, to others on the same host, its followers,
+ * over a Unix domain socket. Responses learned by the leader are then
+ * known to every follower before its next command, without saving and
+ * loading.
+ *
+ * The leader logs every change to its knowledge base (each response put,
+ * learned or loaded, each reset and each change of normalization) as it is
+ * made, and queues the log of each command for every follower once the
+ * command is done. A process that starts following is first sent a
+ * snapshot of the whole knowledge base, then the log from there on. A
+ * thread of the leader accepts followers and sends each what is queued for
+ * it as fast as it reads, without ever waiting on one, so a follower that
+ * stops reading cannot hold the leader up; one that falls KB_REPL_QUEUE
+ * bytes behind is dropped instead. A thread of each follower receives the
+ * log as it comes; the follower applies what it received, in order, before
+ * each command. A follower may itself lead other followers.
+ *
+ * The log is a sequence of records:
+ *   1 byte   the type (REPL_SNAPSHOT, REPL_PUT, REPL_LEARN, REPL_RESET or REPL_NORMALIZE)
+ *   varint   length of the rest of the record
+ *   bytes    for REPL_SNAPSHOT, a varint of the normalization flags and the knowledge base as written by knowledge_write();
+ *            for REPL_PUT and REPL_LEARN, a byte of the intent index, a varint of the length of the entity, the entity
+ *            and the response; for REPL_NORMALIZE, a varint of the flags
+ * A varint is 7 bits per byte, lowest first, with the top bit set on every
+ * byte but the last.
+ *
+ * replicate_lead() and replicate_follow() start replicating.
+ * replicate_begin() and replicate_end() surround each command.
+ * replicate_put(), replicate_reset() and replicate_normalize() log changes.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "chat1002.h"
+
+// Define the types of records
+#define REPL_SNAPSHOT  1
+#define REPL_PUT       2
+#define REPL_LEARN     3
+#define REPL_RESET     4
+#define REPL_NORMALIZE 5
+
+// Define a buffer of records
+typedef struct repl_buffer
+{
+	char *data;		 // The records
+	size_t len;		 // Number of bytes used
+	size_t capacity; // Number of bytes allocated
+	int failed;		 // Set to 1 if a record could not be added for lack of memory
+} repl_buffer;
+
+// Define a follower of the leader
+typedef struct repl_follower
+{
+	int socket;			// Socket of the follower
+	repl_buffer queue;	// Log queued for the follower, sent up to sent
+	size_t sent;		// Number of bytes of the queue sent
+	size_t limit;		// Most bytes the queue may hold before the follower is dropped
+} repl_follower;
+
+// Set to 1 while leading
+int replicate_leading;
+
+// Socket the leader listens on, its path, the thread accepting and sending to followers, and a pipe that wakes it
+static int listener = -1;
+static char listen_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static pthread_t sender;
+static int wake[2] = {-1, -1};
+static int stopping;
+
+// The main thread holds leader_lock for the whole of each command, so snapshots are taken between commands
+static pthread_mutex_t leader_lock = PTHREAD_MUTEX_INITIALIZER;
+static int leader_locked;
+
+// The followers, and the sockets accepted that wait for a snapshot, guarded by queue_lock, which is taken after
+// leader_lock when both are held
+static repl_follower followers[KB_MAX_FOLLOWERS];
+static int follower_count;
+static int newcomers[KB_MAX_FOLLOWERS];
+static int newcomer_count;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Log of the command being handled, sent to the followers when it is done
+static repl_buffer pending;
+
+// Socket of the leader while following, and the thread receiving its log into the received buffer
+static int leader = -1;
+static pthread_t receiver;
+static pthread_mutex_t follower_lock = PTHREAD_MUTEX_INITIALIZER;
+static repl_buffer received;
+static int leader_gone;
+
+// Counters for replicate_report()
+static unsigned long long records_sent;
+static unsigned long long records_applied;
+static unsigned long long bytes_sent;
+
+// Utility function to add bytes to a buffer
+static void buffer_add(repl_buffer *buffer, const void *data, size_t len)
+{
+	if (buffer->failed)
+	{
+		return;
+	}
+	if (buffer->len + len > buffer->capacity)
+	{
+		size_t capacity = buffer->capacity < 4096 ? 4096 : buffer->capacity;
+		while (capacity < buffer->len + len)
+		{
+			capacity *= 2;
+		}
+		char *bigger = realloc(buffer->data, capacity);
+		if (bigger == NULL)
+		{
+			buffer->failed = 1;
+			return;
+		}
+		buffer->data = bigger;
+		buffer->capacity = capacity;
+	}
+	memcpy(buffer->data + buffer->len, data, len);
+	buffer->len += len;
+}
+
+// Utility function to add a varint to a buffer
+static void buffer_varint(repl_buffer *buffer, unsigned long long value)
+{
+	unsigned char bytes[10];
+	size_t len = 0;
+
+	while (value >= 0x80)
+	{
+		bytes[len++] = (unsigned char)((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	bytes[len++] = (unsigned char)value;
+	buffer_add(buffer, bytes, len);
+}
+
+// Utility function to read a varint from memory; returns the number of bytes read, or 0 if it is incomplete
+static size_t read_varint(const char *data, size_t len, unsigned long long *value)
+{
+	*value = 0;
+	for (size_t i = 0; i < len && i < 10; i++)
+	{
+		*value |= (unsigned long long)((unsigned char)data[i] & 0x7F) << (7 * i);
+		if (!((unsigned char)data[i] & 0x80))
+		{
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+// Utility function to send what is queued for a follower, as far as it takes it without waiting; returns 0 if it has gone
+static int flush_follower(repl_follower *follower)
+{
+	while (follower->sent < follower->queue.len)
+	{
+		ssize_t sent = send(follower->socket, follower->queue.data + follower->sent, follower->queue.len - follower->sent,
+							MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (sent < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return 1;
+		}
+		if (sent <= 0)
+		{
+			return 0;
+		}
+		follower->sent += sent;
+		bytes_sent += sent;
+	}
+
+	follower->queue.len = 0;
+	follower->sent = 0;
+	return 1;
+}
+
+// Utility function to queue log for a follower; returns 0 if it has fallen too far behind, or memory ran out
+static int queue_follower(repl_follower *follower, const char *data, size_t len)
+{
+	if (follower->queue.len - follower->sent + len > follower->limit)
+	{
+		return 0;
+	}
+
+	// Move what is left to the front, so the queue only grows with what is unsent
+	memmove(follower->queue.data, follower->queue.data + follower->sent, follower->queue.len - follower->sent);
+	follower->queue.len -= follower->sent;
+	follower->sent = 0;
+	buffer_add(&follower->queue, data, len);
+	return !follower->queue.failed;
+}
+
+// Utility function to wake the thread serving the followers; if the pipe is full, the thread is awake already
+static void wake_sender()
+{
+	ssize_t written = write(wake[1], "", 1);
+	(void)written;
+}
+
+// Utility function to stop sending to a follower
+static void drop_follower(int i)
+{
+	close(followers[i].socket);
+	free(followers[i].queue.data);
+	followers[i] = followers[--follower_count];
+}
+
+/*
+ * Make a snapshot of the knowledge base, as the record a new follower
+ * starts from.
+ *
+ * Input:
+ *   snapshot - receives the record
+ */
+static void make_snapshot(repl_buffer *snapshot)
+{
+	char *text = NULL;
+	size_t text_len = 0;
+	FILE *f = open_memstream(&text, &text_len);
+	if (f == NULL || knowledge_write(f) != KB_OK)
+	{
+		snapshot->failed = 1;
+	}
+	if (f != NULL)
+	{
+		fclose(f);
+	}
+
+	repl_buffer flags = {NULL, 0, 0, 0};
+	buffer_varint(&flags, (unsigned long long)normalize_get());
+
+	unsigned char type = REPL_SNAPSHOT;
+	buffer_add(snapshot, &type, 1);
+	buffer_varint(snapshot, flags.len + text_len);
+	buffer_add(snapshot, flags.data, flags.len);
+	buffer_add(snapshot, text, text_len);
+	free(flags.data);
+	free(text);
+}
+
+/*
+ * Make the sockets accepted since the last call followers, queueing one
+ * snapshot for all of them to start from. The caller must hold leader_lock,
+ * so that the snapshot is taken between commands, and the log of no command
+ * is in it already.
+ */
+static void admit_newcomers()
+{
+	int sockets[KB_MAX_FOLLOWERS];
+	int count;
+
+	pthread_mutex_lock(&queue_lock);
+	count = newcomer_count;
+	memcpy(sockets, newcomers, count * sizeof(int));
+	newcomer_count = 0;
+	pthread_mutex_unlock(&queue_lock);
+	if (count == 0)
+	{
+		return;
+	}
+
+	repl_buffer snapshot = {NULL, 0, 0, 0};
+	make_snapshot(&snapshot);
+
+	pthread_mutex_lock(&queue_lock);
+	for (int i = 0; i < count; i++)
+	{
+		repl_follower *follower = &followers[follower_count];
+		repl_buffer copy = {NULL, 0, 0, 0};
+		if (!snapshot.failed && follower_count < KB_MAX_FOLLOWERS)
+		{
+			buffer_add(&copy, snapshot.data, snapshot.len);
+		}
+		if (copy.data == NULL || copy.failed)
+		{
+			free(copy.data);
+			close(sockets[i]);
+			continue;
+		}
+		follower->socket = sockets[i];
+		follower->queue = copy;
+		follower->sent = 0;
+		follower->limit = snapshot.len + KB_REPL_QUEUE;
+		follower_count++;
+		records_sent++;
+	}
+	pthread_mutex_unlock(&queue_lock);
+	free(snapshot.data);
+
+	// Wake the thread serving the followers, to send the snapshots
+	wake_sender();
+}
+
+// Thread function of the leader that accepts followers, and sends each what is queued for it as it is ready for it
+static void *serve_followers(void *arg)
+{
+	(void)arg;
+	struct pollfd fds[KB_MAX_FOLLOWERS + 2];
+	char drain[64];
+
+	while (1)
+	{
+		// Wait for a follower to connect, for one that is behind to be ready for more, or to be woken; while
+		// new followers wait for a snapshot, try every few milliseconds to take one between commands
+		pthread_mutex_lock(&queue_lock);
+		if (stopping)
+		{
+			pthread_mutex_unlock(&queue_lock);
+			break;
+		}
+		int timeout = newcomer_count > 0 ? 10 : -1;
+		nfds_t count = 0;
+		fds[count++] = (struct pollfd){listener, POLLIN, 0};
+		fds[count++] = (struct pollfd){wake[0], POLLIN, 0};
+		for (int i = 0; i < follower_count; i++)
+		{
+			if (followers[i].queue.len > 0)
+			{
+				fds[count++] = (struct pollfd){followers[i].socket, POLLOUT, 0};
+			}
+		}
+		pthread_mutex_unlock(&queue_lock);
+
+		if (poll(fds, count, timeout) < 0 && errno != EINTR)
+		{
+			break;
+		}
+		if (fds[1].revents & POLLIN)
+		{
+			while (read(wake[0], drain, sizeof(drain)) > 0)
+			{
+			}
+		}
+		if (fds[0].revents & POLLIN)
+		{
+			int socket = accept(listener, NULL, NULL);
+			pthread_mutex_lock(&queue_lock);
+			if (socket >= 0 && newcomer_count < KB_MAX_FOLLOWERS)
+			{
+				newcomers[newcomer_count++] = socket;
+				socket = -1;
+			}
+			pthread_mutex_unlock(&queue_lock);
+			if (socket >= 0)
+			{
+				close(socket);
+			}
+		}
+
+		// Never wait for a command to finish, which the main thread also takes new followers after
+		if (pthread_mutex_trylock(&leader_lock) == 0)
+		{
+			admit_newcomers();
+			pthread_mutex_unlock(&leader_lock);
+		}
+
+		// Send to every follower as much as it takes
+		pthread_mutex_lock(&queue_lock);
+		for (int i = follower_count - 1; i >= 0; i--)
+		{
+			if (!flush_follower(&followers[i]))
+			{
+				drop_follower(i);
+			}
+		}
+		pthread_mutex_unlock(&queue_lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start leading: listen for followers on a Unix domain socket.
+ *
+ * Input:
+ *   path - the path of the socket, which is replaced if it exists
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_INVALID, if already leading, or the path is too long
+ *   KB_NOTFOUND, if the socket could not be created
+ */
+int replicate_lead(const char *path)
+{
+	struct sockaddr_un address;
+
+	if (replicate_leading || strlen(path) >= sizeof(address.sun_path))
+	{
+		return KB_INVALID;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	unlink(path);
+
+	// The listener and the pipe that wakes the thread never block it
+	listener = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 16) != 0 ||
+		pipe(wake) != 0 || fcntl(wake[0], F_SETFL, O_NONBLOCK) != 0 || fcntl(wake[1], F_SETFL, O_NONBLOCK) != 0 ||
+		pthread_create(&sender, NULL, serve_followers, NULL) != 0)
+	{
+		if (listener >= 0)
+		{
+			close(listener);
+		}
+		for (int i = 0; i < 2; i++)
+		{
+			if (wake[i] >= 0)
+			{
+				close(wake[i]);
+			}
+			wake[i] = -1;
+		}
+		listener = -1;
+		return KB_NOTFOUND;
+	}
+
+	strcpy(listen_path, path);
+	replicate_leading = 1;
+	return KB_OK;
+}
+
+/*
+ * Log that a response has been put, to be sent to the followers when the
+ * command is done.
+ *
+ * Input:
+ *   index        - the index of the intent in the hashtable
+ *   entity       - the entity
+ *   entity_len   - the length of the entity
+ *   response     - the response
+ *   response_len - the length of the response
+ *   learned      - 1 if the response was learned from the user, 0 if it is pinned
+ */
+void replicate_put(int index, const char *entity, size_t entity_len, const char *response, size_t response_len, int learned)
+{
+	unsigned char type = learned ? REPL_LEARN : REPL_PUT, intent = (unsigned char)index;
+	size_t prefix = 1;
+	for (unsigned long long value = entity_len; value >= 0x80; value >>= 7)
+	{
+		prefix++;
+	}
+
+	buffer_add(&pending, &type, 1);
+	buffer_varint(&pending, 1 + prefix + entity_len + response_len);
+	buffer_add(&pending, &intent, 1);
+	buffer_varint(&pending, entity_len);
+	buffer_add(&pending, entity, entity_len);
+	buffer_add(&pending, response, response_len);
+	records_sent++;
+}
+
+/*
+ * Log that the knowledge base has been reset.
+ */
+void replicate_reset()
+{
+	unsigned char type = REPL_RESET;
+	buffer_add(&pending, &type, 1);
+	buffer_varint(&pending, 0);
+	records_sent++;
+}
+
+/*
+ * Log that the normalization of entities has changed.
+ *
+ * Input:
+ *   flags - the steps of the normalization
+ */
+void replicate_normalize(int flags)
+{
+	unsigned char type = REPL_NORMALIZE;
+	unsigned char value = (unsigned char)flags;
+	buffer_add(&pending, &type, 1);
+	buffer_varint(&pending, 1);
+	buffer_add(&pending, &value, 1);
+	records_sent++;
+}
+
+/*
+ * Apply a record received from the leader.
+ *
+ * Input:
+ *   type - the type of the record
+ *   data - the rest of the record
+ *   len  - the length of the rest of the record
+ */
+static void apply_record(int type, char *data, size_t len)
+{
+	unsigned long long value;
+	size_t used = read_varint(data, len, &value);
+
+	if (type == REPL_SNAPSHOT && used > 0)
+	{
+		// Start again from the knowledge base of the leader
+		FILE *f = fmemopen(data + used, len - used, "r");
+		knowledge_reset();
+		knowledge_normalize((int)value);
+		if (f != NULL)
+		{
+			knowledge_read(f);
+			fclose(f);
+		}
+	}
+	else if ((type == REPL_PUT || type == REPL_LEARN) && len > 0 && (used = read_varint(data + 1, len - 1, &value)) > 0 &&
+			 value <= len - 1 - used && (unsigned char)data[0] < MAX_HASHTABLE)
+	{
+		// The entity and response are null-terminated in a copy, as knowledge_learn() wants
+		const char *intent = knowledge_intent_name((unsigned char)data[0]);
+		const char *entity = data + 1 + used;
+		size_t response_len = len - 1 - used - value;
+		char *copy = malloc(value + response_len + 2);
+		if (copy != NULL)
+		{
+			memcpy(copy, entity, value);
+			copy[value] = '\0';
+			memcpy(copy + value + 1, entity + value, response_len);
+			copy[value + 1 + response_len] = '\0';
+			if (type == REPL_LEARN)
+			{
+				knowledge_learn(intent, copy, copy + value + 1);
+			}
+			else
+			{
+				knowledge_put_len(intent, copy, value, copy + value + 1, response_len);
+			}
+			free(copy);
+		}
+	}
+	else if (type == REPL_RESET)
+	{
+		knowledge_reset();
+	}
+	else if (type == REPL_NORMALIZE && len > 0)
+	{
+		knowledge_normalize((unsigned char)data[0]);
+	}
+	records_applied++;
+}
+
+/*
+ * Apply the complete records at the start of a buffer, and keep the rest.
+ *
+ * Input:
+ *   buffer - the records
+ *
+ * Returns: the number of records applied
+ */
+static int apply_records(repl_buffer *buffer)
+{
+	size_t at = 0;
+	int applied = 0;
+
+	while (at < buffer->len)
+	{
+		unsigned long long len;
+		size_t used = read_varint(buffer->data + at + 1, buffer->len - at - 1, &len);
+		if (used == 0 || len > buffer->len - at - 1 - used)
+		{
+			break;
+		}
+		apply_record((unsigned char)buffer->data[at], buffer->data + at + 1 + used, len);
+		at += 1 + used + len;
+		applied++;
+	}
+
+	memmove(buffer->data, buffer->data + at, buffer->len - at);
+	buffer->len -= at;
+	return applied;
+}
+
+// Thread function of a follower that receives the log of the leader as it comes
+static void *receive_log(void *arg)
+{
+	(void)arg;
+	char block[KB_BLOCK_SIZE / 4];
+	ssize_t got;
+
+	while ((got = recv(leader, block, sizeof(block), 0)) > 0 || (got < 0 && errno == EINTR))
+	{
+		pthread_mutex_lock(&follower_lock);
+		buffer_add(&received, block, got > 0 ? got : 0);
+		pthread_mutex_unlock(&follower_lock);
+	}
+
+	pthread_mutex_lock(&follower_lock);
+	leader_gone = 1;
+	pthread_mutex_unlock(&follower_lock);
+	return NULL;
+}
+
+/*
+ * Start following a leader: take the snapshot of its knowledge base in
+ * place of this one's, then apply its log before each command.
+ *
+ * Input:
+ *   path - the path of the socket of the leader
+ *
+ * Returns:
+ *   the number of responses in the snapshot
+ *   KB_INVALID, if already following, or the path is too long
+ *   KB_NOTFOUND, if the leader could not be reached
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int replicate_follow(const char *path)
+{
+	struct sockaddr_un address;
+
+	if (leader >= 0 || strlen(path) >= sizeof(address.sun_path))
+	{
+		return KB_INVALID;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+	leader = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (leader < 0 || connect(leader, (struct sockaddr *)&address, sizeof(address)) != 0)
+	{
+		if (leader >= 0)
+		{
+			close(leader);
+		}
+		leader = -1;
+		return KB_NOTFOUND;
+	}
+
+	// Wait for the whole snapshot, and apply it before anything else
+	char block[KB_BLOCK_SIZE / 4];
+	ssize_t got;
+	received.len = 0;
+	received.failed = 0;
+	leader_gone = 0;
+	while (apply_records(&received) == 0)
+	{
+		got = recv(leader, block, sizeof(block), 0);
+		if (got <= 0 && !(got < 0 && errno == EINTR))
+		{
+			close(leader);
+			leader = -1;
+			return KB_NOTFOUND;
+		}
+		buffer_add(&received, block, got > 0 ? got : 0);
+		if (received.failed)
+		{
+			close(leader);
+			leader = -1;
+			return KB_NOMEM;
+		}
+	}
+
+	if (pthread_create(&receiver, NULL, receive_log, NULL) != 0)
+	{
+		close(leader);
+		leader = -1;
+		return KB_NOMEM;
+	}
+
+	size_t entries[MAX_HASHTABLE], memory;
+	knowledge_sizes(entries, &memory);
+	return (int)(entries[0] + entries[1] + entries[2]);
+}
+
+/*
+ * Start a command: a follower applies what it has received from the
+ * leader, and a leader holds off new followers until the command is done.
+ * This is cheap when not replicating, and is meant to be called before
+ * each command.
+ */
+void replicate_begin()
+{
+	if (replicate_leading)
+	{
+		pthread_mutex_lock(&leader_lock);
+		leader_locked = 1;
+	}
+
+	// What a follower applies is logged in turn if it leads followers of its own
+	if (leader >= 0)
+	{
+		pthread_mutex_lock(&follower_lock);
+		apply_records(&received);
+		pthread_mutex_unlock(&follower_lock);
+	}
+}
+
+/*
+ * End a command: a leader queues the log of the command for every
+ * follower, and sends each as much of it as it takes at once; the thread
+ * serving the followers sends the rest.
+ */
+void replicate_end()
+{
+	if (pending.len > 0)
+	{
+		int behind = 0;
+		pthread_mutex_lock(&queue_lock);
+		for (int i = follower_count - 1; i >= 0; i--)
+		{
+			// A follower that misses any of the log would go out of step, so it is dropped, as is one too far behind
+			if (pending.failed || !queue_follower(&followers[i], pending.data, pending.len) || !flush_follower(&followers[i]))
+			{
+				drop_follower(i);
+			}
+			else if (followers[i].queue.len > 0)
+			{
+				behind = 1;
+			}
+		}
+		pthread_mutex_unlock(&queue_lock);
+		pending.len = 0;
+		pending.failed = 0;
+
+		// Wake the thread serving the followers, to send the rest when they are ready for it
+		if (behind)
+		{
+			wake_sender();
+		}
+	}
+
+	// Take new followers while the knowledge base is between commands
+	if (leader_locked)
+	{
+		admit_newcomers();
+		leader_locked = 0;
+		pthread_mutex_unlock(&leader_lock);
+	}
+}
+
+/*
+ * Stop leading and following.
+ */
+void replicate_stop()
+{
+	if (replicate_leading)
+	{
+		if (leader_locked)
+		{
+			leader_locked = 0;
+			pthread_mutex_unlock(&leader_lock);
+		}
+
+		// Give the followers a moment to take the rest of the log
+		for (int waited = 0; waited < KB_REPL_LINGER; waited += 10)
+		{
+			int behind = 0;
+			pthread_mutex_lock(&queue_lock);
+			for (int i = 0; i < follower_count; i++)
+			{
+				behind |= followers[i].queue.len > 0;
+			}
+			pthread_mutex_unlock(&queue_lock);
+			if (!behind)
+			{
+				break;
+			}
+			poll(NULL, 0, 10);
+		}
+
+		// Tell the thread serving followers to stop, and wake it up
+		pthread_mutex_lock(&queue_lock);
+		stopping = 1;
+		pthread_mutex_unlock(&queue_lock);
+		wake_sender();
+		pthread_join(sender, NULL);
+		stopping = 0;
+		close(listener);
+		close(wake[0]);
+		close(wake[1]);
+		wake[0] = wake[1] = -1;
+		unlink(listen_path);
+		listener = -1;
+		replicate_leading = 0;
+
+		while (follower_count > 0)
+		{
+			drop_follower(follower_count - 1);
+		}
+		while (newcomer_count > 0)
+		{
+			close(newcomers[--newcomer_count]);
+		}
+		pending.len = 0;
+		pending.failed = 0;
+	}
+
+	if (leader >= 0)
+	{
+		// Shutting the socket down ends the thread receiving the log
+		shutdown(leader, SHUT_RDWR);
+		pthread_join(receiver, NULL);
+		close(leader);
+		leader = -1;
+		received.len = 0;
+	}
+}
+
+/*
+ * Describe the replication.
+ *
+ * Input:
+ *   response - a buffer to receive the description
+ *   n        - the size of the buffer
+ */
+void replicate_report(char *response, int n)
+{
+	if (replicate_leading)
+	{
+		pthread_mutex_lock(&queue_lock);
+		int count = follower_count;
+		pthread_mutex_unlock(&queue_lock);
+		snprintf(response, n, "I am leading %d follower(s) on %s, and have logged %llu change(s) in %llu bytes.", count,
+				 listen_path, records_sent, bytes_sent);
+	}
+	else if (leader >= 0)
+	{
+		pthread_mutex_lock(&follower_lock);
+		int gone = leader_gone;
+		pthread_mutex_unlock(&follower_lock);
+		snprintf(response, n, "I am following%s, and have applied %llu change(s).", gone ? " a leader that has gone" : " a leader",
+				 records_applied);
+	}
+	else
+	{
+		snprintf(response, n, "I am not replicating.");
+	}
+}
@@ -0,0 +1,316 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the context of each conversation with the chatbot,
+ * so that a follow-up question such as "where is it?" after "what is SIT?"
+ * is asked about SIT, instead of about "it".
+ *
+ * Each session remembers the last entity and intent it asked about, in a
+ * fixed-size record of one cache line. The records are kept in a table
+ * addressed by the hash of the name of the session, where a session is
+ * only ever looked for in the KB_SESSION_PROBES slots from its hash, so
+ * finding one takes the same time however many there are. The table grows
+ * until it has KB_MAX_SESSIONS slots; a session that has not been used for
+ * KB_SESSION_TTL seconds has expired, and its slot is taken by the next new
+ * session that needs one. If no slot near the hash of a new session is
+ * free, it takes the slot of the least recently used of them.
+ *
+ * Entities longer than a record can hold are not remembered, so a reference
+ * after one is not resolved.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chat1002.h"
+
+// Define the number of slots of a new table
+#define SESSION_INITIAL 1024
+
+// Define the longest entity a record can hold, which keeps a record to 64 bytes
+#define SESSION_ENTITY 50
+
+// Define the most characters kept of the name of the current session, including the terminating null
+#define SESSION_NAME 64
+
+// Define the context of a session
+typedef struct session_record
+{
+	unsigned long long id;		// Hash of the name of the session, or 0 for an empty slot
+	unsigned int last_used;		// Seconds from the start of the table to when the session was last used
+	unsigned char intent;		// Index of the intent last asked about
+	unsigned char entity_len;	// Length of the entity last asked about, or 0 if there is none
+	char entity[SESSION_ENTITY]; // The entity last asked about, not null-terminated
+} session_record;
+
+// Words that refer to the entity last asked about, matched in lower case only, so that e.g. "IT" is not taken for "it"
+static const char *references[] = {"it", "its", "that", "this", "there", "he", "she", "him", "her", "they", "them"};
+
+// The table of sessions, the number of its slots in use, and when it started
+static session_record *sessions;
+static size_t session_capacity, session_count;
+static time_t session_epoch;
+
+// The current session, or 0 until it is first used, and its name
+static unsigned long long current;
+static char current_name[SESSION_NAME] = "default";
+
+// The entity last recalled, null-terminated
+static char recalled[SESSION_ENTITY + 1];
+
+// Utility function to get the time in seconds from the start of the table
+static unsigned int session_now()
+{
+	return (unsigned int)(time(NULL) - session_epoch);
+}
+
+// Utility function to check whether a session has not been used for KB_SESSION_TTL seconds
+static int session_expired(const session_record *record, unsigned int now)
+{
+	return now - record->last_used >= KB_SESSION_TTL;
+}
+
+// Utility function to hash the name of a session; zero marks an empty slot, so no session may hash to it
+static unsigned long long session_id(const char *name)
+{
+	unsigned long long id = intern_hash(name, strlen(name));
+	return id == 0 ? 1 : id;
+}
+
+/*
+ * Find the slot of a session in a table, or the slot a new session should take.
+ *
+ * Input:
+ *   table    - the table
+ *   capacity - the number of its slots, a power of two
+ *   id       - the hash of the name of the session
+ *   now      - the time, as from session_now()
+ *
+ * Returns: the slot of the session if it is in the table; otherwise the first empty slot, or else the
+ *          first expired one, or else the least recently used one, of the KB_SESSION_PROBES from its hash
+ */
+static session_record *session_slot(session_record *table, size_t capacity, unsigned long long id, unsigned int now)
+{
+	session_record *empty = NULL, *expired = NULL, *oldest = NULL;
+
+	for (size_t i = 0; i < KB_SESSION_PROBES; i++)
+	{
+		session_record *record = &table[(id + i) & (capacity - 1)];
+		if (record->id == id)
+		{
+			return record;
+		}
+		if (record->id == 0 && empty == NULL)
+		{
+			empty = record;
+		}
+		else if (record->id != 0 && session_expired(record, now) && expired == NULL)
+		{
+			expired = record;
+		}
+		if (oldest == NULL || record->last_used < oldest->last_used)
+		{
+			oldest = record;
+		}
+	}
+
+	return empty != NULL ? empty : expired != NULL ? expired : oldest;
+}
+
+// Utility function to double the table, dropping expired sessions; returns 0 if there was a memory allocation failure
+static int session_grow(unsigned int now)
+{
+	size_t capacity = session_capacity * 2;
+	session_record *table = calloc(capacity, sizeof(session_record));
+	if (table == NULL)
+	{
+		return 0;
+	}
+
+	session_count = 0;
+	for (size_t i = 0; i < session_capacity; i++)
+	{
+		if (sessions[i].id != 0 && !session_expired(&sessions[i], now))
+		{
+			session_record *slot = session_slot(table, capacity, sessions[i].id, now);
+			session_count += slot->id == 0;
+			*slot = sessions[i];
+		}
+	}
+
+	free(sessions);
+	sessions = table;
+	session_capacity = capacity;
+	return 1;
+}
+
+/*
+ * Switch to another session, which starts without context if it is new or has expired.
+ *
+ * Input:
+ *   name - the name of the session
+ */
+void session_select(const char *name)
+{
+	current = session_id(name);
+	snprintf(current_name, sizeof(current_name), "%s", name);
+}
+
+/*
+ * Find the record of the current session.
+ *
+ * Input:
+ *   create - 1 to make a record if the session has none, 0 to return NULL instead
+ *
+ * Returns: the record, or NULL if there is none, or if there was a memory allocation failure
+ */
+static session_record *session_find(int create)
+{
+	// The first session is named "default"
+	if (current == 0)
+	{
+		current = session_id(current_name);
+	}
+
+	// Start the table when it is first needed
+	if (sessions == NULL)
+	{
+		if (!create || (sessions = calloc(SESSION_INITIAL, sizeof(session_record))) == NULL)
+		{
+			return NULL;
+		}
+		session_capacity = SESSION_INITIAL;
+		session_epoch = time(NULL);
+	}
+
+	unsigned int now = session_now();
+	session_record *record = session_slot(sessions, session_capacity, current, now);
+	if (record->id == current && !session_expired(record, now))
+	{
+		return record;
+	}
+	if (!create)
+	{
+		return NULL;
+	}
+	if (record->id == current)
+	{
+		// The session has expired, so it starts again without context
+		memset(record, 0, sizeof(session_record));
+		record->id = current;
+		record->last_used = now;
+		return record;
+	}
+
+	// Keep the table at most three quarters full, unless it is as large as it may be
+	if (session_count * 4 >= session_capacity * 3 && session_capacity < KB_MAX_SESSIONS && session_grow(now))
+	{
+		record = session_slot(sessions, session_capacity, current, now);
+	}
+
+	// Take the slot, evicting the session in it, if any
+	session_count += record->id == 0;
+	memset(record, 0, sizeof(session_record));
+	record->id = current;
+	record->last_used = now;
+	return record;
+}
+
+/*
+ * Resolve a reference to the entity last asked about in the current session.
+ *
+ * Input:
+ *   entity - the entity of a question
+ *
+ * Returns: the entity last asked about, valid until the next call, if the entity is a lower-case word such
+ *          as "it" or "there", or is empty; NULL if it is such a word but the session has no entity to resolve it to;
+ *          or the entity itself otherwise
+ */
+const char *session_recall(const char *entity)
+{
+	int reference = entity[0] == '\0';
+	for (size_t i = 0; !reference && i < sizeof(references) / sizeof(references[0]); i++)
+	{
+		reference = strcmp(entity, references[i]) == 0;
+	}
+	if (!reference)
+	{
+		return entity;
+	}
+
+	session_record *record = session_find(0);
+	if (record == NULL || record->entity_len == 0)
+	{
+		return NULL;
+	}
+
+	record->last_used = session_now();
+	memcpy(recalled, record->entity, record->entity_len);
+	recalled[record->entity_len] = '\0';
+	return recalled;
+}
+
+/*
+ * Remember the entity and intent of a question in the current session.
+ *
+ * Input:
+ *   index  - the index of the intent in the hashtable
+ *   entity - the entity
+ */
+void session_remember(int index, const char *entity)
+{
+	session_record *record = session_find(1);
+	if (record == NULL)
+	{
+		return;
+	}
+
+	// An entity too long for the record is forgotten, rather than resolved to part of itself
+	size_t len = strlen(entity);
+	record->intent = (unsigned char)index;
+	record->entity_len = len <= SESSION_ENTITY ? (unsigned char)len : 0;
+	memcpy(record->entity, entity, record->entity_len);
+	record->last_used = session_now();
+}
+
+/*
+ * Forget the context of the current session.
+ */
+void session_forget()
+{
+	session_record *record = session_find(0);
+	if (record != NULL)
+	{
+		record->entity_len = 0;
+	}
+}
+
+/*
+ * Describe the current session and the table of sessions.
+ *
+ * Input:
+ *   response - a buffer to receive the description
+ *   n        - the size of the buffer
+ */
+void session_report(char *response, int n)
+{
+	session_record *record = session_find(0);
+	int len;
+
+	if (record == NULL || record->entity_len == 0)
+	{
+		len = snprintf(response, n, "This is session %s, with nothing asked yet.", current_name);
+	}
+	else
+	{
+		len = snprintf(response, n, "This is session %s, last asking %s %.*s.", current_name,
+					   knowledge_intent_name(record->intent), (int)record->entity_len, record->entity);
+	}
+
+	if (len >= 0 && len < n)
+	{
+		snprintf(response + len, n - len, " %zu sessions are in a table of %zu, of at most %d.", session_count,
+				 session_capacity, KB_MAX_SESSIONS);
+	}
+}
@@ -0,0 +1,853 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the sharding of the knowledge base across several
+ * chatbot processes on the same host, so that it can outgrow the memory and
+ * the lookup throughput of one process.
+ *
+ * "chatbot --serve SOCKET" is a backend: it starts empty, and answers
+ * requests for its part of the knowledge base on a Unix domain socket,
+ * without chatting.
+ *
+ * "chatbot --route SOCKET..." chats as usual, but keeps no knowledge of its
+ * own: each question and each response learned or loaded goes to the
+ * backend that owns its intent and entity, chosen by consistent hashing
+ * over the sockets of the backends. Each backend owns KB_SHARD_POINTS
+ * points on a ring of 64-bit hashes, and a key belongs to the backend of
+ * the first point at or after its hash, so adding or removing a backend
+ * only moves the keys next to its points. Entities are normalized before
+ * they are hashed, so every variant of an entity goes to the same backend.
+ * Resetting clears every backend, then sends each entity of the embedded
+ * knowledge to the backend that owns it. A router starting clears nothing,
+ * as other routers may be using the same backends: it only sends the
+ * embedded knowledge to the backends that know nothing yet. Saving merges the knowledge
+ * of every backend into one file, and a load is split between them, with
+ * the responses for each backend sent in large batches.
+ *
+ * A backend that goes away is reached again on the next request for it;
+ * until then, the requests it owns fail with KB_UNAVAILABLE.
+ *
+ * Only knowledge is sharded: commands such as FREEZE apply to the router
+ * alone. Entities are placed by their normalized keys, and backends keep
+ * the default normalization, so a router refuses to change it.
+ *
+ * Requests and replies are framed as:
+ *   1 byte   the type (SHARD_GET, SHARD_PUT, SHARD_LEARN, SHARD_RESET, SHARD_DUMP or SHARD_COUNT), or for a reply, minus
+ *            its result
+ *   varint   length of the rest of the frame
+ *   bytes    for SHARD_GET, a byte of the intent index and the entity; for SHARD_PUT and SHARD_LEARN, a byte of the
+ *            intent index, a varint of the length of the entity, the entity and the response; for a reply to
+ *            SHARD_GET, the response; for a reply to SHARD_DUMP, the knowledge as written by knowledge_write(); for a
+ *            reply to SHARD_COUNT, a varint of the number of entities the backend knows
+ *
+ * serve_main() runs a backend.
+ * route_start() starts routing, and route_get(), route_put(), route_flush(),
+ * route_reset(), route_fresh(), route_shards() and route_dump() are used by knowledge.c while it does.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "chat1002.h"
+
+// Define the types of requests
+#define SHARD_GET   1
+#define SHARD_PUT   2
+#define SHARD_LEARN 3
+#define SHARD_RESET 4
+#define SHARD_DUMP  5
+#define SHARD_COUNT 6
+
+// Define the most bytes of requests batched for one backend before they are sent
+#define SHARD_BATCH (64 * 1024)
+
+// Define a buffer of frames
+typedef struct frame_buffer
+{
+	char *data;		 // The frames
+	size_t len;		 // Number of bytes used
+	size_t capacity; // Number of bytes allocated
+	int failed;		 // Set to 1 if a frame could not be added for lack of memory
+} frame_buffer;
+
+// Define a backend, as the router sees it
+typedef struct shard
+{
+	const char *path;  // Path of the socket of the backend, to reconnect to it
+	int socket;		   // Socket connected to the backend, or -1 while it is gone
+	frame_buffer batch; // Requests not sent yet
+	int waiting;	   // Number of requests sent or batched whose replies have not been read
+	int failed;		   // Number of batched requests that failed, since the last route_flush()
+	int fresh;		   // 1 if the backend knew nothing after the last reset, so it is sent the embedded knowledge
+} shard;
+
+// Define a point of a backend on the ring
+typedef struct ring_point
+{
+	unsigned long long hash; // Position on the ring
+	int shard;				 // The backend
+} ring_point;
+
+// Set to 1 while routing
+int route_enabled;
+
+// Set to 1 from the start of routing until the first reset, which clears nothing
+static int starting;
+
+// The backends, and their points on the ring in order of hash
+static shard *shards;
+static int shard_count;
+static ring_point *ring;
+
+// The last response got from a backend, and the longest so far
+static frame_buffer reply;
+static size_t longest_reply;
+
+// Utility function to add bytes to a buffer
+static void buffer_add(frame_buffer *buffer, const void *data, size_t len)
+{
+	if (buffer->failed)
+	{
+		return;
+	}
+	if (buffer->len + len > buffer->capacity)
+	{
+		size_t capacity = buffer->capacity < 4096 ? 4096 : buffer->capacity;
+		while (capacity < buffer->len + len)
+		{
+			capacity *= 2;
+		}
+		char *bigger = realloc(buffer->data, capacity);
+		if (bigger == NULL)
+		{
+			buffer->failed = 1;
+			return;
+		}
+		buffer->data = bigger;
+		buffer->capacity = capacity;
+	}
+	memcpy(buffer->data + buffer->len, data, len);
+	buffer->len += len;
+}
+
+// Utility function to add a varint to a buffer, or only count its bytes if the buffer is NULL
+static size_t buffer_varint(frame_buffer *buffer, unsigned long long value)
+{
+	unsigned char bytes[10];
+	size_t len = 0;
+
+	while (value >= 0x80)
+	{
+		bytes[len++] = (unsigned char)((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	bytes[len++] = (unsigned char)value;
+	if (buffer != NULL)
+	{
+		buffer_add(buffer, bytes, len);
+	}
+	return len;
+}
+
+// Utility function to read a varint from memory; returns the number of bytes read, or 0 if it is incomplete
+static size_t read_varint(const char *data, size_t len, unsigned long long *value)
+{
+	*value = 0;
+	for (size_t i = 0; i < len && i < 10; i++)
+	{
+		*value |= (unsigned long long)((unsigned char)data[i] & 0x7F) << (7 * i);
+		if (!((unsigned char)data[i] & 0x80))
+		{
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+// Utility function to add a frame to a buffer
+static void buffer_frame(frame_buffer *buffer, int type, const char *data, size_t len)
+{
+	unsigned char byte = (unsigned char)type;
+	buffer_add(buffer, &byte, 1);
+	buffer_varint(buffer, len);
+	buffer_add(buffer, data, len);
+}
+
+// Utility function to add a request for a response to a buffer
+static void buffer_put(frame_buffer *buffer, int type, int index, const char *entity, size_t entity_len,
+					   const char *response, size_t response_len)
+{
+	unsigned char byte = (unsigned char)type, intent = (unsigned char)index;
+	buffer_add(buffer, &byte, 1);
+	buffer_varint(buffer, 1 + buffer_varint(NULL, entity_len) + entity_len + response_len);
+	buffer_add(buffer, &intent, 1);
+	buffer_varint(buffer, entity_len);
+	buffer_add(buffer, entity, entity_len);
+	buffer_add(buffer, response, response_len);
+}
+
+// Utility function to send a whole buffer to a socket; returns 0 if the socket has gone
+static int send_all(int socket, const char *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t sent = send(socket, data, len, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (sent <= 0)
+		{
+			return 0;
+		}
+		data += sent;
+		len -= sent;
+	}
+	return 1;
+}
+
+// Utility function to receive exactly len bytes from a socket; returns 0 if the socket has gone
+static int receive_all(int socket, char *data, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t got = recv(socket, data, len, 0);
+		if (got < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if (got <= 0)
+		{
+			return 0;
+		}
+		data += got;
+		len -= got;
+	}
+	return 1;
+}
+
+/*
+ * Receive a frame from a socket.
+ *
+ * Input:
+ *   socket - the socket
+ *   frame  - receives the rest of the frame, replacing what it held
+ *
+ * Returns: the type of the frame, or -1 if the socket has gone or there was a memory allocation failure
+ */
+static int receive_frame(int socket, frame_buffer *frame)
+{
+	unsigned char type, byte;
+	unsigned long long len = 0;
+	int shift = 0;
+
+	if (!receive_all(socket, (char *)&type, 1))
+	{
+		return -1;
+	}
+	do
+	{
+		if (shift > 63 || !receive_all(socket, (char *)&byte, 1))
+		{
+			return -1;
+		}
+		len |= (unsigned long long)(byte & 0x7F) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+
+	// Make room for the frame and a null after it
+	frame->len = 0;
+	frame->failed = 0;
+	buffer_add(frame, "", 0);
+	if (len + 1 > frame->capacity)
+	{
+		char *bigger = realloc(frame->data, len + 1);
+		if (bigger == NULL)
+		{
+			return -1;
+		}
+		frame->data = bigger;
+		frame->capacity = len + 1;
+	}
+	if (!receive_all(socket, frame->data, len))
+	{
+		return -1;
+	}
+	frame->data[len] = '\0';
+	frame->len = len;
+	return type;
+}
+
+/*
+ * Handle a request of a router on a backend.
+ *
+ * Input:
+ *   type  - the type of the request
+ *   data  - the rest of the request
+ *   len   - the length of the rest of the request
+ *   out   - receives the reply
+ */
+static void serve_request(int type, char *data, size_t len, frame_buffer *out)
+{
+	unsigned long long entity_len;
+	size_t used;
+	int result = KB_INVALID;
+
+	if (type == SHARD_GET && len > 0 && (unsigned char)data[0] < MAX_HASHTABLE)
+	{
+		// Copy the entity to null-terminate it
+		char *entity = malloc(len);
+		const char *response = NULL;
+		size_t response_len = 0;
+		result = KB_NOMEM;
+		if (entity != NULL)
+		{
+			memcpy(entity, data + 1, len - 1);
+			entity[len - 1] = '\0';
+			result = knowledge_get_ref(knowledge_intent_name((unsigned char)data[0]), entity, &response, &response_len);
+			free(entity);
+		}
+		buffer_frame(out, -result, response, result == KB_OK ? response_len : 0);
+		return;
+	}
+	else if ((type == SHARD_PUT || type == SHARD_LEARN) && len > 0 && (unsigned char)data[0] < MAX_HASHTABLE &&
+			 (used = read_varint(data + 1, len - 1, &entity_len)) > 0 && entity_len <= len - 1 - used)
+	{
+		// Copy the entity and response to null-terminate them
+		const char *intent = knowledge_intent_name((unsigned char)data[0]);
+		size_t response_len = len - 1 - used - entity_len;
+		char *copy = malloc(entity_len + response_len + 2);
+		result = KB_NOMEM;
+		if (copy != NULL)
+		{
+			memcpy(copy, data + 1 + used, entity_len);
+			copy[entity_len] = '\0';
+			memcpy(copy + entity_len + 1, data + 1 + used + entity_len, response_len);
+			copy[entity_len + 1 + response_len] = '\0';
+			result = type == SHARD_LEARN ? knowledge_learn(intent, copy, copy + entity_len + 1)
+										 : knowledge_put_len(intent, copy, entity_len, copy + entity_len + 1, response_len);
+			free(copy);
+		}
+	}
+	else if (type == SHARD_RESET)
+	{
+		knowledge_clear();
+		result = KB_OK;
+	}
+	else if (type == SHARD_DUMP)
+	{
+		char *text = NULL;
+		size_t text_len = 0;
+		FILE *f = open_memstream(&text, &text_len);
+		result = f == NULL ? KB_NOMEM : knowledge_write(f);
+		if (f != NULL)
+		{
+			fclose(f);
+		}
+		buffer_frame(out, -result, text, result == KB_OK ? text_len : 0);
+		free(text);
+		return;
+	}
+	else if (type == SHARD_COUNT)
+	{
+		size_t entries[MAX_HASHTABLE], memory, known = 0;
+		knowledge_sizes(entries, &memory);
+		for (int i = 0; i < MAX_HASHTABLE; i++)
+		{
+			known += entries[i];
+		}
+		unsigned char reply_type = (unsigned char)-KB_OK;
+		buffer_add(out, &reply_type, 1);
+		buffer_varint(out, buffer_varint(NULL, known));
+		buffer_varint(out, known);
+		return;
+	}
+
+	buffer_frame(out, -result, NULL, 0);
+}
+
+/*
+ * Run a backend: answer the requests of routers on a Unix domain socket
+ * until killed.
+ *
+ * Input:
+ *   argc - the number of arguments
+ *   argv - the path of the socket
+ *
+ * Returns: the exit status of the program
+ */
+int serve_main(int argc, char *argv[])
+{
+	struct sockaddr_un address;
+
+	if (argc != 1 || strlen(argv[0]) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "usage: chatbot --serve SOCKET\n");
+		return 1;
+	}
+
+	// Listen on the socket, replacing any left behind
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, argv[0]);
+	unlink(argv[0]);
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 16) != 0)
+	{
+		fprintf(stderr, "cannot listen on %s\n", argv[0]);
+		return 1;
+	}
+
+	printf("serving on %s\n", argv[0]);
+	fflush(stdout);
+
+	// Wait for routers to connect and send requests, answering each request in turn
+	struct pollfd polled[KB_MAX_FOLLOWERS + 1];
+	int count = 1;
+	frame_buffer request = {NULL, 0, 0, 0}, out = {NULL, 0, 0, 0};
+	polled[0].fd = listener;
+	polled[0].events = POLLIN;
+	while (poll(polled, count, -1) >= 0 || errno == EINTR)
+	{
+		for (int i = count - 1; i >= 1; i--)
+		{
+			if (polled[i].revents == 0)
+			{
+				continue;
+			}
+
+			// A router that has gone, or sent a frame that cannot be read, is forgotten
+			int type = (polled[i].revents & POLLIN) ? receive_frame(polled[i].fd, &request) : -1;
+			out.len = 0;
+			out.failed = 0;
+			if (type >= 0)
+			{
+				serve_request(type, request.data, request.len, &out);
+			}
+			if (type < 0 || out.failed || !send_all(polled[i].fd, out.data, out.len))
+			{
+				close(polled[i].fd);
+				polled[i] = polled[--count];
+			}
+		}
+
+		if ((polled[0].revents & POLLIN) && count < KB_MAX_FOLLOWERS + 1)
+		{
+			int socket = accept(listener, NULL, NULL);
+			if (socket >= 0)
+			{
+				polled[count].fd = socket;
+				polled[count].events = POLLIN;
+				polled[count].revents = 0;
+				count++;
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Utility function to mix a hash, so that nearby values land far apart on the ring
+static unsigned long long mix(unsigned long long h)
+{
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+// Utility function to order the points of the ring
+static int compare_points(const void *a, const void *b)
+{
+	const ring_point *x = a, *y = b;
+	return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+/*
+ * Find the backend that owns an entity: the backend of the first point of
+ * the ring at or after the hash of the intent and key of the entity.
+ *
+ * Input:
+ *   index      - the index of the intent in the hashtable
+ *   entity     - the entity
+ *   entity_len - the length of the entity
+ *
+ * Returns: the backend, or NULL if there was a memory allocation failure
+ */
+static shard *find_shard(int index, const char *entity, size_t entity_len)
+{
+	size_t key_len;
+	const char *key = normalize_cached(entity, entity_len, &key_len);
+	if (key == NULL)
+	{
+		return NULL;
+	}
+
+	unsigned long long h = mix(intern_hash(key, key_len) + (unsigned long long)index);
+	size_t low = 0, high = (size_t)shard_count * KB_SHARD_POINTS;
+	while (low < high)
+	{
+		size_t middle = (low + high) / 2;
+		if (ring[middle].hash < h)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	// Past the last point, the ring wraps around to the first
+	return &shards[ring[low == (size_t)shard_count * KB_SHARD_POINTS ? 0 : low].shard];
+}
+
+// Utility function to forget a backend that has gone
+static void lose_shard(shard *backend)
+{
+	if (backend->socket >= 0)
+	{
+		close(backend->socket);
+		backend->socket = -1;
+	}
+	backend->batch.len = 0;
+	backend->batch.failed = 0;
+	backend->waiting = 0;
+}
+
+// Utility function to connect to a backend; returns 0 if it cannot be reached
+static int connect_shard(shard *backend)
+{
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	snprintf(address.sun_path, sizeof(address.sun_path), "%s", backend->path);
+	backend->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (backend->socket >= 0 && connect(backend->socket, (struct sockaddr *)&address, sizeof(address)) != 0)
+	{
+		close(backend->socket);
+		backend->socket = -1;
+	}
+	return backend->socket >= 0;
+}
+
+/*
+ * Send the batched requests of a backend, and read the replies to every
+ * request sent to it.
+ *
+ * Input:
+ *   backend - the backend
+ *
+ * Returns:
+ *   the result of the last reply
+ *   KB_NOMEM, if the requests could not be batched for lack of memory
+ *   KB_UNAVAILABLE, if the backend has gone and cannot be reached again
+ */
+static int flush_shard(shard *backend)
+{
+	int result = KB_OK;
+
+	// A backend that has gone may have been restarted, so it is reached again before it is sent anything
+	if (backend->socket < 0 && backend->waiting > 0)
+	{
+		connect_shard(backend);
+	}
+	if (backend->socket < 0 || backend->batch.failed ||
+		(backend->batch.len > 0 && !send_all(backend->socket, backend->batch.data, backend->batch.len)))
+	{
+		result = backend->socket >= 0 && backend->batch.failed ? KB_NOMEM : KB_UNAVAILABLE;
+		backend->failed += backend->waiting;
+		lose_shard(backend);
+		return result;
+	}
+	backend->batch.len = 0;
+
+	for (; backend->waiting > 0; backend->waiting--)
+	{
+		int type = receive_frame(backend->socket, &reply);
+		if (type < 0)
+		{
+			backend->failed += backend->waiting;
+			lose_shard(backend);
+			return KB_UNAVAILABLE;
+		}
+		result = -type;
+		if (result != KB_OK)
+		{
+			backend->failed++;
+		}
+	}
+
+	return result;
+}
+
+/*
+ * Start routing: connect to every backend, and place them on the ring.
+ *
+ * Input:
+ *   count - the number of backends
+ *   paths - the paths of their sockets, which must stay valid while routing
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOTFOUND, if a backend could not be reached (routing does not start)
+ *   KB_NOMEM, if there was a memory allocation failure
+ */
+int route_start(int count, char *paths[])
+{
+	shards = calloc(count, sizeof(shard));
+	ring = malloc((size_t)count * KB_SHARD_POINTS * sizeof(ring_point));
+	if (shards == NULL || ring == NULL)
+	{
+		free(shards);
+		free(ring);
+		return KB_NOMEM;
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		shards[i].path = paths[i];
+		if (!connect_shard(&shards[i]))
+		{
+			shard_count = i + 1;
+			route_stop();
+			return KB_NOTFOUND;
+		}
+
+		// The points of a backend follow from its socket, so the same backends always own the same keys
+		for (int j = 0; j < KB_SHARD_POINTS; j++)
+		{
+			ring[i * KB_SHARD_POINTS + j].hash = mix(intern_hash(paths[i], strlen(paths[i])) + (unsigned long long)j);
+			ring[i * KB_SHARD_POINTS + j].shard = i;
+		}
+	}
+	shard_count = count;
+	qsort(ring, (size_t)count * KB_SHARD_POINTS, sizeof(ring_point), compare_points);
+
+	// Ask each backend what it knows, so that only those that know nothing yet are sent the embedded knowledge
+	for (int i = 0; i < count; i++)
+	{
+		unsigned long long known;
+		buffer_frame(&shards[i].batch, SHARD_COUNT, NULL, 0);
+		shards[i].waiting++;
+		if (flush_shard(&shards[i]) != KB_OK || read_varint(reply.data, reply.len, &known) == 0)
+		{
+			route_stop();
+			return KB_NOTFOUND;
+		}
+		shards[i].fresh = known == 0;
+	}
+
+	starting = 1;
+	route_enabled = 1;
+	return KB_OK;
+}
+
+/*
+ * Stop routing, and disconnect from the backends.
+ */
+void route_stop()
+{
+	for (int i = 0; i < shard_count; i++)
+	{
+		lose_shard(&shards[i]);
+		free(shards[i].batch.data);
+	}
+	free(shards);
+	free(ring);
+	shards = NULL;
+	ring = NULL;
+	shard_count = 0;
+	starting = 0;
+	route_enabled = 0;
+}
+
+/*
+ * Get the response to a question from the backend that owns it.
+ *
+ * Input:
+ *   index    - the index of the intent in the hashtable
+ *   entity   - the entity
+ *   response - receives the response, valid until the next request to a backend
+ *   len      - receives the length of the response
+ *
+ * Returns: as knowledge_get_ref(), or KB_UNAVAILABLE if the backend has gone and cannot be reached again
+ */
+int route_get(int index, const char *entity, const char **response, size_t *len)
+{
+	size_t entity_len = strlen(entity);
+	shard *backend = find_shard(index, entity, entity_len);
+	if (backend == NULL)
+	{
+		return KB_NOMEM;
+	}
+
+	unsigned char intent = (unsigned char)index, type = SHARD_GET;
+	buffer_add(&backend->batch, &type, 1);
+	buffer_varint(&backend->batch, 1 + entity_len);
+	buffer_add(&backend->batch, &intent, 1);
+	buffer_add(&backend->batch, entity, entity_len);
+	backend->waiting++;
+
+	// The reply to the question is the last one read
+	int result = flush_shard(backend);
+	if (result == KB_OK)
+	{
+		*response = reply.data;
+		*len = reply.len;
+		longest_reply = reply.len > longest_reply ? reply.len : longest_reply;
+	}
+	return result;
+}
+
+/*
+ * Put a response into the backend that owns it.
+ *
+ * Input:
+ *   index        - the index of the intent in the hashtable
+ *   entity       - the entity
+ *   entity_len   - the length of the entity
+ *   response     - the response
+ *   response_len - the length of the response
+ *   learned      - 1 if the response was learned from the user, 0 to pin it
+ *   batched      - 1 to batch the request with others, leaving the result to route_flush(); 0 to wait for it
+ *
+ * Returns: as knowledge_put_len(), or KB_UNAVAILABLE if the backend has gone and cannot be reached again; always KB_OK
+ * if batched
+ */
+int route_put(int index, const char *entity, size_t entity_len, const char *response, size_t response_len, int learned,
+			  int batched)
+{
+	shard *backend = find_shard(index, entity, entity_len);
+	if (backend == NULL)
+	{
+		return KB_NOMEM;
+	}
+
+	buffer_put(&backend->batch, learned ? SHARD_LEARN : SHARD_PUT, index, entity, entity_len, response, response_len);
+	backend->waiting++;
+	longest_reply = response_len > longest_reply ? response_len : longest_reply;
+
+	// Batches are sent once they are large, and their replies read, so neither side's socket fills up
+	if (!batched || backend->batch.len >= SHARD_BATCH)
+	{
+		int result = flush_shard(backend);
+		return batched ? KB_OK : result;
+	}
+	return KB_OK;
+}
+
+/*
+ * Send every batched request, and count the ones that failed.
+ *
+ * Returns: the number of requests that failed since the last flush
+ */
+int route_flush()
+{
+	int failed = 0;
+
+	for (int i = 0; i < shard_count; i++)
+	{
+		flush_shard(&shards[i]);
+		failed += shards[i].failed;
+		shards[i].failed = 0;
+	}
+
+	return failed;
+}
+
+/*
+ * Clear every backend. The first reset after routing starts clears
+ * nothing, so that starting a router does not lose what other routers
+ * have put into the backends.
+ */
+void route_reset()
+{
+	if (starting)
+	{
+		starting = 0;
+		return;
+	}
+
+	for (int i = 0; i < shard_count; i++)
+	{
+		buffer_frame(&shards[i].batch, SHARD_RESET, NULL, 0);
+		shards[i].waiting++;
+		shards[i].fresh = flush_shard(&shards[i]) == KB_OK;
+		shards[i].failed = 0;
+	}
+}
+
+/*
+ * Determine whether the backend that owns an entity knew nothing after
+ * the last reset, and so is to be sent the embedded knowledge.
+ *
+ * Input:
+ *   index      - the index of the intent in the hashtable
+ *   entity     - the entity
+ *   entity_len - the length of the entity
+ *
+ * Returns: 1 if the backend knew nothing, 0 if it did or there was a memory allocation failure
+ */
+int route_fresh(int index, const char *entity, size_t entity_len)
+{
+	shard *backend = find_shard(index, entity, entity_len);
+	return backend != NULL && backend->fresh;
+}
+
+/*
+ * Get the number of backends being routed to.
+ *
+ * Returns: the number of backends, or 0 if not routing
+ */
+int route_shards()
+{
+	return shard_count;
+}
+
+/*
+ * Get the knowledge of a backend, as written by knowledge_write().
+ *
+ * Input:
+ *   index - the index of the backend, from 0 to route_shards() - 1
+ *   data  - receives the knowledge, which the caller must free
+ *   len   - receives the length of the knowledge
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOMEM, if the backend could not write its knowledge
+ *   KB_UNAVAILABLE, if the backend has gone and cannot be reached again
+ */
+int route_dump(int index, char **data, size_t *len)
+{
+	buffer_frame(&shards[index].batch, SHARD_DUMP, NULL, 0);
+	shards[index].waiting++;
+	int result = flush_shard(&shards[index]);
+	if (result != KB_OK)
+	{
+		return result == KB_UNAVAILABLE ? KB_UNAVAILABLE : KB_NOMEM;
+	}
+
+	// Hand the reply over to the caller
+	*data = reply.data;
+	*len = reply.len;
+	memset(&reply, 0, sizeof(reply));
+	return KB_OK;
+}
+
+/*
+ * Get the length of the longest response got from or put into a backend.
+ *
+ * Returns: the length
+ */
+size_t route_max_response()
+{
+	return longest_reply;
+}
@@ -0,0 +1,316 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements shared knowledge bases: frozen images published in
+ * POSIX shared memory, so that many chatbot processes on a host can answer
+ * from one copy of the knowledge instead of each loading its own. Images use
+ * offsets instead of pointers, so they work wherever they are mapped.
+ *
+ * A shared knowledge base called NAME is made of a control block "/NAME",
+ * which holds the number of its current generation, and one segment
+ * "/NAME.GENERATION" holding the image of each generation. The loader
+ * writes a new generation in full before raising the number in the control
+ * block, so workers never see an image half written. Workers map the
+ * segments read-only and check the control block before each command;
+ * when the number has moved on, they map the new generation and let go of
+ * the old one. The loader unlinks the old generation once the new one is
+ * published, and its memory is freed when the last worker lets go of it.
+ *
+ * shared_publish() publishes an image as the next generation.
+ * shared_attach() maps the current generation of a shared knowledge base.
+ * shared_refresh() maps the next generation, if there is one.
+ * shared_unmap() lets go of a generation.
+ * shared_close() stops following a shared knowledge base.
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "chat1002.h"
+
+// Define the longest name of a shared knowledge base, and of a shared memory segment with its generation number
+#define MAX_NAME 48
+#define MAX_SEGMENT_NAME 64
+
+// The control block of the shared knowledge base being followed, or NULL
+static const kb_shared_control *control;
+
+// The name of the shared knowledge base being followed, and the generation mapped last
+static char followed_name[MAX_NAME + 1];
+static unsigned int mapped_generation;
+
+// Utility function to name the segment of the control block (generation 0) or of a generation
+static void segment_name(char *buf, const char *name, unsigned int generation)
+{
+	if (generation == 0)
+	{
+		snprintf(buf, MAX_SEGMENT_NAME, "/%s", name);
+	}
+	else
+	{
+		snprintf(buf, MAX_SEGMENT_NAME, "/%s.%u", name, generation);
+	}
+}
+
+/*
+ * Check that a name can be used for a shared knowledge base.
+ *
+ * Input:
+ *   name - the name
+ *
+ * Returns:
+ *   1, if the name is made of letters, digits, '-' and '_' only, and has at most MAX_NAME of them
+ *   0, otherwise
+ */
+static int valid_name(const char *name)
+{
+	if (name[0] == '\0' || strlen(name) > MAX_NAME)
+	{
+		return 0;
+	}
+	for (const char *c = name; *c != '\0'; c++)
+	{
+		if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || *c == '-' || *c == '_'))
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Publish an image as the next generation of a shared knowledge base,
+ * creating the shared knowledge base if it does not exist yet.
+ *
+ * Input:
+ *   name  - the name of the shared knowledge base
+ *   image - the image
+ *
+ * Returns:
+ *   the number of the new generation, from 1
+ *   KB_INVALID, if the name cannot be used
+ *   KB_NOMEM, if the shared memory could not be created
+ */
+int shared_publish(const char *name, const kb_image *image)
+{
+	char buf[MAX_SEGMENT_NAME];
+
+	if (!valid_name(name))
+	{
+		return KB_INVALID;
+	}
+
+	// Open the control block, creating it if needed
+	segment_name(buf, name, 0);
+	int fd = shm_open(buf, O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+	{
+		return KB_NOMEM;
+	}
+	kb_shared_control *block = MAP_FAILED;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && (st.st_size >= (off_t)sizeof(kb_shared_control) || ftruncate(fd, sizeof(kb_shared_control)) == 0))
+	{
+		block = mmap(NULL, sizeof(kb_shared_control), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (block == MAP_FAILED)
+	{
+		return KB_NOMEM;
+	}
+
+	// Write the image into a new segment for the next generation
+	unsigned int generation = __atomic_load_n(&block->generation, __ATOMIC_ACQUIRE) + 1;
+	int result = KB_NOMEM;
+	segment_name(buf, name, generation);
+	shm_unlink(buf);
+	fd = shm_open(buf, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd >= 0)
+	{
+		void *segment = ftruncate(fd, image->size) == 0
+							? mmap(NULL, image->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+							: MAP_FAILED;
+		close(fd);
+
+		if (segment != MAP_FAILED)
+		{
+			memcpy(segment, image, image->size);
+			munmap(segment, image->size);
+			result = (int)generation;
+		}
+		else
+		{
+			shm_unlink(buf);
+		}
+	}
+
+	// Only once the image is complete, tell the workers about it and unlink the old generation
+	if (result > 0)
+	{
+		block->magic = KB_IMAGE_MAGIC;
+		__atomic_store_n(&block->generation, generation, __ATOMIC_RELEASE);
+		if (generation > 1)
+		{
+			segment_name(buf, name, generation - 1);
+			shm_unlink(buf);
+		}
+	}
+
+	munmap(block, sizeof(kb_shared_control));
+	return result;
+}
+
+/*
+ * Map a generation of the shared knowledge base being followed.
+ *
+ * Input:
+ *   generation - the generation
+ *
+ * Returns: the image of the generation, or NULL if it cannot be mapped or is not a valid image
+ */
+static kb_image *map_generation(unsigned int generation)
+{
+	char buf[MAX_SEGMENT_NAME];
+	struct stat st;
+
+	segment_name(buf, followed_name, generation);
+	int fd = shm_open(buf, O_RDONLY, 0);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+
+	kb_image *image = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(kb_image))
+	{
+		image = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (image == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	// Refuse anything that is not a whole image
+	if (image->magic != KB_IMAGE_MAGIC || image->size != (unsigned long long)st.st_size)
+	{
+		munmap(image, st.st_size);
+		return NULL;
+	}
+
+	return image;
+}
+
+/*
+ * Map the next generation of the shared knowledge base being followed, if
+ * the control block has moved on from the one mapped last. A generation
+ * can be unlinked by the time it is mapped, if the loader publishes again
+ * meanwhile, so the control block is read again until one maps.
+ *
+ * Input:
+ *   generation - receives the number of the generation mapped
+ *
+ * Returns: the image of the new generation, or NULL if there is none (or it cannot be mapped)
+ */
+kb_image *shared_refresh(unsigned int *generation)
+{
+	for (int attempt = 0; control != NULL && attempt < 8; attempt++)
+	{
+		unsigned int current = __atomic_load_n(&control->generation, __ATOMIC_ACQUIRE);
+		if (current == 0 || current == mapped_generation)
+		{
+			return NULL;
+		}
+
+		kb_image *image = map_generation(current);
+		if (image != NULL)
+		{
+			mapped_generation = current;
+			*generation = current;
+			return image;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Start following a shared knowledge base, and map its current generation.
+ *
+ * Input:
+ *   name       - the name of the shared knowledge base
+ *   generation - receives the number of the generation mapped
+ *
+ * Returns: the image of the current generation, or NULL if the shared knowledge base cannot be found
+ */
+kb_image *shared_attach(const char *name, unsigned int *generation)
+{
+	char buf[MAX_SEGMENT_NAME];
+
+	if (!valid_name(name))
+	{
+		return NULL;
+	}
+
+	// Map the control block read-only
+	segment_name(buf, name, 0);
+	int fd = shm_open(buf, O_RDONLY, 0);
+	if (fd < 0)
+	{
+		return NULL;
+	}
+	const kb_shared_control *block = MAP_FAILED;
+	struct stat st;
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(kb_shared_control))
+	{
+		block = mmap(NULL, sizeof(kb_shared_control), PROT_READ, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (block == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	// Follow the new shared knowledge base instead of any other
+	shared_close();
+	control = block;
+	snprintf(followed_name, sizeof(followed_name), "%s", name);
+
+	kb_image *image = shared_refresh(generation);
+	if (image == NULL)
+	{
+		shared_close();
+	}
+	return image;
+}
+
+/*
+ * Let go of a generation of a shared knowledge base.
+ *
+ * Input:
+ *   image - the image of the generation, as returned by shared_attach() or shared_refresh()
+ */
+void shared_unmap(kb_image *image)
+{
+	image_forget(image);
+	munmap(image, image->size);
+}
+
+/*
+ * Stop following the shared knowledge base, if any. Generations already
+ * mapped stay mapped until shared_unmap().
+ */
+void shared_close()
+{
+	if (control != NULL)
+	{
+		munmap((void *)control, sizeof(kb_shared_control));
+	}
+	control = NULL;
+	followed_name[0] = '\0';
+	mapped_generation = 0;
+}
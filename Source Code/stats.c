@@ -0,0 +1,312 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the statistics of the chatbot's knowledge base.
+ *
+ * Every thread counts into its own counters, so counting needs no locks or
+ * atomic operations and can stay enabled all the time. The counters of all
+ * threads are only added up when a report is asked for.
+ *
+ * stats_count() adds one to a counter.
+ * stats_probe() records how many nodes a lookup compared.
+ * stats_clock() and stats_time() time an operation.
+ * stats_bucket() and stats_percentile() read and fill histograms, for other timings too.
+ * stats_collect() adds up the counters of all threads.
+ * stats_report() describes the knowledge base in a sentence.
+ * stats_write() writes all statistics to a file as JSON.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "chat1002.h"
+
+// Define the counters of one thread, kept in a list of all threads
+typedef struct thread_stats
+{
+	kb_stats stats;
+	struct thread_stats *next;
+} thread_stats;
+
+// Names of the counters and timers, as written to JSON
+static const char *counter_names[STAT_COUNTERS] = {"hit", "miss", "learned", "insert", "overwrite", "filtered", "evicted"};
+static const char *timer_names[STAT_TIMERS] = {"get", "read", "write"};
+
+// Counters of the calling thread
+static _Thread_local thread_stats *local;
+
+// List of the counters of all running threads, and the totals of threads that have exited
+static thread_stats *threads;
+static kb_stats retired;
+static pthread_mutex_t threads_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Key used to retire the counters of a thread when it exits
+static pthread_key_t exit_key;
+static pthread_once_t exit_key_once = PTHREAD_ONCE_INIT;
+
+// Counters used by threads when there is insufficient memory for their own
+static thread_stats discarded;
+
+// Utility function to add all counters of one set of statistics to another
+static void add_stats(kb_stats *total, const kb_stats *stats)
+{
+	for (int i = 0; i < STAT_COUNTERS; i++)
+	{
+		total->counters[i] += stats->counters[i];
+	}
+	for (int i = 0; i < STAT_BUCKETS; i++)
+	{
+		total->probes[i] += stats->probes[i];
+		for (int j = 0; j < STAT_TIMERS; j++)
+		{
+			total->latency[j][i] += stats->latency[j][i];
+		}
+	}
+}
+
+// Called when a thread exits, to add its counters to the retired totals and free them
+static void retire_thread(void *arg)
+{
+	thread_stats *mine = arg;
+
+	pthread_mutex_lock(&threads_lock);
+	add_stats(&retired, &mine->stats);
+	for (thread_stats **cursor = &threads; *cursor != NULL; cursor = &(*cursor)->next)
+	{
+		if (*cursor == mine)
+		{
+			*cursor = mine->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&threads_lock);
+
+	free(mine);
+}
+
+static void create_exit_key()
+{
+	pthread_key_create(&exit_key, retire_thread);
+}
+
+// Get the counters of the calling thread, creating them on first use
+static kb_stats *local_stats()
+{
+	if (local == NULL)
+	{
+		thread_stats *mine = calloc(1, sizeof(thread_stats));
+		if (mine == NULL)
+		{
+			return &discarded.stats;
+		}
+
+		pthread_once(&exit_key_once, create_exit_key);
+		pthread_setspecific(exit_key, mine);
+
+		pthread_mutex_lock(&threads_lock);
+		mine->next = threads;
+		threads = mine;
+		pthread_mutex_unlock(&threads_lock);
+
+		local = mine;
+	}
+
+	return &local->stats;
+}
+
+/*
+ * Find the histogram bucket of a value; bucket i holds values from 2^(i-1)
+ * up to 2^i - 1.
+ *
+ * Input:
+ *   value - the value
+ *
+ * Returns: the bucket, from 0 to STAT_BUCKETS - 1
+ */
+int stats_bucket(unsigned long long value)
+{
+	int i = value == 0 ? 0 : 64 - __builtin_clzll(value);
+	return i < STAT_BUCKETS ? i : STAT_BUCKETS - 1;
+}
+
+/*
+ * Add one to a counter of the calling thread.
+ *
+ * Input:
+ *   counter - the counter, one of STAT_HIT, STAT_MISS, STAT_LEARNED, STAT_INSERT, STAT_OVERWRITE, STAT_FILTERED or STAT_EVICTED
+ */
+void stats_count(int counter)
+{
+	local_stats()->counters[counter]++;
+}
+
+/*
+ * Record the number of nodes a lookup compared before it finished.
+ *
+ * Input:
+ *   probes - the number of nodes
+ */
+void stats_probe(int probes)
+{
+	local_stats()->probes[stats_bucket(probes)]++;
+}
+
+/*
+ * Read the monotonic clock, to start timing an operation.
+ *
+ * Returns: the time in nanoseconds
+ */
+unsigned long long stats_clock()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Record the time an operation took.
+ *
+ * Input:
+ *   timer - the timer, one of STAT_TIME_GET, STAT_TIME_READ or STAT_TIME_WRITE
+ *   start - the time the operation started, from stats_clock()
+ */
+void stats_time(int timer, unsigned long long start)
+{
+	local_stats()->latency[timer][stats_bucket(stats_clock() - start)]++;
+}
+
+/*
+ * Add up the counters of all threads, including those that have exited.
+ *
+ * Input:
+ *   total - receives the totals
+ */
+void stats_collect(kb_stats *total)
+{
+	memset(total, 0, sizeof(kb_stats));
+
+	pthread_mutex_lock(&threads_lock);
+	add_stats(total, &retired);
+	for (thread_stats *cursor = threads; cursor != NULL; cursor = cursor->next)
+	{
+		add_stats(total, &cursor->stats);
+	}
+	pthread_mutex_unlock(&threads_lock);
+}
+
+/*
+ * Find a percentile of a histogram, as the upper bound of the bucket it
+ * falls in.
+ *
+ * Input:
+ *   histogram - the histogram, with buckets as stats_bucket()
+ *   fraction  - the percentile as a fraction, e.g. 0.99
+ *
+ * Returns: the percentile, or 0 if the histogram is empty
+ */
+unsigned long long stats_percentile(const unsigned long long histogram[STAT_BUCKETS], double fraction)
+{
+	unsigned long long total = 0, seen = 0;
+
+	for (int i = 0; i < STAT_BUCKETS; i++)
+	{
+		total += histogram[i];
+	}
+	for (int i = 0; i < STAT_BUCKETS; i++)
+	{
+		seen += histogram[i];
+		if (seen > 0 && seen >= total * fraction)
+		{
+			return i == 0 ? 0 : (1ULL << i) - 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Describe the knowledge base and its lookups in a sentence.
+ *
+ * Input:
+ *   response - a buffer to receive the description
+ *   n        - the size of the buffer
+ */
+void stats_report(char *response, int n)
+{
+	size_t entries[MAX_HASHTABLE], memory;
+	kb_stats total;
+
+	knowledge_sizes(entries, &memory);
+	stats_collect(&total);
+
+	snprintf(response, n,
+			 "I know %zu what, %zu where and %zu who responses in %zu bytes. "
+			 "I answered %llu questions, did not know %llu and learned %llu, forgetting %llu to stay within my memory budget; "
+			 "%llu unknown entities were filtered out without a search. "
+			 "Half of all lookups took under %llu ns, and 99%% under %llu ns.",
+			 entries[0], entries[1], entries[2], memory,
+			 total.counters[STAT_HIT], total.counters[STAT_MISS], total.counters[STAT_LEARNED], total.counters[STAT_EVICTED],
+			 total.counters[STAT_FILTERED],
+			 stats_percentile(total.latency[STAT_TIME_GET], 0.5), stats_percentile(total.latency[STAT_TIME_GET], 0.99));
+}
+
+// Utility function to write a histogram as a JSON array of bucket counts, without trailing empty buckets
+static void write_histogram(FILE *f, const unsigned long long histogram[STAT_BUCKETS])
+{
+	int last = STAT_BUCKETS - 1;
+	while (last > 0 && histogram[last] == 0)
+	{
+		last--;
+	}
+
+	fputc('[', f);
+	for (int i = 0; i <= last; i++)
+	{
+		fprintf(f, i == 0 ? "%llu" : ", %llu", histogram[i]);
+	}
+	fputc(']', f);
+}
+
+/*
+ * Write all statistics to a file as JSON. Histograms are arrays where
+ * element i counts values from 2^(i-1) up to 2^i - 1 (element 0 counts
+ * zeroes); latencies are in nanoseconds.
+ *
+ * Input:
+ *   f - the file
+ */
+void stats_write(FILE *f)
+{
+	size_t entries[MAX_HASHTABLE], memory;
+	kb_stats total;
+
+	knowledge_sizes(entries, &memory);
+	stats_collect(&total);
+
+	// Write the size of the knowledge base
+	fprintf(f, "{\n  \"memory_bytes\": %zu,\n  \"entries\": {", memory);
+	for (int i = 0; i < MAX_HASHTABLE; i++)
+	{
+		fprintf(f, "%s\"%s\": %zu", i == 0 ? "" : ", ", knowledge_intent_name(i), entries[i]);
+	}
+
+	// Write the counters
+	fprintf(f, "},\n  \"counters\": {");
+	for (int i = 0; i < STAT_COUNTERS; i++)
+	{
+		fprintf(f, "%s\"%s\": %llu", i == 0 ? "" : ", ", counter_names[i], total.counters[i]);
+	}
+
+	// Write the histograms
+	fprintf(f, "},\n  \"probe_histogram\": ");
+	write_histogram(f, total.probes);
+	fprintf(f, ",\n  \"latency_histogram_ns\": {");
+	for (int i = 0; i < STAT_TIMERS; i++)
+	{
+		fprintf(f, "%s\n    \"%s\": ", i == 0 ? "" : ",", timer_names[i]);
+		write_histogram(f, total.latency[i]);
+	}
+	fprintf(f, "\n  }\n}\n");
+}
@@ -0,0 +1,240 @@
+/*
+ * INF1002 (C Language) Group Project.
+ *
+ * This file implements the tracing of requests, to find out where the time
+ * of a slow request goes. While tracing is on, each request is split into
+ * stages by marks placed along its path:
+ *   tokenize - splitting the input into words, in main()
+ *   dispatch - finding the intent, in chatbot_main()
+ *   entity   - putting the entity together, in chatbot_do_question()
+ *   lookup   - looking the entity up, in knowledge_get()
+ *   handler  - the rest of the command, including every command other than questions
+ *   output   - printing the response, in main()
+ * Time spent waiting for the user to answer a question is left out.
+ *
+ * The time of every stage is added to a histogram of that stage. Requests
+ * that take longer than a threshold are also written to a trace file, as
+ * lines of a fixed length in KB_TRACE_RING slots that are reused in turn,
+ * so the file keeps the latest slow requests without ever growing.
+ *
+ * When tracing is off, each mark costs one test of trace_enabled (see
+ * TRACE_MARK in chat1002.h).
+ *
+ * trace_start() and trace_stop() turn tracing on and off.
+ * trace_begin(), trace_mark(), trace_skip() and trace_end() mark a request.
+ * trace_report() describes the stages in a sentence.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "chat1002.h"
+
+// Set to 1 while tracing is on
+int trace_enabled;
+
+// Names of the stages, as written to the trace file
+static const char *stage_names[TRACE_STAGES] = {"tokenize", "dispatch", "entity", "lookup", "handler", "output"};
+
+// Histograms of the time taken by each stage, and by whole requests, in nanoseconds
+static unsigned long long stage_latency[TRACE_STAGES][STAT_BUCKETS];
+static unsigned long long request_latency[STAT_BUCKETS];
+
+// Number of requests traced, and of those slower than the threshold
+static unsigned long long request_count;
+static unsigned long long slow_count;
+
+// Requests slower than this many nanoseconds are written to the trace file
+static unsigned long long slow_threshold;
+
+// The trace file, or NULL
+static FILE *trace_file;
+
+// The request being traced: whether trace_begin() saw it, the time of its last mark, the time of each stage, and its input
+static int current_begun;
+static unsigned long long last_mark;
+static unsigned long long current[TRACE_STAGES];
+static char current_input[KB_TRACE_RECORD];
+
+/*
+ * Turn tracing on, clearing the histograms.
+ *
+ * Input:
+ *   threshold - requests slower than this many nanoseconds are written to the trace file
+ *   file_name - the trace file, created if it does not exist and otherwise written over slot by slot
+ *
+ * Returns:
+ *   KB_OK, if successful
+ *   KB_NOTFOUND, if the trace file could not be opened
+ */
+int trace_start(unsigned long long threshold, const char *file_name)
+{
+	// Open the file for writing in place, creating it if needed
+	FILE *f = fopen(file_name, "r+");
+	if (f == NULL)
+	{
+		f = fopen(file_name, "w+");
+	}
+	if (f == NULL)
+	{
+		return KB_NOTFOUND;
+	}
+
+	trace_stop();
+	trace_file = f;
+	slow_threshold = threshold;
+	request_count = 0;
+	slow_count = 0;
+	memset(stage_latency, 0, sizeof(stage_latency));
+	memset(request_latency, 0, sizeof(request_latency));
+
+	// The request that turned tracing on began untraced, so it is left out
+	current_begun = 0;
+	memset(current, 0, sizeof(current));
+	current_input[0] = '\0';
+	last_mark = stats_clock();
+	trace_enabled = 1;
+	return KB_OK;
+}
+
+/*
+ * Turn tracing off, keeping the histograms for trace_report().
+ */
+void trace_stop()
+{
+	if (trace_file != NULL)
+	{
+		fclose(trace_file);
+	}
+	trace_file = NULL;
+	trace_enabled = 0;
+}
+
+/*
+ * Start tracing a request.
+ *
+ * Input:
+ *   input - the line of input, kept for the trace file
+ */
+void trace_begin(const char *input)
+{
+	size_t len = strcspn(input, "\r\n");
+
+	// Keep the input on one line, cut short if needed
+	if (len >= sizeof(current_input))
+	{
+		len = sizeof(current_input) - 1;
+	}
+	memcpy(current_input, input, len);
+	current_input[len] = '\0';
+
+	memset(current, 0, sizeof(current));
+	current_begun = 1;
+	last_mark = stats_clock();
+}
+
+/*
+ * Mark the end of a stage of the request being traced: the time since the
+ * last mark is added to the stage.
+ *
+ * Input:
+ *   stage - the stage, one of TRACE_TOKENIZE, TRACE_DISPATCH, TRACE_ENTITY, TRACE_LOOKUP, TRACE_HANDLER or TRACE_OUTPUT
+ */
+void trace_mark(int stage)
+{
+	unsigned long long now = stats_clock();
+
+	current[stage] += now - last_mark;
+	last_mark = now;
+}
+
+/*
+ * Leave the time since the last mark out of the request being traced, e.g.
+ * the time spent waiting for the user.
+ */
+void trace_skip()
+{
+	last_mark = stats_clock();
+}
+
+// Utility function to write a slow request to the next slot of the trace file
+static void write_slow(unsigned long long total)
+{
+	char record[KB_TRACE_RECORD + 1];
+	int len = snprintf(record, sizeof(record), "%llu total=%llu", slow_count, total);
+
+	for (int i = 0; i < TRACE_STAGES && len < KB_TRACE_RECORD; i++)
+	{
+		len += snprintf(record + len, sizeof(record) - len, " %s=%llu", stage_names[i], current[i]);
+	}
+	if (len < KB_TRACE_RECORD)
+	{
+		len += snprintf(record + len, sizeof(record) - len, " input=%s", current_input);
+	}
+
+	// Pad the record to its fixed length, so that every slot starts at a multiple of it
+	if (len > KB_TRACE_RECORD - 1)
+	{
+		len = KB_TRACE_RECORD - 1;
+	}
+	memset(record + len, ' ', KB_TRACE_RECORD - 1 - len);
+	record[KB_TRACE_RECORD - 1] = '\n';
+
+	fseek(trace_file, (long)((slow_count % KB_TRACE_RING) * KB_TRACE_RECORD), SEEK_SET);
+	fwrite(record, 1, KB_TRACE_RECORD, trace_file);
+	fflush(trace_file);
+}
+
+/*
+ * Finish tracing a request: add its stages to the histograms, and write it
+ * to the trace file if it was slow. A request that trace_begin() did not
+ * see is left out.
+ */
+void trace_end()
+{
+	unsigned long long total = 0;
+
+	if (!current_begun)
+	{
+		return;
+	}
+	current_begun = 0;
+
+	for (int i = 0; i < TRACE_STAGES; i++)
+	{
+		stage_latency[i][stats_bucket(current[i])]++;
+		total += current[i];
+	}
+	request_latency[stats_bucket(total)]++;
+	request_count++;
+
+	if (total > slow_threshold)
+	{
+		slow_count++;
+		if (trace_file != NULL)
+		{
+			write_slow(total);
+		}
+	}
+}
+
+/*
+ * Describe the stages of the requests traced in a sentence.
+ *
+ * Input:
+ *   response - a buffer to receive the description
+ *   n        - the size of the buffer
+ */
+void trace_report(char *response, int n)
+{
+	int len = snprintf(response, n, "I traced %llu requests, %llu slow. Half took under %llu ns, 99%% under %llu ns; by stage, 99%% under",
+					   request_count, slow_count, stats_percentile(request_latency, 0.5), stats_percentile(request_latency, 0.99));
+
+	for (int i = 0; i < TRACE_STAGES && len > 0 && len < n; i++)
+	{
+		len += snprintf(response + len, n - len, "%s %s %llu", i == 0 ? "" : ",", stage_names[i], stats_percentile(stage_latency[i], 0.99));
+	}
+	if (len > 0 && len < n)
+	{
+		snprintf(response + len, n - len, " ns.");
+	}
+}